@@ -0,0 +1,67 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+/*
+ * Append-only binary chat log, split into numbered segments PREFIX.000000,
+ * PREFIX.000001, ... Each segment starts with a fixed header; records are
+ * little-endian:
+ *
+ *   u32 body length, u32 FNV-1a of the body,
+ *   body: u64 seq, i64 timestamp, u8 sender len, u8 target len, u16 text len,
+ *         u8 room len, sender, target, room, text (no terminators)
+ *
+ * Version 1 segments have no room length or room and are still readable.
+ */
+#define BINLOG_MAGIC "CHATLOG"
+#define BINLOG_VERSION 2
+#define BINLOG_HEADER_SIZE 24
+#define BINLOG_RECORD_HEAD 8
+#define BINLOG_BODY_FIXED 21
+#define BINLOG_BODY_FIXED_V1 20
+#define BINLOG_RECORD_MAX (BINLOG_RECORD_HEAD + BINLOG_BODY_FIXED + 2 * USERNAME_MAX + ROOM_MAX + TEXT_MAX)
+#define BINLOG_PATH_MAX 512
+
+/* When the writer makes appended records durable */
+typedef enum {
+    LOG_SYNC_NONE = 0,     /* leave it to the kernel */
+    LOG_SYNC_INTERVAL = 1, /* fdatasync at most every N ms while records are pending */
+    LOG_SYNC_COUNT = 2     /* fdatasync after every N records */
+} LogSyncPolicy;
+
+/* Opaque pointer - writer for the newest segment. Single-threaded. */
+typedef struct BinLog BinLog;
+
+/* Opens the newest segment for PREFIX, dropping a torn record at its tail,
+ * or starts segment 0. Rolls to a new segment past segment_size bytes. */
+BinLog *binlog_open(const char *prefix, size_t segment_size);
+int binlog_append(BinLog *log, const ChatMessage *msgs, size_t n); /* one write per call; 0 or -1 */
+int binlog_sync(BinLog *log);
+uint64_t binlog_last_seq(const BinLog *log);
+void binlog_close(BinLog *log);
+
+/* Opaque pointer - sequential reader for one segment file */
+typedef struct BinLogReader BinLogReader;
+
+int binlog_segment_path(const char *prefix, unsigned index, char *buf, size_t cap);
+BinLogReader *binlog_reader_open(const char *path); /* NULL if missing or not a segment */
+int binlog_reader_next(BinLogReader *reader, uint64_t *seq, ChatMessage *msg); /* 1 record, 0 end, -1 corrupt */
+long binlog_reader_offset(const BinLogReader *reader); /* end of the last good record */
+void binlog_reader_close(BinLogReader *reader);
+
+/* Opaque pointer - random access to every record of PREFIX's segments through
+ * read-only mappings and one offset per record. Records appended since, and new
+ * segments, are picked up by binlog_index_refresh. Not thread-safe. */
+typedef struct BinLogIndex BinLogIndex;
+
+BinLogIndex *binlog_index_open(const char *prefix);
+int binlog_index_refresh(BinLogIndex *index); /* 0, or -1 if a segment could not be mapped */
+size_t binlog_index_count(const BinLogIndex *index);
+int binlog_index_get(const BinLogIndex *index, size_t i, uint64_t *seq, ChatMessage *msg); /* 0 or -1 */
+void binlog_index_close(BinLogIndex *index);
+
+#endif
@@ -2,18 +2,23 @@
 #define CHAT_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #define USERNAME_MAX 32
 #define TEXT_MAX 256
+#define ROOM_MAX 32 /* including the leading '#' */
 #define SOCKET_PATH "/tmp/pos_chat.sock"
 #define DEFAULT_TCP_PORT "5555"
 
 typedef struct ChatMessage {
     char sender[USERNAME_MAX];
     char target[USERNAME_MAX]; /* empty means broadcast */
+    char room[ROOM_MAX];       /* "#name" for room messages, empty otherwise */
     char text[TEXT_MAX];
     time_t timestamp;
+    uint64_t received_ns;      /* server only: monotonic time it came in, never sent */
+    uint64_t trace_id;         /* server only: flight recorder id, 0 if untraced */
 } ChatMessage;
 
 int send_all(int fd, const void *buf, size_t len);
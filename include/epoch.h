@@ -0,0 +1,19 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation for data that readers walk without a lock. A reader
+ * brackets its walk with epoch_enter/epoch_exit; a writer unlinks an object so
+ * that new readers cannot reach it and hands it to epoch_retire, which frees it
+ * once every reader that might still hold it has left its section. Readers
+ * never wait; sections should be short, since they hold back reclamation.
+ */
+typedef void (*EpochFreeFn)(void *ptr);
+
+void epoch_enter(void); /* not reentrant */
+void epoch_exit(void);
+void epoch_retire(void *ptr, EpochFreeFn fn); /* fn(ptr) later, on some writer's thread */
+void epoch_reclaim(void);  /* frees whatever no reader can see any more */
+void epoch_shutdown(void); /* frees everything; no reader may be left */
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+/* Runs fn(arg, first, end) over consecutive chunks of [0, items) */
+typedef void (*FanoutFn)(void *arg, size_t first, size_t end);
+
+/* Opaque pointer - a pool of delivery workers shared by every submitter. */
+typedef struct FanoutPool FanoutPool;
+
+/* Opaque pointer - one submitter's reusable job. The chunks are dealt out in
+ * contiguous runs, one per worker and one for the submitter; each takes from
+ * the front of its own run and, once that is empty, steals from the back of
+ * another's. */
+typedef struct FanoutJob FanoutJob;
+
+FanoutPool *fanout_create(int workers); /* NULL on failure */
+void fanout_destroy(FanoutPool *pool);  /* waits for the workers; no job may be running */
+int fanout_workers(const FanoutPool *pool);
+
+FanoutJob *fanout_job_create(FanoutPool *pool);
+void fanout_job_destroy(FanoutJob *job);
+/* Returns once every chunk has run, on the caller or a worker; the number of
+ * chunks that were stolen */
+size_t fanout_run(FanoutJob *job, size_t items, size_t chunk, FanoutFn fn, void *arg);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define FRAME_POOL_CAPACITY 512 /* frames up to this size come from frame_pool() */
+
+/* An encoded wire frame shared by every outbound queue it is fanned out to.
+ * Filled in once by its creator, immutable afterwards, freed with the last reference. */
+typedef struct SharedFrame {
+    atomic_uint refs;
+    uint64_t born_ns; /* receive time of the message it carries, 0 if unknown */
+    uint64_t trace_id; /* flight recorder id of that message, 0 if untraced */
+    size_t len;
+    int pooled; /* private to frame.c */
+    unsigned char data[];
+} SharedFrame;
+
+SharedFrame *frame_alloc(size_t capacity); /* one reference, len 0 */
+SharedFrame *frame_create(const void *data, size_t len);
+SharedFrame *frame_ref(SharedFrame *frame);
+void frame_unref(SharedFrame *frame);
+ObjectPool *frame_pool(void); /* lives as long as the process */
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+#include "server.h"
+
+/*
+ * Hot restart. A new server started with --takeover PATH connects to the old
+ * server's admin socket and sends "takeover". The old server answers with
+ * HANDOFF_HELLO while still serving, and goes on only once the new one has
+ * checked it and sent HANDOFF_ACK. Then it stops its reactors, lets its
+ * dispatchers deliver what is left in the inboxes, closes the chat log and
+ * streams its state over that connection as records:
+ *
+ *   header: u32 type, u32 payload length, then the payload
+ *
+ * in host byte order. A record that carries a descriptor has it attached with
+ * SCM_RIGHTS to the header. The new server answers HANDOFF_END with a second
+ * HANDOFF_ACK, and only then does the old process let go and exit; if the
+ * stream breaks or no ack comes within HANDOFF_ACK_TIMEOUT_MS, it reopens the
+ * chat log and keeps serving.
+ */
+#define HANDOFF_MAGIC "CHATHOF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_REQUEST "takeover"
+#define HANDOFF_RECORD_MAX (16 * 1024 * 1024)
+#define HANDOFF_ACK_TIMEOUT_MS 5000
+
+typedef enum {
+    HANDOFF_HELLO = 1, /* char magic[8], u32 version */
+    HANDOFF_LISTENER,  /* a listening socket; no payload */
+    HANDOFF_CLIENT,    /* a client socket; HandoffClient, input, frames */
+    HANDOFF_END,
+    HANDOFF_ACK        /* new server to old: hello accepted, or everything received; no payload */
+} HandoffType;
+
+/* Fixed part of a HANDOFF_CLIENT payload. inlen bytes of unparsed input follow,
+ * then each queued frame as a u32 length and its bytes. */
+typedef struct HandoffClient {
+    char username[USERNAME_MAX]; /* empty while the hello is still outstanding */
+    char rooms[CLIENT_ROOMS_MAX][ROOM_MAX];
+    int32_t proto;
+    int32_t shard;
+    int32_t room_count;
+    int32_t lagging;
+    uint64_t dropped;
+    uint64_t lag_dropped;
+    uint32_t inlen;
+    uint32_t frames;
+    uint32_t head_off; /* bytes of the first frame the client already has */
+    uint32_t reserved;
+} HandoffClient;
+
+typedef struct HandoffRecord {
+    uint32_t type;
+    int fd;              /* -1 if the record carried none */
+    size_t len;
+    unsigned char *data; /* malloc'd payload, NULL if empty */
+} HandoffRecord;
+
+int handoff_send(int sock, uint32_t type, const void *data, size_t len, int fd); /* fd -1 for none; 0 or -1 */
+int handoff_recv(int sock, HandoffRecord *rec); /* blocking; 0 or -1 */
+void handoff_release(HandoffRecord *rec);       /* frees the payload, closes an unclaimed fd */
+int handoff_wait_ack(int sock, int timeout_ms); /* 0 once a HANDOFF_ACK arrives, -1 on anything else */
+
+#endif
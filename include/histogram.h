@@ -0,0 +1,25 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Opaque pointer - log-linear histogram of unsigned values (latencies in ns).
+ * Every power of two is split into 64 buckets, so a reported percentile is
+ * within about 1.5% of the true value. One thread records into a histogram;
+ * others may merge or read it meanwhile. Keep one per thread and merge them
+ * when reporting. */
+typedef struct Histogram Histogram;
+
+Histogram *hist_create(void);
+void hist_destroy(Histogram *hist);
+
+void hist_record(Histogram *hist, uint64_t value);
+void hist_merge(Histogram *dst, const Histogram *src);
+void hist_reset(Histogram *hist);
+
+uint64_t hist_count(const Histogram *hist);
+uint64_t hist_max(const Histogram *hist);
+double hist_mean(const Histogram *hist);
+uint64_t hist_percentile(const Histogram *hist, double pct); /* pct in 0..100; 0 if empty */
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+#define HISTORY_ROOMS_MAX 256 /* room rings kept; the one written longest ago makes way */
+
+/* Opaque pointer - the last few messages of the lobby and of each room, each in a
+ * fixed ring. Every message added gets the next sequence number.
+ * Not thread-safe: callers serialize access with their own lock. */
+typedef struct History History;
+
+History *history_create(size_t depth);
+void history_destroy(History *history);
+
+void history_add(History *history, const ChatMessage *msg); /* into msg->room's ring, "" is the lobby */
+uint64_t history_last(const History *history);              /* newest sequence number, 0 if none */
+/* Up to max of the newest messages of room numbered above after, oldest first */
+size_t history_since(const History *history, const char *room, uint64_t after, ChatMessage *out, size_t max);
+
+#endif
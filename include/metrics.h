@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process-wide server metrics. Every thread records into its own slot, made on
+ * first use, so the hot paths never write to a cache line another thread
+ * writes. Reports sum the slots; slots of exited threads are folded into a
+ * retired total.
+ */
+
+/* Event counters */
+typedef enum {
+    MET_ACCEPTED = 0,    /* connections accepted */
+    MET_DISCONNECTED,    /* users removed */
+    MET_MSGS_IN,         /* messages and commands read from clients */
+    MET_MSGS_DISPATCHED, /* messages taken off shard inboxes */
+    MET_FRAMES_QUEUED,   /* frames put on outbound queues */
+    MET_FRAMES_DROPPED,  /* frames dropped by --outq-policy */
+    MET_OUTQ_KICKS,      /* clients disconnected for a full outbound queue */
+    MET_FLUSHES,         /* flushes of a non-empty outbound queue */
+    MET_SEND_BLOCKED,    /* flushes that left data for later */
+    MET_SEND_ERRORS,     /* flushes that failed with a socket error */
+    MET_URING_ENTERS,    /* io_uring_enter calls of --io uring reactors */
+    MET_URING_SQES,      /* requests they submitted */
+    MET_HISTORY_REPLAYED, /* scrollback messages queued on join and by /history */
+    MET_FANOUT_PARALLEL, /* dispatcher batches split across the fan-out workers */
+    MET_FANOUT_STEALS,   /* chunks a fan-out worker or dispatcher took from another's run */
+    MET_RATE_DROPPED,    /* messages dropped over a client's --rate-limit */
+    MET_RATE_WARNED,     /* warnings sent to clients over the limit */
+    MET_RATE_PAUSED,     /* times a client's reads were paused for RATE_PAUSE_MS */
+    MET_RATE_KICKED,     /* clients disconnected for flooding */
+    MET_LOG_RECORDS,     /* records appended to the chat log */
+    MET_LOG_WRITES,      /* group-commit writes */
+    MET_LOG_SYNCS,
+    MET_LOG_ERRORS,
+    MET_COUNTER_COUNT
+} MetricCounter;
+
+/* Latency histograms, in nanoseconds */
+typedef enum {
+    MET_LAT_QUEUE = 0, /* read from a client -> taken off a shard inbox */
+    MET_LAT_DISPATCH,  /* one dispatcher batch: encode, queue, first flush */
+    MET_LAT_WRITE,     /* read from a client -> written to a recipient's socket */
+    MET_LAT_LOG,       /* read from a client -> written to the chat log */
+    MET_HIST_COUNT
+} MetricHist;
+
+typedef size_t (*MetricGaugeFn)(void *arg);
+
+uint64_t metrics_now(void); /* CLOCK_MONOTONIC in ns, the clock of every latency */
+void metrics_count(MetricCounter counter, uint64_t n);
+void metrics_observe(MetricHist hist, uint64_t ns);
+void metrics_observe_since(MetricHist hist, uint64_t start_ns); /* no-op for start 0 */
+
+/* Gauges are sampled when a report is made; register them before serving. */
+int metrics_add_gauge(const char *name, MetricGaugeFn fn, void *arg);
+
+char *metrics_render(int json); /* malloc'd report, plain text or JSON; NULL on failure */
+void metrics_shutdown(void);    /* frees everything once no other thread records */
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "shm.h"
+
+#define OUTQ_DEFAULT_CAPACITY 1024 /* frames */
+
+/* What to do when a client's outbound queue is full */
+typedef enum {
+    OUTQ_DISCONNECT = 0,  /* drop the connection */
+    OUTQ_DROP_OLDEST = 1, /* discard the oldest queued frame */
+    OUTQ_LAG = 2          /* stop queueing until the client catches up */
+} OutqPolicy;
+
+/* Opaque pointer - bounded FIFO of shared frames waiting to be written to one socket.
+ * Not thread-safe: callers serialize access with their own lock. */
+typedef struct OutQueue OutQueue;
+
+OutQueue *outq_create(size_t capacity);
+void outq_destroy(OutQueue *queue);
+
+int outq_push(OutQueue *queue, SharedFrame *frame); /* takes its own reference; 0 on success, -1 if full */
+int outq_drop_oldest(OutQueue *queue); /* skips frames already on the wire; 0 on success, -1 if nothing to drop */
+int outq_flush(OutQueue *queue, int fd); /* non-blocking; 1 drained, 0 would block, -1 socket error */
+int outq_flush_shm(OutQueue *queue, ShmChannel *ch); /* same, into a shared-memory ring */
+
+/* Asynchronous writes: the frames in iov stay queued, and outq_drop_oldest leaves them
+ * alone, until outq_complete reports how many bytes were taken. */
+size_t outq_peek_iov(OutQueue *queue, struct iovec *iov, size_t max);
+void outq_complete(OutQueue *queue, size_t bytes);
+size_t outq_depth(const OutQueue *queue);
+const SharedFrame *outq_head(const OutQueue *queue); /* oldest queued frame, NULL if empty */
+const SharedFrame *outq_at(const OutQueue *queue, size_t i); /* i-th oldest, NULL past the end */
+size_t outq_head_offset(const OutQueue *queue); /* bytes of the head frame already written */
+
+#endif
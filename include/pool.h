@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_MAX 16 /* pools per process */
+
+/* Opaque pointer - fixed-size objects carved out of slabs. Each thread keeps a
+ * small cache per pool and only takes the pool mutex to move a batch between
+ * its cache and the shared free list, so an object may be freed on any thread.
+ * A pool lives as long as the process: its slabs never go back to the system,
+ * they wait on the free list for the next burst. */
+typedef struct ObjectPool ObjectPool;
+
+typedef struct PoolStats {
+    size_t object_size; /* rounded up to a cache line */
+    size_t slabs;
+    size_t objects;     /* carved out of slabs so far */
+    size_t outstanding; /* allocated and not freed yet; thread caches do not count */
+    size_t high_water;  /* most outstanding seen at once, sampled whenever a thread
+                           cache trades with the shared list and on every pool_stats */
+} PoolStats;
+
+ObjectPool *pool_create(const char *name, size_t object_size); /* NULL on failure or once POOL_MAX exist */
+
+void *pool_alloc(ObjectPool *pool); /* contents undefined; NULL if out of memory */
+void pool_free(ObjectPool *pool, void *obj);
+
+void pool_stats(ObjectPool *pool, PoolStats *out);
+const char *pool_name(const ObjectPool *pool);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat.h"
+
+/*
+ * Wire protocol versions.
+ *
+ * v1 (legacy) frames are a raw LegacyMessage dump, host-endian time_t.
+ * v2 frames are length-prefixed and only as long as their contents:
+ *
+ *   varint  body length (everything after this prefix)
+ *   u8      frame type
+ *   u8      flags (reserved, 0)
+ *   varint  timestamp, seconds since the epoch
+ *   varint  sender length, sender bytes
+ *   varint  target length, target bytes (0 = broadcast)
+ *   varint  text length, text bytes
+ *
+ * v3 appends one more field to the v2 body:
+ *
+ *   varint  room length, room bytes (0 = not a room message)
+ *
+ * Peers below v3 have no room field; room messages reach them with the room
+ * name prefixed to the text instead, and a broadcast from them whose text
+ * starts with "#room " is decoded as a message to that room.
+ *
+ * Varints are unsigned LEB128. Every connection starts with a v1 hello whose
+ * text carries "proto=N"; a server that speaks v2 answers with a v1 SYSTEM
+ * frame "proto=N" naming the version both sides use from then on. Peers that
+ * never mention a version stay on v1.
+ *
+ * On a UNIX socket a v2+ hello may end in " shm" to ask for the shared-memory
+ * transport (include/shm.h). A server that grants it acks "proto=N shm" and
+ * passes the shared memory right after; all later frames use the rings.
+ */
+#define PROTO_LEGACY 1
+#define PROTO_V2 2
+#define PROTO_V3 3
+#define PROTO_MAX_VERSION PROTO_V3
+
+#define PROTO_HELLO_TAG "proto="
+#define PROTO_SHM_TAG " shm"
+#define PROTO_VARINT_MAX 10
+/* Largest body accepted from a peer: a v3 message with every field full. A field
+ * longer than ChatMessage holds is refused, never truncated. */
+#define PROTO_MAX_FRAME (2 + PROTO_VARINT_MAX + 2 * USERNAME_MAX + (1 + TEXT_MAX) + ROOM_MAX)
+#define PROTO_MAX_ENCODED 512    /* room for any encoded ChatMessage */
+#define PROTO_TOO_LONG -2        /* proto_decode: well-formed, but a field does not fit */
+
+typedef enum {
+    FRAME_MSG = 1
+} FrameType;
+
+/* The v1 frame: ChatMessage as it was before rooms, kept byte-for-byte */
+typedef struct LegacyMessage {
+    char sender[USERNAME_MAX];
+    char target[USERNAME_MAX];
+    char text[TEXT_MAX];
+    time_t timestamp;
+} LegacyMessage;
+
+size_t varint_encode(uint64_t value, unsigned char *out);
+int varint_decode(const unsigned char *buf, size_t len, uint64_t *value, size_t *used); /* 1 ok, 0 short, -1 bad */
+
+/* 1 if buf starts with a complete frame (its size in *frame_len), 0 if more bytes are needed, -1 if malformed */
+int proto_frame_size(int version, const void *buf, size_t len, size_t *frame_len);
+/* 0 on success, -1 if malformed, PROTO_TOO_LONG if a field is longer than ChatMessage holds */
+int proto_decode(int version, const void *frame, size_t len, ChatMessage *out);
+size_t proto_encode(int version, const ChatMessage *msg, void *buf, size_t cap); /* bytes written, 0 if no room */
+
+/* Blocking helpers built on send_all/recv_all */
+int proto_send(int fd, int version, const ChatMessage *msg);
+int proto_recv(int fd, int version, ChatMessage *out); /* as proto_decode, -1 also on a socket error */
+
+/* Version requested in a hello (PROTO_LEGACY if none), and the server's answer */
+int proto_hello_version(const ChatMessage *hello);
+int proto_hello_shm(const ChatMessage *hello); /* 1 if the hello asks for shared memory */
+void proto_make_ack(ChatMessage *ack, int version, int shm);
+int proto_ack_version(const ChatMessage *msg); /* negotiated version, or 0 if msg is not an ack */
+int proto_ack_shm(const ChatMessage *ack);     /* 1 if the ack grants shared memory */
+
+#endif
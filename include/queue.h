@@ -1,20 +1,49 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <stddef.h>
+
 #include "chat.h"
+#include "pool.h"
+
+#define MQ_RING_DEFAULT_CAPACITY 4096
+
+/* Storage behind a MessageQueue; both share the API below */
+typedef enum {
+    MQ_BACKEND_LIST = 0, /* unbounded linked list, mutex + condvar */
+    MQ_BACKEND_RING = 1  /* preallocated lock-free MPSC ring; producers wait while it is full */
+} MQBackend;
+
+/* Priority classes of a queue made with mq_create_lanes */
+typedef enum {
+    MQ_LANE_SYSTEM = 0, /* notices and command replies */
+    MQ_LANE_PRIVATE,    /* direct messages */
+    MQ_LANE_BULK,       /* broadcasts and room traffic; plain mq_push lands here */
+    MQ_LANE_COUNT
+} MQLane;
 
 /* Opaque pointer - internal structure hidden from users */
 typedef struct MessageQueue MessageQueue;
 
 /* Create and destroy queue */
-MessageQueue *mq_create(void);
+MessageQueue *mq_create(void); /* list backend */
+MessageQueue *mq_create_backend(MQBackend backend, size_t capacity); /* capacity is rounded up to a power of two */
+/* One queue of the given backend per lane, each with its own capacity. A pop takes
+ * up to weights[lane] messages from each lane in turn, system first, and goes
+ * round again while there is room, so bulk traffic still moves under load.
+ * Messages keep their order within a lane only. */
+MessageQueue *mq_create_lanes(MQBackend backend, size_t capacity, const unsigned weights[MQ_LANE_COUNT]);
 void mq_destroy(MessageQueue *queue);
 
 /* Queue operations */
 void mq_push(MessageQueue *queue, const ChatMessage *msg);
-int mq_pop(MessageQueue *queue, ChatMessage *out); /* returns 0 on success, -1 if closed */
+void mq_push_lane(MessageQueue *queue, MQLane lane, const ChatMessage *msg); /* lane is ignored without lanes */
+int mq_pop(MessageQueue *queue, ChatMessage *out); /* returns 0 on success, -1 if closed; single consumer for rings */
+int mq_pop_batch(MessageQueue *queue, ChatMessage *out, size_t max); /* blocks for one, takes up to max; count or -1 if closed */
+int mq_pop_batch_timed(MessageQueue *queue, ChatMessage *out, size_t max, int timeout_ms); /* as above, 0 on timeout */
 void mq_close(MessageQueue *queue);
+void mq_reopen(MessageQueue *queue); /* undoes mq_close; only once no consumer is left waiting */
+size_t mq_depth(MessageQueue *queue); /* messages waiting; approximate while producers run */
+ObjectPool *mq_node_pool(void); /* shared by the list backend of every queue; lives as long as the process */
 
 #endif
-
-
@@ -0,0 +1,23 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stddef.h>
+
+#include "chat.h"
+
+/* Opaque pointer - room name -> compact array of member pointers. Rooms are
+ * created by their first join and freed when the last member parts.
+ * Not thread-safe: callers serialize access with their own lock. */
+typedef struct RoomTable RoomTable;
+
+RoomTable *rooms_create(void);
+void rooms_destroy(RoomTable *table);
+
+int rooms_join(RoomTable *table, const char *room, void *member); /* 0 joined, 1 already in, -1 no memory */
+int rooms_part(RoomTable *table, const char *room, void *member); /* 0 on success, -1 if not a member */
+/* Members of room (NULL if it does not exist); valid until the next join or part. */
+void *const *rooms_members(const RoomTable *table, const char *room, size_t *count);
+
+int room_name_valid(const char *room); /* "#" followed by 1..ROOM_MAX-2 printable, non-space chars */
+
+#endif
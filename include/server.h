@@ -3,13 +3,54 @@
 
 #include "chat.h"
 
-#define BACKLOG 16
+#define BACKLOG 4096 /* default --backlog; the kernel caps it at net.core.somaxconn */
+#define HANDSHAKE_TIMEOUT_MS 5000 /* a new connection must send its hello within this */
+#define ACCEPT_BATCH 16 /* connections taken from a shared listener per wakeup */
+#define JOIN_DIGEST_MS 200 /* join notices closer together than this are announced in one message */
+#define EPOCH_RECLAIM_MS 1000 /* the watchdog frees retired memory at least this often */
 #define PORT_STR_LEN 16
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_BUDGET 32 /* frames per client per wakeup */
+#define URING_SEND_IOV 128 /* frames per io_uring sendmsg */
+#define WHO_MAX_ENTRIES 32
+#define CLIENT_ROOMS_MAX 16
+#define ADMIN_REQUEST_MAX 64
+#define ADMIN_REQUEST_TIMEOUT_MS 200
+#define DISPATCH_BATCH 64
+#define LANE_WEIGHTS_DEFAULT {8, 4, 1} /* default --lane-weights: system, private, bulk messages per inbox round */
+#define FANOUT_WORKERS_DEFAULT 4 /* default --fanout-workers; 0 delivers every broadcast on its dispatcher */
+#define FANOUT_WORKERS_MAX 64
+#define FANOUT_THRESHOLD_DEFAULT 1024 /* default --fanout-threshold: recipients from which a broadcast is split up */
+#define FANOUT_CHUNK 128 /* recipients per chunk of a split broadcast */
+#define RATE_LIMIT_DEFAULT 50 /* default --rate-limit: messages per second a client may keep up; 0 is unlimited */
+#define RATE_BURST_DEFAULT 100 /* default --rate-burst: messages a quiet client may send at once */
+#define RATE_MAX 1000000
+#define RATE_STRIKES 10 /* messages dropped over the limit before reads are paused */
+#define RATE_PAUSE_MS 1000
+#define RATE_PAUSES_MAX 3 /* pauses before a client that keeps flooding is disconnected */
+#define RATE_PAUSE_INPUT_MAX (1024 * 1024) /* io_uring mode: input received before a pause took effect is kept up to this */
+#define SHARDS_MAX 64
+#define LOG_BATCH 256
+#define LOG_PREFIX "chat.log" /* binary segments chat.log.000000, ... */
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define TRACE_FILE "chat.trace" /* flight recorder dumps */
+#define INBUF_INITIAL 512 /* per-connection read buffer, grows for large frames */
+#define HISTORY_DEFAULT 50 /* default --history: messages per lobby or room ring replayed on join */
+#define HISTORY_SEED_RECORDS 10000 /* chat log records read back into the rings at startup */
+#define HISTORY_PAGE_DEFAULT 20 /* /history without a count */
+#define HISTORY_PAGE_MAX 200
+#define HISTORY_SCAN_MAX 100000 /* log records one /history looks at */
 
 typedef enum {
     MODE_UNIX = 0,
     MODE_TCP = 1
 } ServerMode;
 
+typedef enum {
+    IO_EPOLL = 0,   /* single reactor thread, non-blocking sockets */
+    IO_THREADS = 1, /* legacy: one blocking thread per client */
+    IO_URING = 2    /* reactor on io_uring; epoll if the kernel lacks it */
+} IoMode;
+
 #endif
 
@@ -0,0 +1,51 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Shared-memory transport for clients on the same host. After the hello on
+ * the UNIX socket the server creates a sealed memfd holding two single-producer
+ * single-consumer byte rings, client->server and server->client, and one
+ * eventfd per side, and passes all three with SCM_RIGHTS.
+ *
+ * The rings carry the same v2/v3 frames the socket would. An eventfd is only
+ * written when the other side said it was about to sleep: a reader that found
+ * its ring empty, or a writer that found it full. Each side keeps its own ring
+ * positions privately and only publishes them, so a misbehaving peer can stop
+ * its own connection but not make the other side read out of bounds.
+ *
+ * The socket stays open for the life of the connection; closing it is how
+ * either side hangs up.
+ */
+#define SHM_MAGIC "CHATSHM"
+#define SHM_VERSION 1
+#define SHM_RING_SIZE (64 * 1024) /* bytes per direction, a power of two */
+
+/* Opaque pointer - one end of a shared-memory connection */
+typedef struct ShmChannel ShmChannel;
+
+ShmChannel *shm_create(size_t ring_size); /* server end */
+int shm_send(const ShmChannel *ch, int sock); /* passes the descriptors to the client; 0 or -1 */
+ShmChannel *shm_receive(int sock);        /* client end, from the descriptors shm_send passed */
+void shm_destroy(ShmChannel *ch);
+
+int shm_wait_fd(const ShmChannel *ch);    /* readable once the peer rang this end */
+void shm_clear(ShmChannel *ch);           /* consume a ring of the doorbell */
+void shm_ring_self(ShmChannel *ch);       /* leave work for the next wakeup */
+
+/* Bytes moved, 0 if the ring is empty / full, -1 if the peer corrupted it */
+ssize_t shm_read(ShmChannel *ch, void *buf, size_t cap);
+ssize_t shm_writev(ShmChannel *ch, const struct iovec *iov, int count);
+ssize_t shm_write(ShmChannel *ch, const void *buf, size_t len);
+
+/* Ask the peer for a doorbell before sleeping; 1 if there is already something to do */
+int shm_arm_readable(ShmChannel *ch);
+int shm_arm_writable(ShmChannel *ch);
+
+/* Client: sleep until data arrives (1) or sock becomes readable or hangs up (0); -1 on error */
+int shm_wait(ShmChannel *ch, int sock);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Timer Timer;
+typedef void (*TimerFn)(Timer *timer, uint64_t now);
+
+/* Intrusive timer - embed in the owning object. Fields are private to the wheel. */
+struct Timer {
+    Timer *next;
+    Timer **pprev; /* NULL while not scheduled */
+    uint64_t expires;
+    TimerFn fn;
+};
+
+/* Opaque pointer - hierarchical timing wheel with 1 ms ticks. Scheduling and
+ * cancelling are O(1); advancing costs one step per expired or cascaded timer.
+ * Not thread-safe: callers serialize access with their own lock. */
+typedef struct TimerWheel TimerWheel;
+
+TimerWheel *tw_create(uint64_t now);
+void tw_destroy(TimerWheel *wheel); /* pending timers are simply forgotten */
+
+void timer_init(Timer *timer, TimerFn fn);
+int timer_pending(const Timer *timer);
+
+void tw_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires); /* moves it if already pending */
+void tw_cancel(TimerWheel *wheel, Timer *timer);
+size_t tw_advance(TimerWheel *wheel, uint64_t now); /* runs fn of every timer due by now; may reschedule */
+long tw_next_timeout(const TimerWheel *wheel, uint64_t now); /* ms worth sleeping, -1 if nothing is pending */
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Flight recorder: every thread appends (time, message id, stage, shard)
+ * events to its own fixed-size ring, overwriting the oldest. Nothing is
+ * shared on the recording path. A dump copies every ring into one file:
+ *
+ *   header: char magic[8] "CHATTRC", u32 version, u32 event size, u64 count
+ *   events: u64 time ns (CLOCK_MONOTONIC), u64 id, u32 stage, u32 shard
+ *
+ * in host byte order. ./chattrace turns a dump into per-stage percentiles.
+ */
+#define TRACE_MAGIC "CHATTRC"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 24
+#define TRACE_NO_SHARD UINT32_MAX
+
+typedef enum {
+    TRACE_RECV = 1, /* read from a client */
+    TRACE_ROUTED,   /* pushed to the shard inboxes */
+    TRACE_DEQUEUED, /* taken off a shard inbox */
+    TRACE_LOCKED,   /* the dispatcher holds the shard mutex */
+    TRACE_FANNED,   /* the whole batch is queued and flushed on the shard */
+    TRACE_WRITTEN,  /* a flush emptied a recipient's queue up to the frame */
+    TRACE_LOGGED,   /* written to the chat log */
+    TRACE_STAGE_END
+} TraceStage;
+
+typedef struct TraceEvent {
+    uint64_t ts;
+    uint64_t id;
+    uint32_t stage;
+    uint32_t shard;
+} TraceEvent;
+
+int trace_init(size_t events_per_thread); /* 0 leaves tracing off; -1 on bad size */
+int trace_enabled(void);
+uint64_t trace_next_id(void); /* unique per message; 0 while tracing is off */
+void trace_event(uint64_t id, TraceStage stage, uint32_t shard); /* ignores id 0 */
+int trace_dump(const char *path); /* replaces path atomically; 0 or -1 */
+void trace_shutdown(void);
+
+#endif
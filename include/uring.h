@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Just enough io_uring for the server's --io uring reactor, on raw syscalls:
+ * multishot accept, multishot recv into a ring of provided buffers, sendmsg,
+ * read and cancel. Requests are only handed to the kernel by
+ * uring_submit_and_wait, so everything prepared in one loop turn costs a
+ * single io_uring_enter. A ring belongs to one thread.
+ */
+#define URING_ENTRIES 1024
+#define URING_BUF_COUNT 512   /* provided receive buffers per ring, a power of two */
+#define URING_BUF_SIZE 4096
+
+/* Opaque pointer - a submission/completion queue pair plus its receive buffers */
+typedef struct Uring Uring;
+
+typedef struct UringCompletion {
+    uint64_t data;  /* as given when the request was prepared */
+    int32_t res;    /* result, or -errno */
+    uint32_t flags; /* IORING_CQE_F_* */
+} UringCompletion;
+
+int uring_probe(void); /* 0 if the kernel has everything used here; -1 with errno otherwise */
+Uring *uring_create(unsigned entries);
+void uring_destroy(Uring *ring);
+
+/* Each returns 0, or -1 if the request could not be queued */
+int uring_prep_accept(Uring *ring, int fd, uint64_t data);  /* multishot */
+int uring_prep_recv(Uring *ring, int fd, uint64_t data);    /* multishot, into a provided buffer */
+int uring_prep_sendmsg(Uring *ring, int fd, const struct msghdr *mh, uint64_t data);
+int uring_prep_read(Uring *ring, int fd, void *buf, size_t len, uint64_t data);
+int uring_prep_cancel(Uring *ring, uint64_t target, uint64_t data); /* the request prepared with target */
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr); /* requests submitted, -1 on error */
+size_t uring_reap(Uring *ring, UringCompletion *out, size_t max);
+int uring_more(const UringCompletion *cqe); /* a multishot request is still armed */
+
+/* A recv completion's data; hand the buffer back once consumed */
+const void *uring_buffer(const Uring *ring, const UringCompletion *cqe);
+void uring_recycle(Uring *ring, const UringCompletion *cqe);
+
+#endif
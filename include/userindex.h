@@ -0,0 +1,20 @@
+#ifndef USERINDEX_H
+#define USERINDEX_H
+
+#include <stddef.h>
+
+#include "chat.h"
+
+/* Opaque pointer - open-addressing hash map from username to an arbitrary pointer.
+ * Not thread-safe: callers serialize access with their own lock. */
+typedef struct UserIndex UserIndex;
+
+UserIndex *ui_create(size_t expected);
+void ui_destroy(UserIndex *index);
+
+int ui_insert(UserIndex *index, const char *name, void *value); /* 0 on success, -1 if taken or no memory */
+void *ui_lookup(const UserIndex *index, const char *name);      /* NULL if absent */
+int ui_remove(UserIndex *index, const char *name, const void *value); /* only if mapped to value; 0 on success */
+size_t ui_count(const UserIndex *index);
+
+#endif
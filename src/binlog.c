@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "binlog.h"
+
+#define BINLOG_WRITE_BUFFER 65536
+
+/* Internal writer structure - not exposed in header */
+struct BinLog {
+    char prefix[BINLOG_PATH_MAX];
+    unsigned index;      /* current segment number */
+    int fd;
+    size_t size;         /* bytes in the current segment */
+    size_t segment_size;
+    uint64_t seq;        /* last sequence number written */
+    unsigned char *buf;  /* records of one append, written together */
+};
+
+/* Internal reader structure - not exposed in header */
+struct BinLogReader {
+    FILE *fp;
+    long offset;
+    uint32_t version; /* of this segment's records */
+    uint64_t first_seq; /* from the header: the seq its first record gets */
+};
+
+static void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint32_t checksum(const unsigned char *p, size_t len) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t encode_record(uint64_t seq, const ChatMessage *msg, unsigned char *buf) {
+    size_t slen = strnlen(msg->sender, USERNAME_MAX - 1);
+    size_t tlen = strnlen(msg->target, USERNAME_MAX - 1);
+    size_t xlen = strnlen(msg->text, TEXT_MAX - 1);
+    size_t rlen = strnlen(msg->room, ROOM_MAX - 1);
+    unsigned char *body = buf + BINLOG_RECORD_HEAD;
+
+    put_u64(body, seq);
+    put_u64(body + 8, (uint64_t)(int64_t)msg->timestamp);
+    body[16] = (unsigned char)slen;
+    body[17] = (unsigned char)tlen;
+    put_u16(body + 18, (uint16_t)xlen);
+    body[20] = (unsigned char)rlen;
+    unsigned char *p = body + BINLOG_BODY_FIXED;
+    memcpy(p, msg->sender, slen);
+    p += slen;
+    memcpy(p, msg->target, tlen);
+    p += tlen;
+    memcpy(p, msg->room, rlen);
+    p += rlen;
+    memcpy(p, msg->text, xlen);
+    p += xlen;
+
+    size_t body_len = (size_t)(p - body);
+    put_u32(buf, (uint32_t)body_len);
+    put_u32(buf + 4, checksum(body, body_len));
+    return BINLOG_RECORD_HEAD + body_len;
+}
+
+static int decode_body(uint32_t version, const unsigned char *body, size_t len, uint64_t *seq,
+                       ChatMessage *msg) {
+    size_t fixed = version == 1 ? BINLOG_BODY_FIXED_V1 : BINLOG_BODY_FIXED;
+    if (len < fixed) {
+        return -1;
+    }
+    size_t slen = body[16];
+    size_t tlen = body[17];
+    size_t xlen = get_u16(body + 18);
+    size_t rlen = version == 1 ? 0 : body[20];
+    if (slen >= USERNAME_MAX || tlen >= USERNAME_MAX || xlen >= TEXT_MAX || rlen >= ROOM_MAX ||
+        fixed + slen + tlen + rlen + xlen != len) {
+        return -1;
+    }
+
+    memset(msg, 0, sizeof(ChatMessage));
+    *seq = get_u64(body);
+    msg->timestamp = (time_t)(int64_t)get_u64(body + 8);
+    const unsigned char *p = body + fixed;
+    memcpy(msg->sender, p, slen);
+    p += slen;
+    memcpy(msg->target, p, tlen);
+    p += tlen;
+    memcpy(msg->room, p, rlen);
+    p += rlen;
+    memcpy(msg->text, p, xlen);
+    return 0;
+}
+
+int binlog_segment_path(const char *prefix, unsigned index, char *buf, size_t cap) {
+    int n = snprintf(buf, cap, "%s.%06u", prefix, index);
+    return n < 0 || (size_t)n >= cap ? -1 : 0;
+}
+
+BinLogReader *binlog_reader_open(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    unsigned char header[BINLOG_HEADER_SIZE];
+    uint32_t version = 0;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) != 0 ||
+        (version = get_u32(header + 8)) < 1 || version > BINLOG_VERSION) {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    BinLogReader *reader = malloc(sizeof(BinLogReader));
+    if (!reader) {
+        fclose(fp);
+        return NULL;
+    }
+    reader->fp = fp;
+    reader->offset = BINLOG_HEADER_SIZE;
+    reader->version = version;
+    reader->first_seq = get_u64(header + 16);
+    return reader;
+}
+
+int binlog_reader_next(BinLogReader *reader, uint64_t *seq, ChatMessage *msg) {
+    unsigned char head[BINLOG_RECORD_HEAD];
+    unsigned char body[BINLOG_RECORD_MAX];
+    size_t got = fread(head, 1, sizeof(head), reader->fp);
+    if (got == 0 && feof(reader->fp)) {
+        return 0;
+    }
+    if (got != sizeof(head)) {
+        return -1;
+    }
+    size_t len = get_u32(head);
+    if (len > sizeof(body) || fread(body, 1, len, reader->fp) != len ||
+        checksum(body, len) != get_u32(head + 4) || decode_body(reader->version, body, len, seq, msg) < 0) {
+        return -1;
+    }
+    reader->offset += (long)(BINLOG_RECORD_HEAD + len);
+    return 1;
+}
+
+long binlog_reader_offset(const BinLogReader *reader) {
+    return reader->offset;
+}
+
+void binlog_reader_close(BinLogReader *reader) {
+    if (!reader) {
+        return;
+    }
+    fclose(reader->fp);
+    free(reader);
+}
+
+/* Internal mapped segment - not exposed in header */
+typedef struct IndexedSegment {
+    unsigned char *map;
+    size_t mapped;   /* bytes mapped, the file size when last looked at */
+    size_t scanned;  /* offset of the first record not yet indexed */
+    uint32_t version;
+} IndexedSegment;
+
+/* Internal index structure - an entry is segment << 32 | offset of a record */
+struct BinLogIndex {
+    char prefix[BINLOG_PATH_MAX];
+    IndexedSegment *segments;
+    size_t segment_count;
+    uint64_t *entries;
+    size_t count;
+    size_t cap;
+};
+
+BinLogIndex *binlog_index_open(const char *prefix) {
+    BinLogIndex *index = calloc(1, sizeof(BinLogIndex));
+    if (!index) {
+        return NULL;
+    }
+    snprintf(index->prefix, sizeof(index->prefix), "%s", prefix);
+    return index;
+}
+
+/* Map a segment again if it grew; segments are small enough for 32-bit offsets */
+static int map_segment(BinLogIndex *index, size_t n) {
+    char path[BINLOG_PATH_MAX];
+    if (binlog_segment_path(index->prefix, (unsigned)n, path, sizeof(path)) < 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+    IndexedSegment *seg = &index->segments[n];
+    size_t size = (size_t)st.st_size;
+    if (size == seg->mapped) {
+        close(fd);
+        return 0;
+    }
+    void *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (seg->map) {
+        munmap(seg->map, seg->mapped);
+    }
+    seg->map = map;
+    seg->mapped = size;
+    if (seg->scanned == 0 && size >= BINLOG_HEADER_SIZE && memcmp(map, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0) {
+        seg->version = get_u32(seg->map + 8);
+        seg->scanned = BINLOG_HEADER_SIZE;
+    }
+    return 0;
+}
+
+/* Index the complete records past seg->scanned; a torn tail waits for the next refresh */
+static int scan_segment(BinLogIndex *index, size_t n) {
+    IndexedSegment *seg = &index->segments[n];
+    if (seg->version < 1 || seg->version > BINLOG_VERSION) {
+        return 0;
+    }
+    while (seg->scanned + BINLOG_RECORD_HEAD <= seg->mapped) {
+        const unsigned char *head = seg->map + seg->scanned;
+        size_t len = get_u32(head);
+        if (len > BINLOG_RECORD_MAX || seg->scanned + BINLOG_RECORD_HEAD + len > seg->mapped ||
+            checksum(head + BINLOG_RECORD_HEAD, len) != get_u32(head + 4)) {
+            break;
+        }
+        if (index->count == index->cap) {
+            size_t new_cap = index->cap ? index->cap * 2 : 1024;
+            uint64_t *grown = realloc(index->entries, new_cap * sizeof(uint64_t));
+            if (!grown) {
+                return -1;
+            }
+            index->entries = grown;
+            index->cap = new_cap;
+        }
+        index->entries[index->count++] = (uint64_t)n << 32 | seg->scanned;
+        seg->scanned += BINLOG_RECORD_HEAD + len;
+    }
+    return 0;
+}
+
+int binlog_index_refresh(BinLogIndex *index) {
+    /* The newest known segment may have grown; later ones may have appeared */
+    size_t n = index->segment_count > 0 ? index->segment_count - 1 : 0;
+    for (;; n++) {
+        if (n == index->segment_count) {
+            char path[BINLOG_PATH_MAX];
+            struct stat st;
+            if (binlog_segment_path(index->prefix, (unsigned)n, path, sizeof(path)) < 0 || stat(path, &st) < 0) {
+                return 0;
+            }
+            IndexedSegment *grown = realloc(index->segments, (n + 1) * sizeof(IndexedSegment));
+            if (!grown) {
+                return -1;
+            }
+            index->segments = grown;
+            memset(&index->segments[n], 0, sizeof(IndexedSegment));
+            index->segment_count++;
+        }
+        if (map_segment(index, n) < 0 || scan_segment(index, n) < 0) {
+            return -1;
+        }
+    }
+}
+
+size_t binlog_index_count(const BinLogIndex *index) {
+    return index->count;
+}
+
+int binlog_index_get(const BinLogIndex *index, size_t i, uint64_t *seq, ChatMessage *msg) {
+    if (i >= index->count) {
+        return -1;
+    }
+    const IndexedSegment *seg = &index->segments[index->entries[i] >> 32];
+    const unsigned char *head = seg->map + (uint32_t)index->entries[i];
+    return decode_body(seg->version, head + BINLOG_RECORD_HEAD, get_u32(head), seq, msg);
+}
+
+void binlog_index_close(BinLogIndex *index) {
+    if (!index) {
+        return;
+    }
+    for (size_t i = 0; i < index->segment_count; i++) {
+        if (index->segments[i].map) {
+            munmap(index->segments[i].map, index->segments[i].mapped);
+        }
+    }
+    free(index->segments);
+    free(index->entries);
+    free(index);
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* The header goes into a temporary file that only appears under the segment's
+ * name once complete, so a crash cannot leave a segment without one. */
+static int create_segment(BinLog *log) {
+    char path[BINLOG_PATH_MAX];
+    char tmp[BINLOG_PATH_MAX + 8];
+    if (binlog_segment_path(log->prefix, log->index, path, sizeof(path)) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    unsigned char header[BINLOG_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, BINLOG_MAGIC, sizeof(BINLOG_MAGIC));
+    put_u32(header + 8, BINLOG_VERSION);
+    put_u64(header + 16, log->seq + 1); /* first sequence number in this segment */
+    /* link, unlike rename, fails rather than replace an existing segment */
+    if (write_full(fd, header, sizeof(header)) < 0 || fdatasync(fd) < 0 || link(tmp, path) < 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    unlink(tmp);
+    log->fd = fd;
+    log->size = sizeof(header);
+    return 0;
+}
+
+/* Reopen the newest existing segment for appending, after trimming a torn tail.
+ * A segment in an older format is only trimmed and a new one started. */
+static int resume_segment(BinLog *log, const char *path) {
+    BinLogReader *reader = binlog_reader_open(path);
+    if (!reader) {
+        return -1;
+    }
+    /* An empty segment still carries on the numbering of the ones before it */
+    if (reader->first_seq > 0) {
+        log->seq = reader->first_seq - 1;
+    }
+    uint64_t seq = 0;
+    ChatMessage msg;
+    while (binlog_reader_next(reader, &seq, &msg) == 1) {
+        log->seq = seq;
+    }
+    long good = binlog_reader_offset(reader);
+    uint32_t version = reader->version;
+    binlog_reader_close(reader);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, good) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (version != BINLOG_VERSION) {
+        close(fd);
+        log->index++;
+        return create_segment(log);
+    }
+    log->fd = fd;
+    log->size = (size_t)good;
+    return 0;
+}
+
+BinLog *binlog_open(const char *prefix, size_t segment_size) {
+    BinLog *log = calloc(1, sizeof(BinLog));
+    if (!log) {
+        return NULL;
+    }
+    log->buf = malloc(BINLOG_WRITE_BUFFER);
+    if (!log->buf) {
+        free(log);
+        return NULL;
+    }
+    snprintf(log->prefix, sizeof(log->prefix), "%s", prefix);
+    log->segment_size = segment_size;
+    log->fd = -1;
+
+    /* Segments are numbered without gaps; the last one that exists is current */
+    char path[BINLOG_PATH_MAX];
+    struct stat st;
+    unsigned found = 0;
+    while (binlog_segment_path(prefix, found, path, sizeof(path)) == 0 && stat(path, &st) == 0) {
+        found++;
+    }
+    /* A newest segment shorter than a header was cut off while being created, before
+     * any record went in: drop it and carry on from the one before */
+    while (found > 0) {
+        binlog_segment_path(prefix, found - 1, path, sizeof(path));
+        if (stat(path, &st) < 0 || st.st_size >= BINLOG_HEADER_SIZE || unlink(path) < 0) {
+            break;
+        }
+        found--;
+    }
+
+    int rc;
+    if (found > 0) {
+        log->index = found - 1;
+        rc = resume_segment(log, path);
+    } else {
+        rc = create_segment(log);
+    }
+    if (rc < 0) {
+        free(log->buf);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+/* Seal the current segment and start the next one. If that fails the current
+ * one stays open, so the next append tries again. */
+static int roll_segment(BinLog *log) {
+    int sealed = log->fd;
+    log->index++;
+    if (create_segment(log) < 0) {
+        log->index--;
+        return -1;
+    }
+    fdatasync(sealed);
+    close(sealed);
+    return 0;
+}
+
+/* A failed write is cut back off, since a partial record would hide every later one */
+static int write_buffer(BinLog *log, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (write_full(log->fd, log->buf, len) < 0) {
+        int saved = errno;
+        if (ftruncate(log->fd, (off_t)log->size) < 0) {
+            perror("binlog ftruncate");
+        }
+        errno = saved;
+        return -1;
+    }
+    log->size += len;
+    return 0;
+}
+
+/* log->seq only moves past records that were written */
+int binlog_append(BinLog *log, const ChatMessage *msgs, size_t n) {
+    uint64_t seq = log->seq;
+    size_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (used + BINLOG_RECORD_MAX > BINLOG_WRITE_BUFFER) {
+            if (write_buffer(log, used) < 0) {
+                return -1;
+            }
+            log->seq = seq;
+            used = 0;
+        }
+        if (log->size + used > BINLOG_HEADER_SIZE && log->size + used >= log->segment_size) {
+            if (write_buffer(log, used) < 0) {
+                return -1;
+            }
+            log->seq = seq;
+            used = 0;
+            if (roll_segment(log) < 0) {
+                return -1;
+            }
+        }
+        used += encode_record(++seq, &msgs[i], log->buf + used);
+    }
+    if (write_buffer(log, used) < 0) {
+        return -1;
+    }
+    log->seq = seq;
+    return 0;
+}
+
+int binlog_sync(BinLog *log) {
+    return fdatasync(log->fd);
+}
+
+uint64_t binlog_last_seq(const BinLog *log) {
+    return log->seq;
+}
+
+void binlog_close(BinLog *log) {
+    if (!log) {
+        return;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    free(log->buf);
+    free(log);
+}
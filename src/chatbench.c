@@ -0,0 +1,508 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "client.h"
+#include "histogram.h"
+#include "proto.h"
+
+#define BENCH_NAME_PREFIX "bench"
+#define BENCH_TAG "bench "
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_EVENTS 128
+#define BENCH_INBUF 16384
+#define BENCH_SETTLE_MS 500   /* quiet time after the join storm before measuring */
+#define BENCH_DRAIN_MS 2000   /* longest wait for stragglers after the last send */
+
+/* One benchmark connection, owned by a single worker thread */
+typedef struct Conn {
+    int fd;
+    int index;
+    int proto;
+    int closed;
+    size_t inlen;
+    unsigned char inbuf[BENCH_INBUF];
+} Conn;
+
+/* Send time and outstanding deliveries of one message, indexed by its id */
+typedef struct Probe {
+    uint64_t sent_ns;
+    atomic_uint remaining;
+} Probe;
+
+typedef struct Worker {
+    pthread_t thread;
+    int epfd;
+    Conn **conns;
+    int conn_count;      /* published before the sending phase starts */
+    Histogram *latency;  /* per delivery: receive - send */
+    Histogram *fanout;   /* per message: last delivery - send */
+    uint64_t delivered;
+    uint64_t sent;
+    uint64_t disconnects;
+    unsigned int seed;
+} Worker;
+
+static ClientMode bench_mode = MODE_UNIX;
+static char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = SOCKET_PATH;
+static char tcp_host[256] = "127.0.0.1";
+static char tcp_port[16] = DEFAULT_TCP_PORT;
+static int client_count = 100;
+static int thread_count = 4;
+static double rate = 1000.0;     /* messages per second, all senders together */
+static double duration = 10.0;   /* seconds of sending */
+static int dm_percent = 0;       /* share of private messages */
+static size_t text_size = 0;     /* pad texts to this many bytes */
+static int wanted_proto = PROTO_MAX_VERSION;
+
+static Worker workers[BENCH_MAX_THREADS];
+static Probe *probes;
+static size_t probe_cap;
+static atomic_uint_least64_t next_id;
+static atomic_uint_least64_t completed;
+static atomic_int live_conns;
+static atomic_uint_least64_t last_rx_ns;
+static atomic_int sending;
+static atomic_int stopping;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int connect_unix_socket(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int connect_tcp_socket(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int gai = getaddrinfo(host, port, &hints, &res);
+    if (gai != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        perror("connect");
+    }
+    return fd;
+}
+
+/* Same hello as ./client; returns the negotiated version or -1 */
+static int handshake(int fd, int index) {
+    ChatMessage hello;
+    memset(&hello, 0, sizeof(hello));
+    snprintf(hello.sender, USERNAME_MAX, "%s%d", BENCH_NAME_PREFIX, index);
+    if (wanted_proto > PROTO_LEGACY) {
+        snprintf(hello.text, TEXT_MAX, "hello %s%d", PROTO_HELLO_TAG, wanted_proto);
+    } else {
+        snprintf(hello.text, TEXT_MAX, "hello");
+    }
+    hello.timestamp = time(NULL);
+    if (proto_send(fd, PROTO_LEGACY, &hello) < 0) {
+        return -1;
+    }
+    if (wanted_proto == PROTO_LEGACY) {
+        return PROTO_LEGACY;
+    }
+
+    ChatMessage reply;
+    if (proto_recv(fd, PROTO_LEGACY, &reply) < 0) {
+        return -1;
+    }
+    reply.text[TEXT_MAX - 1] = '\0';
+    int version = proto_ack_version(&reply);
+    if (version <= 0) {
+        fprintf(stderr, "%s%d: rejected: %s\n", BENCH_NAME_PREFIX, index, reply.text);
+        return -1;
+    }
+    return version;
+}
+
+/* Texts look like "bench <id> <send ns>" so any receiver can time them */
+static void on_message(Worker *worker, const ChatMessage *msg, uint64_t now) {
+    unsigned long long id;
+    unsigned long long sent_ns;
+    if (strncmp(msg->text, BENCH_TAG, sizeof(BENCH_TAG) - 1) != 0 ||
+        sscanf(msg->text + sizeof(BENCH_TAG) - 1, "%llu %llu", &id, &sent_ns) != 2 ||
+        id >= probe_cap) {
+        return;
+    }
+    worker->delivered++;
+    hist_record(worker->latency, now > sent_ns ? now - sent_ns : 0);
+    if (atomic_fetch_sub(&probes[id].remaining, 1) == 1) {
+        hist_record(worker->fanout, now - probes[id].sent_ns);
+        atomic_fetch_add(&completed, 1);
+    }
+}
+
+static void close_conn(Worker *worker, Conn *conn) {
+    if (conn->closed) {
+        return;
+    }
+    conn->closed = 1;
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    worker->disconnects++;
+    atomic_fetch_sub(&live_conns, 1);
+}
+
+static void read_conn(Worker *worker, Conn *conn, uint64_t now) {
+    for (;;) {
+        ssize_t n = recv(conn->fd, conn->inbuf + conn->inlen, sizeof(conn->inbuf) - conn->inlen, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_conn(worker, conn);
+            return;
+        }
+        if (n < 0) {
+            return;
+        }
+        conn->inlen += (size_t)n;
+
+        size_t off = 0;
+        size_t frame_len;
+        int rc;
+        while ((rc = proto_frame_size(conn->proto, conn->inbuf + off, conn->inlen - off, &frame_len)) == 1) {
+            ChatMessage msg;
+            if (proto_decode(conn->proto, conn->inbuf + off, frame_len, &msg) == 0) {
+                on_message(worker, &msg, now);
+            }
+            off += frame_len;
+        }
+        if (rc < 0) {
+            close_conn(worker, conn);
+            return;
+        }
+        memmove(conn->inbuf, conn->inbuf + off, conn->inlen - off);
+        conn->inlen -= off;
+    }
+}
+
+static void send_one(Worker *worker, uint64_t now) {
+    if (worker->conn_count == 0) {
+        return;
+    }
+    Conn *conn = worker->conns[rand_r(&worker->seed) % (unsigned)worker->conn_count];
+    if (conn->closed) {
+        return;
+    }
+    uint64_t id = atomic_fetch_add(&next_id, 1);
+    if (id >= probe_cap) {
+        return;
+    }
+
+    ChatMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    int dm = dm_percent > 0 && client_count > 1 && (int)(rand_r(&worker->seed) % 100) < dm_percent;
+    if (dm) {
+        int target = (int)(rand_r(&worker->seed) % (unsigned)(client_count - 1));
+        if (target >= conn->index) {
+            target++;
+        }
+        snprintf(msg.target, USERNAME_MAX, "%s%d", BENCH_NAME_PREFIX, target);
+    }
+    int len = snprintf(msg.text, TEXT_MAX, BENCH_TAG "%llu %llu ", (unsigned long long)id, (unsigned long long)now);
+    while (len > 0 && (size_t)len < text_size && len < TEXT_MAX - 1) {
+        msg.text[len++] = 'x';
+    }
+    msg.timestamp = time(NULL);
+
+    probes[id].sent_ns = now;
+    atomic_store(&probes[id].remaining, dm ? 1u : (unsigned)atomic_load(&live_conns));
+
+    unsigned char frame[PROTO_MAX_ENCODED + sizeof(LegacyMessage)];
+    size_t frame_len = proto_encode(conn->proto, &msg, frame, sizeof(frame));
+    if (frame_len == 0 || send_all(conn->fd, frame, frame_len) < 0) {
+        close_conn(worker, conn);
+        return;
+    }
+    worker->sent++;
+}
+
+static void *worker_thread(void *arg) {
+    Worker *worker = arg;
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    double interval_ns = 1e9 * (double)thread_count / rate;
+    uint64_t next_send = 0;
+
+    while (!atomic_load(&stopping)) {
+        int timeout = 50;
+        uint64_t now = monotonic_ns();
+        int active = atomic_load(&sending);
+        if (active) {
+            if (next_send == 0) {
+                next_send = now;
+            }
+            timeout = next_send > now ? (int)((next_send - now) / 1000000) : 0;
+        }
+
+        int n = epoll_wait(worker->epfd, events, BENCH_MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        now = monotonic_ns();
+        for (int i = 0; i < n; i++) {
+            read_conn(worker, events[i].data.ptr, now);
+        }
+        if (n > 0) {
+            atomic_store(&last_rx_ns, now);
+        }
+
+        if (active) {
+            /* Keep the schedule absolute, but do not burst after a long stall */
+            if (now > next_send + 1000000000ull) {
+                next_send = now;
+            }
+            while (next_send <= now && atomic_load(&sending)) {
+                send_one(worker, now);
+                next_send += (uint64_t)interval_ns > 0 ? (uint64_t)interval_ns : 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Wait until no worker has seen a frame for quiet_ms, or limit_ms passed */
+static void wait_quiet(long quiet_ms, long limit_ms, int until_complete) {
+    uint64_t start = monotonic_ns();
+    atomic_store(&last_rx_ns, start);
+    for (;;) {
+        sleep_ms(20);
+        uint64_t now = monotonic_ns();
+        if (until_complete && atomic_load(&completed) >= atomic_load(&next_id)) {
+            return;
+        }
+        if (now - atomic_load(&last_rx_ns) >= (uint64_t)quiet_ms * 1000000ull ||
+            now - start >= (uint64_t)limit_ms * 1000000ull) {
+            return;
+        }
+    }
+}
+
+static void print_hist(const char *label, const Histogram *hist) {
+    printf("%-10s p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us  (%llu samples)\n", label,
+           hist_percentile(hist, 50.0) / 1000.0, hist_percentile(hist, 99.0) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0, hist_max(hist) / 1000.0,
+           (unsigned long long)hist_count(hist));
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--unix PATH | --tcp HOST PORT] [--clients N] [--threads N] [--rate MSGS_PER_SEC]\n"
+            "          [--duration SECONDS] [--dm PERCENT] [--size BYTES] [--legacy | --proto N]\n",
+            prog);
+    fprintf(stderr, "Defaults: --unix %s --clients 100 --threads 4 --rate 1000 --duration 10 --dm 0\n",
+            SOCKET_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            bench_mode = MODE_UNIX;
+            snprintf(unix_path, sizeof(unix_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--tcp") == 0 && i + 2 < argc) {
+            bench_mode = MODE_TCP;
+            snprintf(tcp_host, sizeof(tcp_host), "%s", argv[++i]);
+            snprintf(tcp_port, sizeof(tcp_port), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            client_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--dm") == 0 && i + 1 < argc) {
+            dm_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            text_size = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--legacy") == 0) {
+            wanted_proto = PROTO_LEGACY;
+        } else if (strcmp(argv[i], "--proto") == 0 && i + 1 < argc) {
+            wanted_proto = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (client_count < 1 || thread_count < 1 || thread_count > BENCH_MAX_THREADS || rate <= 0.0 ||
+        duration <= 0.0 || dm_percent < 0 || dm_percent > 100 || wanted_proto < PROTO_LEGACY ||
+        wanted_proto > PROTO_MAX_VERSION) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (thread_count > client_count) {
+        thread_count = client_count;
+    }
+
+    raise_fd_limit();
+    probe_cap = (size_t)(rate * duration) + (size_t)thread_count + 1;
+    probes = calloc(probe_cap, sizeof(Probe));
+    Conn *conns = calloc((size_t)client_count, sizeof(Conn));
+    if (!probes || !conns) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    /* Workers start reading before everyone is connected: each join is broadcast,
+     * and early connections must keep draining or the server drops them. */
+    for (int t = 0; t < thread_count; t++) {
+        Worker *worker = &workers[t];
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        worker->conns = calloc((size_t)client_count / (size_t)thread_count + 1, sizeof(Conn *));
+        worker->latency = hist_create();
+        worker->fanout = hist_create();
+        worker->seed = (unsigned int)(monotonic_ns() ^ (uint64_t)t * 2654435761u);
+        if (worker->epfd < 0 || !worker->conns || !worker->latency || !worker->fanout ||
+            pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+            perror("worker");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t connect_start = monotonic_ns();
+    for (int i = 0; i < client_count; i++) {
+        Conn *conn = &conns[i];
+        conn->index = i;
+        conn->fd = bench_mode == MODE_TCP ? connect_tcp_socket(tcp_host, tcp_port) : connect_unix_socket(unix_path);
+        if (conn->fd < 0 || (conn->proto = handshake(conn->fd, i)) < 0) {
+            fprintf(stderr, "Connected %d of %d clients.\n", i, client_count);
+            return EXIT_FAILURE;
+        }
+        Worker *worker = &workers[i % thread_count];
+        worker->conns[worker->conn_count++] = conn;
+        atomic_fetch_add(&live_conns, 1);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return EXIT_FAILURE;
+        }
+    }
+    double connect_secs = (double)(monotonic_ns() - connect_start) / 1e9;
+    wait_quiet(BENCH_SETTLE_MS, 30000, 0);
+
+    /* Join announcements are not part of the measurement */
+    for (int t = 0; t < thread_count; t++) {
+        hist_reset(workers[t].latency);
+        hist_reset(workers[t].fanout);
+        workers[t].delivered = 0;
+    }
+
+    uint64_t start = monotonic_ns();
+    atomic_store(&sending, 1);
+    sleep_ms((long)(duration * 1000.0));
+    atomic_store(&sending, 0);
+    uint64_t send_end = monotonic_ns();
+    wait_quiet(BENCH_DRAIN_MS, BENCH_DRAIN_MS * 5, 1);
+    uint64_t end = monotonic_ns();
+    atomic_store(&stopping, 1);
+
+    Histogram *latency = hist_create();
+    Histogram *fanout = hist_create();
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t disconnects = 0;
+    for (int t = 0; t < thread_count; t++) {
+        pthread_join(workers[t].thread, NULL);
+        hist_merge(latency, workers[t].latency);
+        hist_merge(fanout, workers[t].fanout);
+        sent += workers[t].sent;
+        delivered += workers[t].delivered;
+        disconnects += workers[t].disconnects;
+    }
+
+    double send_secs = (double)(send_end - start) / 1e9;
+    double total_secs = (double)(end - start) / 1e9;
+    printf("clients    %d over %d threads, proto v%d, connected in %.2f s\n", client_count, thread_count,
+           conns[0].proto, connect_secs);
+    printf("mix        %d%% broadcast / %d%% private, target %.0f msg/s for %.1f s\n", 100 - dm_percent,
+           dm_percent, rate, duration);
+    printf("sent       %llu msgs, %.1f msg/s\n", (unsigned long long)sent, (double)sent / send_secs);
+    printf("delivered  %llu frames, %.1f frames/s\n", (unsigned long long)delivered,
+           (double)delivered / total_secs);
+    print_hist("latency", latency);
+    print_hist("fan-out", fanout);
+    printf("complete   %llu of %llu messages reached every recipient; %llu disconnects\n",
+           (unsigned long long)atomic_load(&completed), (unsigned long long)sent,
+           (unsigned long long)disconnects);
+
+    for (int t = 0; t < thread_count; t++) {
+        hist_destroy(workers[t].latency);
+        hist_destroy(workers[t].fanout);
+        free(workers[t].conns);
+        close(workers[t].epfd);
+    }
+    for (int i = 0; i < client_count; i++) {
+        if (!conns[i].closed) {
+            close(conns[i].fd);
+        }
+    }
+    hist_destroy(latency);
+    hist_destroy(fanout);
+    free(conns);
+    free(probes);
+    return disconnects > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
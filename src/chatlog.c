@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binlog.h"
+#include "chat.h"
+
+#define CHATLOG_DEFAULT_PREFIX "chat.log"
+
+static void print_record(const ChatMessage *msg) {
+    char timebuf[32];
+    struct tm tm_info;
+    localtime_r(&msg->timestamp, &tm_info);
+    strftime(timebuf, sizeof(timebuf), "%H:%M:%S", &tm_info);
+    if (msg->room[0] != '\0') {
+        printf("[%s] <%s %s> %s\n", timebuf, msg->sender, msg->room, msg->text);
+    } else if (msg->target[0] == '\0') {
+        printf("[%s] <%s> %s\n", timebuf, msg->sender, msg->text);
+    } else {
+        printf("[%s] <%s -> %s> %s\n", timebuf, msg->sender, msg->target, msg->text);
+    }
+}
+
+/* Render one segment; a bad record ends it, since everything after is unreadable. */
+static int dump_segment(const char *path, int show_seq) {
+    BinLogReader *reader = binlog_reader_open(path);
+    if (!reader) {
+        perror(path);
+        return -1;
+    }
+    uint64_t seq;
+    ChatMessage msg;
+    int rc;
+    while ((rc = binlog_reader_next(reader, &seq, &msg)) == 1) {
+        if (show_seq) {
+            printf("%llu ", (unsigned long long)seq);
+        }
+        print_record(&msg);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "%s: corrupt record at offset %ld\n", path, binlog_reader_offset(reader));
+    }
+    binlog_reader_close(reader);
+    return rc;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--seq] [--prefix PREFIX | SEGMENT...]\n", prog);
+    fprintf(stderr, "Without segments, renders %s.000000 onwards.\n", CHATLOG_DEFAULT_PREFIX);
+}
+
+int main(int argc, char *argv[]) {
+    const char *prefix = CHATLOG_DEFAULT_PREFIX;
+    int show_seq = 0;
+    int first_file = argc;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seq") == 0) {
+            show_seq = 1;
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            prefix = argv[++i];
+        } else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            first_file = i;
+            break;
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    if (first_file < argc) {
+        for (int i = first_file; i < argc; i++) {
+            if (dump_segment(argv[i], show_seq) < 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+
+    char path[BINLOG_PATH_MAX];
+    FILE *probe;
+    for (unsigned index = 0; binlog_segment_path(prefix, index, path, sizeof(path)) == 0; index++) {
+        if (!(probe = fopen(path, "rb"))) {
+            if (index == 0) {
+                perror(path);
+                status = EXIT_FAILURE;
+            }
+            break;
+        }
+        fclose(probe);
+        if (dump_segment(path, show_seq) < 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
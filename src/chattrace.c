@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "trace.h"
+
+#define CHATTRACE_DEFAULT_PATH "chat.trace"
+
+/* One row of the report: the time between two stages of the same message */
+typedef enum {
+    SPAN_RECV_ROUTED = 0,
+    SPAN_ROUTED_DEQUEUED,
+    SPAN_DEQUEUED_LOCKED,
+    SPAN_LOCKED_FANNED,
+    SPAN_LOCKED_FIRST_WRITE,
+    SPAN_LOCKED_LAST_WRITE,
+    SPAN_RECV_LAST_WRITE,
+    SPAN_RECV_LOGGED,
+    SPAN_COUNT
+} Span;
+
+static const char *span_names[SPAN_COUNT] = {
+    "recv -> routed",        "routed -> dequeued",     "dequeued -> locked",   "locked -> fanned",
+    "locked -> first write", "locked -> last write", "recv -> last write", "recv -> logged",
+};
+
+static Histogram *spans[SPAN_COUNT];
+
+static int by_id_then_time(const void *a, const void *b) {
+    const TraceEvent *x = a;
+    const TraceEvent *y = b;
+    if (x->id != y->id) {
+        return x->id < y->id ? -1 : 1;
+    }
+    if (x->ts != y->ts) {
+        return x->ts < y->ts ? -1 : 1;
+    }
+    return (x->stage > y->stage) - (x->stage < y->stage);
+}
+
+static void record_span(Span span, uint64_t from, uint64_t to) {
+    if (from && to) {
+        hist_record(spans[span], to >= from ? to - from : 0);
+    }
+}
+
+/* First time a stage was seen for the message, on any shard if shard is TRACE_NO_SHARD */
+static uint64_t first_at(const TraceEvent *ev, size_t n, uint32_t stage, uint32_t shard) {
+    for (size_t i = 0; i < n; i++) {
+        if (ev[i].stage == stage && (shard == TRACE_NO_SHARD || ev[i].shard == shard)) {
+            return ev[i].ts;
+        }
+    }
+    return 0;
+}
+
+static uint64_t last_at(const TraceEvent *ev, size_t n, uint32_t stage, uint32_t shard) {
+    for (size_t i = n; i-- > 0;) {
+        if (ev[i].stage == stage && (shard == TRACE_NO_SHARD || ev[i].shard == shard)) {
+            return ev[i].ts;
+        }
+    }
+    return 0;
+}
+
+/* Events of one message, in time order. A message fans out on every shard
+ * with recipients, so the middle stages are paired up per shard. Only the
+ * write that empties a recipient's queue is recorded, and it may happen
+ * before the batch is fanned out, so writes are measured from the lock. */
+static void account_message(const TraceEvent *ev, size_t n) {
+    uint64_t recv = first_at(ev, n, TRACE_RECV, TRACE_NO_SHARD);
+    uint64_t routed = first_at(ev, n, TRACE_ROUTED, TRACE_NO_SHARD);
+    record_span(SPAN_RECV_ROUTED, recv, routed);
+    for (size_t i = 0; i < n; i++) {
+        if (ev[i].stage != TRACE_DEQUEUED) {
+            continue;
+        }
+        uint32_t shard = ev[i].shard;
+        uint64_t locked = first_at(ev, n, TRACE_LOCKED, shard);
+        uint64_t fanned = first_at(ev, n, TRACE_FANNED, shard);
+        record_span(SPAN_ROUTED_DEQUEUED, routed, ev[i].ts);
+        record_span(SPAN_DEQUEUED_LOCKED, ev[i].ts, locked);
+        record_span(SPAN_LOCKED_FANNED, locked, fanned);
+        record_span(SPAN_LOCKED_FIRST_WRITE, locked, first_at(ev, n, TRACE_WRITTEN, shard));
+        record_span(SPAN_LOCKED_LAST_WRITE, locked, last_at(ev, n, TRACE_WRITTEN, shard));
+    }
+    record_span(SPAN_RECV_LAST_WRITE, recv, last_at(ev, n, TRACE_WRITTEN, TRACE_NO_SHARD));
+    record_span(SPAN_RECV_LOGGED, recv, first_at(ev, n, TRACE_LOGGED, TRACE_NO_SHARD));
+}
+
+static TraceEvent *load_trace(const char *path, size_t *count) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+    unsigned char header[TRACE_HEADER_SIZE];
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t n;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    memcpy(&version, header + 8, sizeof(version));
+    memcpy(&event_size, header + 12, sizeof(event_size));
+    memcpy(&n, header + 16, sizeof(n));
+    if (version != TRACE_VERSION || event_size != sizeof(TraceEvent)) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", path, version);
+        fclose(fp);
+        return NULL;
+    }
+    TraceEvent *events = malloc((n ? n : 1) * sizeof(TraceEvent));
+    if (!events) {
+        perror("malloc");
+        fclose(fp);
+        return NULL;
+    }
+    if (fread(events, sizeof(TraceEvent), n, fp) != n) {
+        fprintf(stderr, "%s: truncated\n", path);
+        free(events);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *count = n;
+    return events;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [TRACE]\n", prog);
+    fprintf(stderr, "Prints per-stage latency of a server flight recorder dump (default %s).\n",
+            CHATTRACE_DEFAULT_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = CHATTRACE_DEFAULT_PATH;
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc == 2) {
+        path = argv[1];
+    }
+
+    size_t count = 0;
+    TraceEvent *events = load_trace(path, &count);
+    if (!events) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < SPAN_COUNT; i++) {
+        if (!(spans[i] = hist_create())) {
+            perror("hist_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    qsort(events, count, sizeof(TraceEvent), by_id_then_time);
+    size_t messages = 0;
+    for (size_t start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count && events[end].id == events[start].id; end++) {
+        }
+        account_message(events + start, end - start);
+        messages++;
+    }
+
+    /* The oldest messages of a dump may have lost their early stages to the ring */
+    printf("%zu events, %zu messages\n", count, messages);
+    printf("%-22s %10s %10s %10s %10s %10s\n", "stage (us)", "count", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < SPAN_COUNT; i++) {
+        const Histogram *hist = spans[i];
+        printf("%-22s %10llu %10.1f %10.1f %10.1f %10.1f\n", span_names[i],
+               (unsigned long long)hist_count(hist), hist_percentile(hist, 50.0) / 1000.0,
+               hist_percentile(hist, 99.0) / 1000.0, hist_percentile(hist, 99.9) / 1000.0,
+               hist_max(hist) / 1000.0);
+        hist_destroy(spans[i]);
+    }
+    free(events);
+    return EXIT_SUCCESS;
+}
@@ -14,10 +14,16 @@
 
 #include "chat.h"
 #include "client.h"
+#include "proto.h"
+#include "shm.h"
 
 static volatile sig_atomic_t running = 1;
 static int server_fd = -1;
 static char username[USERNAME_MAX];
+static int wanted_proto = PROTO_MAX_VERSION;
+static int proto_version = PROTO_LEGACY;
+static int want_shm = 0;
+static ShmChannel *shm = NULL; /* granted shared-memory rings, NULL on the socket */
 
 static ClientMode client_mode = MODE_UNIX;
 static char server_unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = SOCKET_PATH;
@@ -99,32 +105,114 @@ static void format_time(time_t ts, char *buf, size_t len) {
     strftime(buf, len, "%H:%M:%S", &tm_info);
 }
 
+static void terminate_message(ChatMessage *msg) {
+    msg->sender[USERNAME_MAX - 1] = '\0';
+    msg->target[USERNAME_MAX - 1] = '\0';
+    msg->room[ROOM_MAX - 1] = '\0';
+    msg->text[TEXT_MAX - 1] = '\0';
+}
+
+static void print_message(const ChatMessage *msg) {
+    char timebuf[32];
+    format_time(msg->timestamp, timebuf, sizeof(timebuf));
+    if (msg->target[0] && strncmp(msg->target, username, USERNAME_MAX) == 0) {
+        printf("[%s] (private) <%s> %s\n", timebuf, msg->sender, msg->text);
+    } else if (msg->target[0]) {
+        printf("[%s] <%s -> %s> %s\n", timebuf, msg->sender, msg->target, msg->text);
+    } else if (msg->room[0]) {
+        printf("[%s] <%s %s> %s\n", timebuf, msg->sender, msg->room, msg->text);
+    } else {
+        printf("[%s] <%s> %s\n", timebuf, msg->sender, msg->text);
+    }
+    fflush(stdout);
+}
+
+/* Frames arrive as a byte stream in the ring, just as they would on the socket */
+static void receive_shm(void) {
+    size_t cap = PROTO_MAX_FRAME + PROTO_VARINT_MAX;
+    unsigned char *buf = malloc(cap);
+    size_t len = 0;
+    int hung_up = 0;
+    while (buf && running) {
+        ssize_t n = shm_read(shm, buf + len, cap - len);
+        if (n < 0) {
+            break;
+        }
+        if (n == 0) {
+            if (hung_up) {
+                break;
+            }
+            /* The socket only becomes readable when the server goes away; drain the ring first */
+            int rc = shm_wait(shm, server_fd);
+            hung_up = rc <= 0;
+            continue;
+        }
+        len += (size_t)n;
+        size_t off = 0;
+        size_t frame_len = 0;
+        int rc;
+        while ((rc = proto_frame_size(proto_version, buf + off, len - off, &frame_len)) == 1) {
+            ChatMessage msg;
+            if (proto_decode(proto_version, buf + off, frame_len, &msg) == 0) {
+                terminate_message(&msg);
+                print_message(&msg);
+            }
+            off += frame_len;
+        }
+        if (rc < 0) {
+            break;
+        }
+        memmove(buf, buf + off, len - off);
+        len -= off;
+    }
+    free(buf);
+    if (running) {
+        fprintf(stderr, "Connection lost.\n");
+        running = 0;
+    }
+}
+
 static void *receiver_thread(void *arg) {
     (void)arg;
+    if (shm) {
+        receive_shm();
+        return NULL;
+    }
     ChatMessage msg;
-    char timebuf[32];
     while (running) {
-        if (recv_all(server_fd, &msg, sizeof(ChatMessage)) < 0) {
+        if (proto_recv(server_fd, proto_version, &msg) < 0) {
             fprintf(stderr, "Connection lost.\n");
             running = 0;
             break;
         }
-        msg.sender[USERNAME_MAX - 1] = '\0';
-        msg.target[USERNAME_MAX - 1] = '\0';
-        msg.text[TEXT_MAX - 1] = '\0';
-        format_time(msg.timestamp, timebuf, sizeof(timebuf));
-        if (msg.target[0] && strncmp(msg.target, username, USERNAME_MAX) == 0) {
-            printf("[%s] (private) <%s> %s\n", timebuf, msg.sender, msg.text);
-        } else if (msg.target[0]) {
-            printf("[%s] <%s -> %s> %s\n", timebuf, msg.sender, msg.target, msg.text);
-        } else {
-            printf("[%s] <%s> %s\n", timebuf, msg.sender, msg.text);
-        }
-        fflush(stdout);
+        terminate_message(&msg);
+        print_message(&msg);
     }
     return NULL;
 }
 
+/* The input thread is the ring's only writer; a full ring is retried after a short pause */
+static int send_message(const ChatMessage *msg) {
+    if (!shm) {
+        return proto_send(server_fd, proto_version, msg);
+    }
+    unsigned char buf[PROTO_MAX_ENCODED];
+    size_t len = proto_encode(proto_version, msg, buf, sizeof(buf));
+    size_t off = 0;
+    while (len > 0 && off < len && running) {
+        ssize_t n = shm_write(shm, buf + off, len - off);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+        off += (size_t)n;
+    }
+    return len > 0 && off == len ? 0 : -1;
+}
+
 static int parse_input_line(const char *line, ChatMessage *out) {
     memset(out, 0, sizeof(*out));
     out->timestamp = time(NULL);
@@ -143,6 +231,14 @@ static int parse_input_line(const char *line, ChatMessage *out) {
         strncpy(out->target, line + 1, user_len);
         out->target[user_len] = '\0';
         snprintf(out->text, TEXT_MAX, "%s", space + 1);
+    } else if (line[0] == '#') {
+        const char *space = strchr(line, ' ');
+        if (!space || space == line + 1 || (size_t)(space - line) >= ROOM_MAX) {
+            fprintf(stderr, "Usage for rooms: #room message (after /join #room)\n");
+            return -1;
+        }
+        memcpy(out->room, line, (size_t)(space - line));
+        snprintf(out->text, TEXT_MAX, "%s", space + 1);
     } else {
         snprintf(out->text, TEXT_MAX, "%s", line);
     }
@@ -165,12 +261,13 @@ static void *input_thread(void *arg) {
             break;
         }
         if (strcmp(line, "/help") == 0) {
-            printf("Commands: /quit, /help, @user message for private\n");
+            printf("Commands: /quit, /help, /who, /history [N], /join #room, /part #room, "
+                   "@user message for private, #room message for a room\n");
             continue;
         }
         ChatMessage msg;
         if (parse_input_line(line, &msg) == 0) {
-            if (send_all(server_fd, &msg, sizeof(ChatMessage)) < 0) {
+            if (send_message(&msg) < 0) {
                 fprintf(stderr, "Failed to send message.\n");
                 running = 0;
                 break;
@@ -185,13 +282,45 @@ static int send_handshake(void) {
     ChatMessage hello;
     memset(&hello, 0, sizeof(hello));
     snprintf(hello.sender, USERNAME_MAX, "%s", username);
-    snprintf(hello.text, TEXT_MAX, "hello");
+    if (wanted_proto > PROTO_LEGACY) {
+        snprintf(hello.text, TEXT_MAX, "hello %s%d%s", PROTO_HELLO_TAG, wanted_proto, want_shm ? PROTO_SHM_TAG : "");
+    } else {
+        snprintf(hello.text, TEXT_MAX, "hello");
+    }
     hello.timestamp = time(NULL);
-    return send_all(server_fd, &hello, sizeof(ChatMessage));
+    if (proto_send(server_fd, PROTO_LEGACY, &hello) < 0) {
+        return -1;
+    }
+    if (wanted_proto == PROTO_LEGACY) {
+        return 0;
+    }
+
+    /* A v2+ server acks first; anything else means a legacy server, so show it and stay on v1. */
+    ChatMessage reply;
+    if (proto_recv(server_fd, PROTO_LEGACY, &reply) < 0) {
+        return -1;
+    }
+    terminate_message(&reply);
+    int version = proto_ack_version(&reply);
+    if (version > 0) {
+        proto_version = version;
+    } else {
+        print_message(&reply);
+    }
+    if (proto_ack_shm(&reply)) {
+        shm = shm_receive(server_fd);
+        if (!shm) {
+            perror("shm");
+            return -1;
+        }
+    } else if (want_shm) {
+        fprintf(stderr, "Server offers no shared memory; using the socket.\n");
+    }
+    return 0;
 }
 
 static void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <username> [--unix PATH | --tcp HOST PORT]\n", prog);
+    fprintf(stderr, "Usage: %s <username> [--unix PATH | --tcp HOST PORT] [--legacy | --shm]\n", prog);
     fprintf(stderr, "Defaults: --unix %s, --tcp %s:%s\n",
             SOCKET_PATH, server_tcp_host, server_tcp_port);
 }
@@ -211,12 +340,21 @@ int main(int argc, char *argv[]) {
             client_mode = MODE_TCP;
             snprintf(server_tcp_host, sizeof(server_tcp_host), "%s", argv[++i]);
             snprintf(server_tcp_port, sizeof(server_tcp_port), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--legacy") == 0) {
+            wanted_proto = PROTO_LEGACY;
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            want_shm = 1;
         } else {
             print_usage(argv[0]);
             return EXIT_FAILURE;
         }
     }
 
+    if (want_shm && (client_mode != MODE_UNIX || wanted_proto == PROTO_LEGACY)) {
+        fprintf(stderr, "--shm needs a UNIX socket and protocol v2 or later.\n");
+        return EXIT_FAILURE;
+    }
+
     struct sigaction sa;
     sa.sa_handler = handle_sigint;
     sigemptyset(&sa.sa_mask);
@@ -255,6 +393,7 @@ int main(int argc, char *argv[]) {
     shutdown(server_fd, SHUT_RDWR);
     pthread_join(recv_tid, NULL);
 
+    shm_destroy(shm);
     close(server_fd);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+#define EPOCH_CACHE_LINE 64
+
+/* Internal per-thread slot - the epoch its owner entered at, 0 while outside */
+typedef struct EpochSlot {
+    _Alignas(EPOCH_CACHE_LINE) _Atomic uint64_t active;
+    struct EpochSlot *next;
+} EpochSlot;
+
+/* Internal retired object - freed once no active slot is at or below its epoch */
+typedef struct Retired {
+    void *ptr;
+    EpochFreeFn fn;
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+static _Atomic uint64_t global_epoch = 1;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static EpochSlot *slots = NULL;  /* live threads, guarded by registry_mutex */
+static Retired *retired = NULL;  /* oldest last, guarded by registry_mutex */
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local EpochSlot *my_slot = NULL;
+
+/* Thread exit: an idle slot holds nothing back, so just unlink it */
+static void drop_slot(void *arg) {
+    EpochSlot *slot = arg;
+    pthread_mutex_lock(&registry_mutex);
+    for (EpochSlot **pp = &slots; *pp; pp = &(*pp)->next) {
+        if (*pp == slot) {
+            *pp = slot->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(slot);
+}
+
+static void make_key(void) {
+    pthread_key_create(&slot_key, drop_slot);
+}
+
+static EpochSlot *thread_slot(void) {
+    if (my_slot) {
+        return my_slot;
+    }
+    pthread_once(&key_once, make_key);
+    EpochSlot *slot = aligned_alloc(EPOCH_CACHE_LINE, sizeof(EpochSlot));
+    if (!slot) {
+        abort(); /* a reader without a slot could not be protected */
+    }
+    atomic_init(&slot->active, 0);
+    pthread_mutex_lock(&registry_mutex);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&registry_mutex);
+    pthread_setspecific(slot_key, slot);
+    my_slot = slot;
+    return slot;
+}
+
+/* The sequentially consistent store orders the announcement before every
+ * pointer the section loads, against the scan in epoch_reclaim. */
+void epoch_enter(void) {
+    EpochSlot *slot = thread_slot();
+    atomic_store(&slot->active, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&my_slot->active, 0, memory_order_release);
+}
+
+/* Caller holds registry_mutex; returns the objects that are safe to free */
+static Retired *collect(void) {
+    uint64_t oldest = atomic_fetch_add(&global_epoch, 1) + 1;
+    for (EpochSlot *slot = slots; slot; slot = slot->next) {
+        uint64_t active = atomic_load(&slot->active);
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+    }
+    /* Retired before any active reader entered: nobody can reach it */
+    Retired **pp = &retired;
+    while (*pp && (*pp)->epoch >= oldest) {
+        pp = &(*pp)->next;
+    }
+    Retired *done = *pp;
+    *pp = NULL;
+    return done;
+}
+
+static void free_all(Retired *done) {
+    while (done) {
+        Retired *next = done->next;
+        done->fn(done->ptr);
+        free(done);
+        done = next;
+    }
+}
+
+void epoch_retire(void *ptr, EpochFreeFn fn) {
+    if (!ptr) {
+        return;
+    }
+    Retired *node = malloc(sizeof(Retired));
+    if (!node) {
+        abort(); /* freeing now could pull memory from under a reader */
+    }
+    node->ptr = ptr;
+    node->fn = fn;
+    pthread_mutex_lock(&registry_mutex);
+    node->epoch = atomic_load(&global_epoch); /* under the lock, so the list stays in epoch order */
+    node->next = retired;
+    retired = node;
+    Retired *done = collect(); /* cheap: a walk over the few threads that ever read */
+    pthread_mutex_unlock(&registry_mutex);
+    free_all(done);
+}
+
+void epoch_reclaim(void) {
+    pthread_mutex_lock(&registry_mutex);
+    Retired *done = collect();
+    pthread_mutex_unlock(&registry_mutex);
+    free_all(done);
+}
+
+void epoch_shutdown(void) {
+    pthread_mutex_lock(&registry_mutex);
+    Retired *done = retired;
+    retired = NULL;
+    pthread_mutex_unlock(&registry_mutex);
+    free_all(done);
+}
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fanout.h"
+
+#define FANOUT_CACHE_LINE 64
+
+/* Internal run of chunks - its owner takes from next, thieves from end */
+typedef struct FanoutRun {
+    _Alignas(FANOUT_CACHE_LINE) pthread_mutex_t mutex;
+    size_t next;
+    size_t end;
+} FanoutRun;
+
+typedef struct FanoutWorker {
+    FanoutPool *pool;
+    int index; /* its run in every job */
+    pthread_t thread;
+} FanoutWorker;
+
+struct FanoutJob {
+    FanoutPool *pool;
+    FanoutRun *runs; /* one per worker, then the submitter's */
+    FanoutFn fn;
+    void *arg;
+    size_t items;
+    size_t chunk;
+    struct FanoutJob *next; /* on pool->jobs while chunks may be left, guarded by pool->mutex */
+    int listed;
+    int attached;           /* workers running its chunks, guarded by pool->mutex */
+    size_t steals;          /* guarded by pool->mutex */
+    pthread_cond_t idle;    /* attached dropped to 0 */
+};
+
+struct FanoutPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; /* a job was listed, or the pool is closing */
+    FanoutJob *jobs;     /* oldest first */
+    int closing;
+    int workers;
+    FanoutWorker *worker;
+};
+
+/* Caller holds pool->mutex */
+static void unlist(FanoutPool *pool, FanoutJob *job) {
+    for (FanoutJob **pp = &pool->jobs; *pp; pp = &(*pp)->next) {
+        if (*pp == job) {
+            *pp = job->next;
+            break;
+        }
+    }
+    job->listed = 0;
+}
+
+/* Next chunk for run self: its own front first, then another run's back */
+static int take_chunk(FanoutJob *job, int self, size_t *chunk, int *stolen) {
+    int runs = job->pool->workers + 1;
+    for (int k = 0; k < runs; k++) {
+        FanoutRun *run = &job->runs[(self + k) % runs];
+        pthread_mutex_lock(&run->mutex);
+        if (run->next < run->end) {
+            *chunk = k == 0 ? run->next++ : --run->end;
+            pthread_mutex_unlock(&run->mutex);
+            *stolen = k != 0;
+            return 0;
+        }
+        pthread_mutex_unlock(&run->mutex);
+    }
+    return -1;
+}
+
+/* Runs chunks until none are left anywhere; returns how many were stolen */
+static size_t work(FanoutJob *job, int self) {
+    size_t steals = 0;
+    size_t chunk;
+    int stolen;
+    while (take_chunk(job, self, &chunk, &stolen) == 0) {
+        size_t first = chunk * job->chunk;
+        size_t end = first + job->chunk < job->items ? first + job->chunk : job->items;
+        job->fn(job->arg, first, end);
+        steals += (size_t)stolen;
+    }
+    return steals;
+}
+
+static void *worker_thread(void *arg) {
+    FanoutWorker *self = arg;
+    FanoutPool *pool = self->pool;
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->closing) {
+        FanoutJob *job = pool->jobs;
+        if (!job) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        job->attached++;
+        pthread_mutex_unlock(&pool->mutex);
+        size_t steals = work(job, self->index);
+        pthread_mutex_lock(&pool->mutex);
+        job->steals += steals;
+        if (job->listed) {
+            unlist(pool, job); /* every chunk is taken */
+        }
+        if (--job->attached == 0) {
+            pthread_cond_signal(&job->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+FanoutPool *fanout_create(int workers) {
+    FanoutPool *pool = calloc(1, sizeof(FanoutPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->worker = calloc((size_t)workers, sizeof(FanoutWorker));
+    if (workers > 0 && !pool->worker) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i = 0; i < workers; i++) {
+        pool->worker[i].pool = pool;
+        pool->worker[i].index = i;
+        if (pthread_create(&pool->worker[i].thread, NULL, worker_thread, &pool->worker[i]) != 0) {
+            break;
+        }
+        pool->workers++;
+    }
+    return pool;
+}
+
+void fanout_destroy(FanoutPool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_join(pool->worker[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->worker);
+    free(pool);
+}
+
+int fanout_workers(const FanoutPool *pool) {
+    return pool->workers;
+}
+
+FanoutJob *fanout_job_create(FanoutPool *pool) {
+    FanoutJob *job = calloc(1, sizeof(FanoutJob));
+    if (!job) {
+        return NULL;
+    }
+    size_t runs = (size_t)pool->workers + 1;
+    job->runs = aligned_alloc(FANOUT_CACHE_LINE, runs * sizeof(FanoutRun));
+    if (!job->runs) {
+        free(job);
+        return NULL;
+    }
+    memset(job->runs, 0, runs * sizeof(FanoutRun));
+    for (size_t i = 0; i < runs; i++) {
+        pthread_mutex_init(&job->runs[i].mutex, NULL);
+    }
+    job->pool = pool;
+    pthread_cond_init(&job->idle, NULL);
+    return job;
+}
+
+void fanout_job_destroy(FanoutJob *job) {
+    if (!job) {
+        return;
+    }
+    for (int i = 0; i <= job->pool->workers; i++) {
+        pthread_mutex_destroy(&job->runs[i].mutex);
+    }
+    pthread_cond_destroy(&job->idle);
+    free(job->runs);
+    free(job);
+}
+
+size_t fanout_run(FanoutJob *job, size_t items, size_t chunk, FanoutFn fn, void *arg) {
+    FanoutPool *pool = job->pool;
+    size_t chunks = chunk > 0 ? (items + chunk - 1) / chunk : 0;
+    size_t runs = (size_t)pool->workers + 1;
+    if (chunks == 0) {
+        return 0;
+    }
+    /* Nobody else can see the job until it is listed */
+    for (size_t i = 0; i < runs; i++) {
+        job->runs[i].next = chunks * i / runs;
+        job->runs[i].end = chunks * (i + 1) / runs;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->items = items;
+    job->chunk = chunk;
+    job->steals = 0;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    FanoutJob **tail = &pool->jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+    job->listed = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    size_t steals = work(job, pool->workers);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (job->listed) {
+        unlist(pool, job);
+    }
+    while (job->attached > 0) {
+        pthread_cond_wait(&job->idle, &pool->mutex);
+    }
+    steals += job->steals;
+    pthread_mutex_unlock(&pool->mutex);
+    return steals;
+}
@@ -0,0 +1,60 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "proto.h"
+
+_Static_assert(FRAME_POOL_CAPACITY >= PROTO_MAX_ENCODED, "every encoded message should fit a pooled frame");
+
+static pthread_once_t frame_pool_once = PTHREAD_ONCE_INIT;
+static ObjectPool *pool = NULL;
+
+static void make_frame_pool(void) {
+    pool = pool_create("frame", sizeof(SharedFrame) + FRAME_POOL_CAPACITY);
+}
+
+ObjectPool *frame_pool(void) {
+    pthread_once(&frame_pool_once, make_frame_pool);
+    return pool;
+}
+
+/* Scrollback pages and other large frames fall back to malloc */
+SharedFrame *frame_alloc(size_t capacity) {
+    int pooled = capacity <= FRAME_POOL_CAPACITY && frame_pool();
+    SharedFrame *frame = pooled ? pool_alloc(pool) : malloc(sizeof(SharedFrame) + capacity);
+    if (!frame) {
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->born_ns = 0;
+    frame->trace_id = 0;
+    frame->len = 0;
+    frame->pooled = pooled;
+    return frame;
+}
+
+SharedFrame *frame_create(const void *data, size_t len) {
+    SharedFrame *frame = frame_alloc(len);
+    if (!frame) {
+        return NULL;
+    }
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    return frame;
+}
+
+SharedFrame *frame_ref(SharedFrame *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+    return frame;
+}
+
+void frame_unref(SharedFrame *frame) {
+    if (frame && atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1) {
+        if (frame->pooled) {
+            pool_free(pool, frame);
+        } else {
+            free(frame);
+        }
+    }
+}
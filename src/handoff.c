@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+typedef struct HandoffHeader {
+    uint32_t type;
+    uint32_t len;
+} HandoffHeader;
+
+int handoff_send(int sock, uint32_t type, const void *data, size_t len, int fd) {
+    if (len > HANDOFF_RECORD_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    HandoffHeader header = {.type = type, .len = (uint32_t)len};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg(sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    /* The descriptor went with the first byte; the rest is plain data */
+    if ((size_t)n < sizeof(header) && send_all(sock, (char *)&header + n, sizeof(header) - (size_t)n) < 0) {
+        return -1;
+    }
+    return len > 0 ? send_all(sock, data, len) : 0;
+}
+
+int handoff_recv(int sock, HandoffRecord *rec) {
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = -1;
+    HandoffHeader header;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&rec->fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if ((size_t)n < sizeof(header) && recv_all(sock, (char *)&header + n, sizeof(header) - (size_t)n) < 0) {
+        handoff_release(rec);
+        return -1;
+    }
+    if (header.len > HANDOFF_RECORD_MAX) {
+        handoff_release(rec);
+        errno = EPROTO;
+        return -1;
+    }
+    rec->type = header.type;
+    rec->len = header.len;
+    if (rec->len > 0) {
+        rec->data = malloc(rec->len);
+        if (!rec->data || recv_all(sock, rec->data, rec->len) < 0) {
+            handoff_release(rec);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int handoff_wait_ack(int sock, int timeout_ms) {
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int n;
+    while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    HandoffRecord rec;
+    if (handoff_recv(sock, &rec) < 0) {
+        return -1;
+    }
+    int rc = rec.type == HANDOFF_ACK ? 0 : -1;
+    handoff_release(&rec);
+    return rc;
+}
+
+void handoff_release(HandoffRecord *rec) {
+    if (rec->fd >= 0) {
+        close(rec->fd);
+        rec->fd = -1;
+    }
+    free(rec->data);
+    rec->data = NULL;
+    rec->len = 0;
+}
@@ -0,0 +1,125 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#define HIST_SUB_BITS 6
+#define HIST_SUB_SIZE (1u << HIST_SUB_BITS)
+#define HIST_GROUPS (64 - HIST_SUB_BITS + 1)
+#define HIST_BUCKETS (HIST_GROUPS * HIST_SUB_SIZE)
+
+/* Internal histogram structure - not exposed in header. Group 0 holds values
+ * below 64 exactly; group g >= 1 covers [64 << (g - 1), 64 << g) in 64 steps.
+ * Fields are relaxed atomics so a reader can merge while the owner records;
+ * with a single writer that costs plain loads and stores. */
+struct Histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t max;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+static uint64_t load(const _Atomic uint64_t *field) {
+    return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+static void store(_Atomic uint64_t *field, uint64_t value) {
+    atomic_store_explicit(field, value, memory_order_relaxed);
+}
+
+Histogram *hist_create(void) {
+    return calloc(1, sizeof(Histogram));
+}
+
+void hist_destroy(Histogram *hist) {
+    free(hist);
+}
+
+static unsigned bucket_of(uint64_t value) {
+    if (value < HIST_SUB_SIZE) {
+        return (unsigned)value;
+    }
+    unsigned msb = 63u - (unsigned)__builtin_clzll(value);
+    unsigned group = msb - HIST_SUB_BITS + 1;
+    unsigned sub = (unsigned)(value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_SIZE - 1);
+    return group * HIST_SUB_SIZE + sub;
+}
+
+/* Midpoint of a bucket, the value reported for anything that landed in it */
+static uint64_t bucket_value(unsigned idx) {
+    unsigned group = idx / HIST_SUB_SIZE;
+    uint64_t sub = idx % HIST_SUB_SIZE;
+    if (group == 0) {
+        return sub;
+    }
+    uint64_t low = (HIST_SUB_SIZE + sub) << (group - 1);
+    uint64_t width = 1ull << (group - 1);
+    return low + width / 2;
+}
+
+void hist_record(Histogram *hist, uint64_t value) {
+    unsigned idx = bucket_of(value);
+    store(&hist->buckets[idx], load(&hist->buckets[idx]) + 1);
+    store(&hist->count, load(&hist->count) + 1);
+    store(&hist->sum, load(&hist->sum) + value);
+    if (value > load(&hist->max)) {
+        store(&hist->max, value);
+    }
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+    uint64_t count = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = load(&src->buckets[i]);
+        store(&dst->buckets[i], load(&dst->buckets[i]) + n);
+        count += n;
+    }
+    /* Count from the buckets actually copied, so a concurrent record cannot skew percentiles */
+    store(&dst->count, load(&dst->count) + count);
+    store(&dst->sum, load(&dst->sum) + load(&src->sum));
+    if (load(&src->max) > load(&dst->max)) {
+        store(&dst->max, load(&src->max));
+    }
+}
+
+void hist_reset(Histogram *hist) {
+    memset(hist, 0, sizeof(Histogram));
+}
+
+uint64_t hist_count(const Histogram *hist) {
+    return load(&hist->count);
+}
+
+uint64_t hist_max(const Histogram *hist) {
+    return load(&hist->max);
+}
+
+double hist_mean(const Histogram *hist) {
+    uint64_t count = load(&hist->count);
+    return count ? (double)load(&hist->sum) / (double)count : 0.0;
+}
+
+uint64_t hist_percentile(const Histogram *hist, double pct) {
+    uint64_t count = load(&hist->count);
+    uint64_t max = load(&hist->max);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += load(&hist->buckets[i]);
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
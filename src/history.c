@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+#include "userindex.h"
+
+/* Internal ring structure - not exposed in header */
+typedef struct HistoryRing {
+    char room[ROOM_MAX];
+    uint64_t last;     /* newest sequence number in the ring */
+    size_t head;       /* slot of the oldest entry */
+    size_t count;
+    uint64_t *seqs;
+    ChatMessage *msgs;
+} HistoryRing;
+
+/* Internal history structure - room rings are looked up through the username index */
+struct History {
+    size_t depth;
+    uint64_t seq;
+    HistoryRing *lobby;
+    UserIndex *index;
+    HistoryRing *rooms[HISTORY_ROOMS_MAX];
+    size_t room_count;
+};
+
+static HistoryRing *ring_create(const char *room, size_t depth) {
+    HistoryRing *ring = calloc(1, sizeof(HistoryRing));
+    if (!ring) {
+        return NULL;
+    }
+    ring->seqs = malloc(depth * sizeof(uint64_t));
+    ring->msgs = malloc(depth * sizeof(ChatMessage));
+    if (!ring->seqs || !ring->msgs) {
+        free(ring->seqs);
+        free(ring->msgs);
+        free(ring);
+        return NULL;
+    }
+    snprintf(ring->room, ROOM_MAX, "%s", room);
+    return ring;
+}
+
+static void ring_free(HistoryRing *ring) {
+    if (!ring) {
+        return;
+    }
+    free(ring->seqs);
+    free(ring->msgs);
+    free(ring);
+}
+
+History *history_create(size_t depth) {
+    if (depth == 0) {
+        return NULL;
+    }
+    History *history = calloc(1, sizeof(History));
+    if (!history) {
+        return NULL;
+    }
+    history->depth = depth;
+    history->lobby = ring_create("", depth);
+    history->index = ui_create(0);
+    if (!history->lobby || !history->index) {
+        history_destroy(history);
+        return NULL;
+    }
+    return history;
+}
+
+void history_destroy(History *history) {
+    if (!history) {
+        return;
+    }
+    for (size_t i = 0; i < history->room_count; i++) {
+        ring_free(history->rooms[i]);
+    }
+    ring_free(history->lobby);
+    ui_destroy(history->index);
+    free(history);
+}
+
+static HistoryRing *find_ring(const History *history, const char *room) {
+    return room[0] == '\0' ? history->lobby : ui_lookup(history->index, room);
+}
+
+/* A new room ring, evicting the one written longest ago when the table is full */
+static HistoryRing *add_ring(History *history, const char *room) {
+    if (history->room_count == HISTORY_ROOMS_MAX) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < history->room_count; i++) {
+            if (history->rooms[i]->last < history->rooms[oldest]->last) {
+                oldest = i;
+            }
+        }
+        HistoryRing *victim = history->rooms[oldest];
+        ui_remove(history->index, victim->room, victim);
+        ring_free(victim);
+        history->rooms[oldest] = history->rooms[--history->room_count];
+    }
+    HistoryRing *ring = ring_create(room, history->depth);
+    if (!ring) {
+        return NULL;
+    }
+    if (ui_insert(history->index, room, ring) < 0) {
+        ring_free(ring);
+        return NULL;
+    }
+    history->rooms[history->room_count++] = ring;
+    return ring;
+}
+
+void history_add(History *history, const ChatMessage *msg) {
+    HistoryRing *ring = find_ring(history, msg->room);
+    if (!ring && !(ring = add_ring(history, msg->room))) {
+        return;
+    }
+    size_t slot = (ring->head + ring->count) % history->depth;
+    if (ring->count == history->depth) {
+        ring->head = (ring->head + 1) % history->depth;
+    } else {
+        ring->count++;
+    }
+    ring->seqs[slot] = ++history->seq;
+    ring->msgs[slot] = *msg;
+    ring->msgs[slot].received_ns = 0;
+    ring->msgs[slot].trace_id = 0;
+    ring->last = history->seq;
+}
+
+uint64_t history_last(const History *history) {
+    return history->seq;
+}
+
+size_t history_since(const History *history, const char *room, uint64_t after, ChatMessage *out, size_t max) {
+    const HistoryRing *ring = find_ring(history, room);
+    if (!ring) {
+        return 0;
+    }
+    /* Entries are in sequence order, so skip from the oldest end */
+    size_t skip = ring->count > max ? ring->count - max : 0;
+    while (skip < ring->count && ring->seqs[(ring->head + skip) % history->depth] <= after) {
+        skip++;
+    }
+    size_t n = 0;
+    for (size_t i = skip; i < ring->count; i++) {
+        out[n++] = ring->msgs[(ring->head + i) % history->depth];
+    }
+    return n;
+}
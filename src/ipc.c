@@ -1,18 +1,36 @@
 #include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "chat.h"
 
+/* Block until fd is ready; lets the helpers below work on non-blocking sockets too. */
+static int wait_fd(int fd, short events) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 int send_all(int fd, const void *buf, size_t len) {
     size_t sent = 0;
     const char *p = buf;
     while (sent < len) {
-        ssize_t n = send(fd, p + sent, len - sent, 0);
+        ssize_t n = send(fd, p + sent, len - sent, MSG_NOSIGNAL);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
             }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd(fd, POLLOUT) == 0) {
+                continue;
+            }
             return -1;
         }
         if (n == 0) {
@@ -32,6 +50,9 @@ int recv_all(int fd, void *buf, size_t len) {
             if (errno == EINTR) {
                 continue;
             }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_fd(fd, POLLIN) == 0) {
+                continue;
+            }
             return -1;
         }
         if (n == 0) {
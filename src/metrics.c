@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "histogram.h"
+#include "metrics.h"
+
+#define METRICS_CACHE_LINE 64
+#define METRICS_MAX_GAUGES 80
+#define METRICS_GAUGE_NAME 32
+
+/* Internal per-thread slot - written by its owner only, read by reports */
+typedef struct MetricsSlot {
+    _Alignas(METRICS_CACHE_LINE) _Atomic uint64_t counters[MET_COUNTER_COUNT];
+    Histogram *_Atomic hists[MET_HIST_COUNT]; /* made on first observation */
+    struct MetricsSlot *next;
+} MetricsSlot;
+
+typedef struct Gauge {
+    char name[METRICS_GAUGE_NAME];
+    MetricGaugeFn fn;
+    void *arg;
+} Gauge;
+
+static const char *counter_names[MET_COUNTER_COUNT] = {
+    "accepted", "disconnected", "msgs_in", "msgs_dispatched", "frames_queued", "frames_dropped",
+    "outq_kicks", "flushes", "send_blocked", "send_errors", "uring_enters", "uring_sqes",
+    "history_replayed", "fanout_parallel", "fanout_steals", "rate_dropped", "rate_warned", "rate_paused",
+    "rate_kicked", "log_records", "log_writes", "log_syncs", "log_errors",
+};
+
+static const char *hist_names[MET_HIST_COUNT] = {"queue", "dispatch", "write", "log"};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MetricsSlot *slots = NULL;     /* live threads, guarded by registry_mutex */
+static MetricsSlot retired;           /* exited threads, guarded by registry_mutex */
+static int thread_count = 0;
+static Gauge gauges[METRICS_MAX_GAUGES];
+static size_t gauge_count = 0;
+static uint64_t start_ns = 0;        /* first registration, guarded by registry_mutex */
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local MetricsSlot *my_slot = NULL;
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t load(const _Atomic uint64_t *field) {
+    return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+static void fold_slot(MetricsSlot *dst, MetricsSlot *src) {
+    for (int i = 0; i < MET_COUNTER_COUNT; i++) {
+        atomic_store_explicit(&dst->counters[i], load(&dst->counters[i]) + load(&src->counters[i]),
+                              memory_order_relaxed);
+    }
+    for (int i = 0; i < MET_HIST_COUNT; i++) {
+        Histogram *hist = atomic_load_explicit(&src->hists[i], memory_order_acquire);
+        if (!hist) {
+            continue;
+        }
+        Histogram *into = atomic_load_explicit(&dst->hists[i], memory_order_relaxed);
+        if (!into) {
+            into = hist_create();
+            atomic_store_explicit(&dst->hists[i], into, memory_order_release);
+        }
+        if (into) {
+            hist_merge(into, hist);
+        }
+    }
+}
+
+static void free_slot(MetricsSlot *slot) {
+    for (int i = 0; i < MET_HIST_COUNT; i++) {
+        hist_destroy(atomic_load_explicit(&slot->hists[i], memory_order_relaxed));
+    }
+    free(slot);
+}
+
+/* Thread exit: keep the totals, drop the slot */
+static void retire_slot(void *arg) {
+    MetricsSlot *slot = arg;
+    pthread_mutex_lock(&registry_mutex);
+    for (MetricsSlot **pp = &slots; *pp; pp = &(*pp)->next) {
+        if (*pp == slot) {
+            *pp = slot->next;
+            break;
+        }
+    }
+    thread_count--;
+    fold_slot(&retired, slot);
+    pthread_mutex_unlock(&registry_mutex);
+    free_slot(slot);
+}
+
+static void make_key(void) {
+    pthread_key_create(&slot_key, retire_slot);
+}
+
+static MetricsSlot *thread_slot(void) {
+    if (my_slot) {
+        return my_slot;
+    }
+    pthread_once(&key_once, make_key);
+    MetricsSlot *slot = aligned_alloc(METRICS_CACHE_LINE, sizeof(MetricsSlot));
+    if (!slot) {
+        return NULL;
+    }
+    memset(slot, 0, sizeof(MetricsSlot));
+    pthread_mutex_lock(&registry_mutex);
+    slot->next = slots;
+    slots = slot;
+    thread_count++;
+    if (start_ns == 0) {
+        start_ns = metrics_now();
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    pthread_setspecific(slot_key, slot);
+    my_slot = slot;
+    return slot;
+}
+
+void metrics_count(MetricCounter counter, uint64_t n) {
+    MetricsSlot *slot = thread_slot();
+    if (slot) {
+        atomic_store_explicit(&slot->counters[counter], load(&slot->counters[counter]) + n,
+                              memory_order_relaxed);
+    }
+}
+
+void metrics_observe(MetricHist hist, uint64_t ns) {
+    MetricsSlot *slot = thread_slot();
+    if (!slot) {
+        return;
+    }
+    Histogram *h = atomic_load_explicit(&slot->hists[hist], memory_order_relaxed);
+    if (!h) {
+        if (!(h = hist_create())) {
+            return;
+        }
+        atomic_store_explicit(&slot->hists[hist], h, memory_order_release);
+    }
+    hist_record(h, ns);
+}
+
+void metrics_observe_since(MetricHist hist, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t now = metrics_now();
+    metrics_observe(hist, now > start ? now - start : 0);
+}
+
+int metrics_add_gauge(const char *name, MetricGaugeFn fn, void *arg) {
+    if (gauge_count == METRICS_MAX_GAUGES) {
+        return -1;
+    }
+    Gauge *gauge = &gauges[gauge_count++];
+    snprintf(gauge->name, sizeof(gauge->name), "%s", name);
+    gauge->fn = fn;
+    gauge->arg = arg;
+    pthread_mutex_lock(&registry_mutex);
+    if (start_ns == 0) {
+        start_ns = metrics_now();
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+static void print_latency_text(FILE *out, const char *name, const Histogram *hist) {
+    fprintf(out, "latency_us %s count=%llu p50=%.1f p99=%.1f p999=%.1f max=%.1f\n", name,
+            (unsigned long long)hist_count(hist), hist_percentile(hist, 50.0) / 1000.0,
+            hist_percentile(hist, 99.0) / 1000.0, hist_percentile(hist, 99.9) / 1000.0,
+            hist_max(hist) / 1000.0);
+}
+
+static void print_latency_json(FILE *out, const char *name, const Histogram *hist) {
+    fprintf(out, "\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", name,
+            (unsigned long long)hist_count(hist), (unsigned long long)hist_percentile(hist, 50.0),
+            (unsigned long long)hist_percentile(hist, 99.0), (unsigned long long)hist_percentile(hist, 99.9),
+            (unsigned long long)hist_max(hist));
+}
+
+char *metrics_render(int json) {
+    /* Gauges may take other locks, so they are sampled outside registry_mutex */
+    size_t values[METRICS_MAX_GAUGES];
+    for (size_t i = 0; i < gauge_count; i++) {
+        values[i] = gauges[i].fn(gauges[i].arg);
+    }
+
+    MetricsSlot *total = aligned_alloc(METRICS_CACHE_LINE, sizeof(MetricsSlot));
+    if (!total) {
+        return NULL;
+    }
+    memset(total, 0, sizeof(MetricsSlot));
+    pthread_mutex_lock(&registry_mutex);
+    int threads = thread_count;
+    uint64_t started = start_ns;
+    fold_slot(total, &retired);
+    for (MetricsSlot *slot = slots; slot; slot = slot->next) {
+        fold_slot(total, slot);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    Histogram *empty = hist_create();
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (!out || !empty) {
+        if (out) {
+            fclose(out);
+        }
+        free(buf);
+        hist_destroy(empty);
+        free_slot(total);
+        return NULL;
+    }
+
+    double uptime = started ? (double)(metrics_now() - started) / 1e9 : 0.0;
+    if (json) {
+        fprintf(out, "{\"uptime_s\":%.3f,\"threads\":%d,\"gauges\":{", uptime, threads);
+        for (size_t i = 0; i < gauge_count; i++) {
+            fprintf(out, "%s\"%s\":%zu", i ? "," : "", gauges[i].name, values[i]);
+        }
+        fprintf(out, "},\"counters\":{");
+        for (int i = 0; i < MET_COUNTER_COUNT; i++) {
+            fprintf(out, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+                    (unsigned long long)load(&total->counters[i]));
+        }
+        fprintf(out, "},\"latency_ns\":{");
+        for (int i = 0; i < MET_HIST_COUNT; i++) {
+            Histogram *hist = atomic_load_explicit(&total->hists[i], memory_order_relaxed);
+            fprintf(out, "%s", i ? "," : "");
+            print_latency_json(out, hist_names[i], hist ? hist : empty);
+        }
+        fprintf(out, "}}\n");
+    } else {
+        fprintf(out, "uptime_s %.3f\nthreads %d\n", uptime, threads);
+        for (size_t i = 0; i < gauge_count; i++) {
+            fprintf(out, "gauge %s %zu\n", gauges[i].name, values[i]);
+        }
+        for (int i = 0; i < MET_COUNTER_COUNT; i++) {
+            fprintf(out, "counter %s %llu\n", counter_names[i], (unsigned long long)load(&total->counters[i]));
+        }
+        for (int i = 0; i < MET_HIST_COUNT; i++) {
+            Histogram *hist = atomic_load_explicit(&total->hists[i], memory_order_relaxed);
+            print_latency_text(out, hist_names[i], hist ? hist : empty);
+        }
+    }
+    fclose(out);
+    hist_destroy(empty);
+    free_slot(total);
+    return buf;
+}
+
+void metrics_shutdown(void) {
+    pthread_mutex_lock(&registry_mutex);
+    MetricsSlot *slot = slots;
+    slots = NULL;
+    thread_count = 0;
+    pthread_mutex_unlock(&registry_mutex);
+    while (slot) {
+        MetricsSlot *next = slot->next;
+        free_slot(slot);
+        slot = next;
+    }
+    for (int i = 0; i < MET_HIST_COUNT; i++) {
+        hist_destroy(atomic_load_explicit(&retired.hists[i], memory_order_relaxed));
+        atomic_store_explicit(&retired.hists[i], NULL, memory_order_relaxed);
+    }
+    if (my_slot) {
+        pthread_setspecific(slot_key, NULL);
+        my_slot = NULL;
+    }
+}
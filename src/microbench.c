@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "histogram.h"
+#include "queue.h"
+
+#define MICRO_MAX_PRODUCERS 64
+#define MICRO_DEFAULT_OPS 1000000
+#define MICRO_DEFAULT_BYTES (256u << 20)
+#define MICRO_MAX_FRAME 65536
+
+static const size_t frame_sizes[] = {64, sizeof(ChatMessage), 4096, MICRO_MAX_FRAME};
+static const char *label = ""; /* first CSV column, e.g. a commit id */
+
+/* Producers wait here so every run starts from the same instant */
+typedef struct StartGate {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int open;
+} StartGate;
+
+typedef struct QueueRun {
+    MessageQueue *queue;
+    StartGate *gate;
+    size_t ops; /* pushes per producer */
+} QueueRun;
+
+typedef struct PipeRun {
+    int fd;
+    size_t frame_size;
+    size_t frames;
+    StartGate *gate;
+} PipeRun;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void gate_init(StartGate *gate) {
+    pthread_mutex_init(&gate->mutex, NULL);
+    pthread_cond_init(&gate->cond, NULL);
+    gate->open = 0;
+}
+
+static void gate_destroy(StartGate *gate) {
+    pthread_mutex_destroy(&gate->mutex);
+    pthread_cond_destroy(&gate->cond);
+}
+
+static void gate_wait(StartGate *gate) {
+    pthread_mutex_lock(&gate->mutex);
+    while (!gate->open) {
+        pthread_cond_wait(&gate->cond, &gate->mutex);
+    }
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static void gate_open(StartGate *gate) {
+    pthread_mutex_lock(&gate->mutex);
+    gate->open = 1;
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static void print_header(void) {
+    printf("label,suite,backend,producers,frame_size,ops,seconds,ops_per_sec,mb_per_sec,"
+           "p50_ns,p99_ns,p999_ns,max_ns\n");
+}
+
+static void print_row(const char *suite, const char *backend, int producers, size_t frame_size,
+                      uint64_t ops, double seconds, const Histogram *latency) {
+    printf("%s,%s,%s,%d,%zu,%llu,%.6f,%.1f,%.2f,%llu,%llu,%llu,%llu\n", label, suite, backend, producers,
+           frame_size, (unsigned long long)ops, seconds, (double)ops / seconds,
+           (double)ops * (double)frame_size / seconds / 1e6,
+           (unsigned long long)hist_percentile(latency, 50.0),
+           (unsigned long long)hist_percentile(latency, 99.0),
+           (unsigned long long)hist_percentile(latency, 99.9), (unsigned long long)hist_max(latency));
+    fflush(stdout);
+}
+
+/* The push time rides in the text, so the consumer can time each message */
+static void *queue_producer(void *arg) {
+    QueueRun *run = arg;
+    ChatMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.sender, USERNAME_MAX, "bench");
+    gate_wait(run->gate);
+    for (size_t i = 0; i < run->ops; i++) {
+        uint64_t now = monotonic_ns();
+        memcpy(msg.text, &now, sizeof(now));
+        mq_push(run->queue, &msg);
+    }
+    return NULL;
+}
+
+static int bench_queue(MQBackend backend, size_t capacity, int producers, size_t ops) {
+    MessageQueue *queue = mq_create_backend(backend, capacity);
+    Histogram *latency = hist_create();
+    if (!queue || !latency) {
+        perror("queue bench");
+        mq_destroy(queue);
+        hist_destroy(latency);
+        return -1;
+    }
+
+    StartGate gate;
+    gate_init(&gate);
+    QueueRun run = {queue, &gate, ops / (size_t)producers};
+    pthread_t threads[MICRO_MAX_PRODUCERS];
+    for (int i = 0; i < producers; i++) {
+        if (pthread_create(&threads[i], NULL, queue_producer, &run) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t total = (uint64_t)run.ops * (uint64_t)producers;
+    ChatMessage msg;
+    uint64_t start = monotonic_ns();
+    gate_open(&gate);
+    for (uint64_t i = 0; i < total; i++) {
+        if (mq_pop(queue, &msg) < 0) {
+            break;
+        }
+        uint64_t sent;
+        memcpy(&sent, msg.text, sizeof(sent));
+        uint64_t now = monotonic_ns();
+        hist_record(latency, now > sent ? now - sent : 0);
+    }
+    double seconds = (double)(monotonic_ns() - start) / 1e9;
+
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    print_row("queue", backend == MQ_BACKEND_RING ? "ring" : "list", producers, sizeof(ChatMessage), total,
+              seconds, latency);
+    gate_destroy(&gate);
+    hist_destroy(latency);
+    mq_destroy(queue);
+    return 0;
+}
+
+static void *pipe_sender(void *arg) {
+    PipeRun *run = arg;
+    unsigned char *frame = calloc(1, run->frame_size);
+    if (!frame) {
+        perror("calloc");
+        return NULL;
+    }
+    gate_wait(run->gate);
+    for (size_t i = 0; i < run->frames; i++) {
+        uint64_t now = monotonic_ns();
+        memcpy(frame, &now, sizeof(now));
+        if (send_all(run->fd, frame, run->frame_size) < 0) {
+            perror("send_all");
+            break;
+        }
+    }
+    free(frame);
+    return NULL;
+}
+
+/* One sender streams fixed-size frames through a socketpair into recv_all */
+static int bench_ipc(size_t frame_size, size_t bytes) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    unsigned char *frame = malloc(frame_size);
+    Histogram *latency = hist_create();
+    if (!frame || !latency) {
+        perror("ipc bench");
+        free(frame);
+        hist_destroy(latency);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    StartGate gate;
+    gate_init(&gate);
+    size_t frames = bytes / frame_size ? bytes / frame_size : 1;
+    PipeRun run = {fds[0], frame_size, frames, &gate};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pipe_sender, &run) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t done = 0;
+    uint64_t start = monotonic_ns();
+    gate_open(&gate);
+    for (; done < frames; done++) {
+        if (recv_all(fds[1], frame, frame_size) < 0) {
+            perror("recv_all");
+            break;
+        }
+        uint64_t sent;
+        memcpy(&sent, frame, sizeof(sent));
+        uint64_t now = monotonic_ns();
+        hist_record(latency, now > sent ? now - sent : 0);
+    }
+    double seconds = (double)(monotonic_ns() - start) / 1e9;
+
+    pthread_join(thread, NULL);
+    print_row("ipc", "socketpair", 1, frame_size, done, seconds, latency);
+    gate_destroy(&gate);
+    hist_destroy(latency);
+    free(frame);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--suite queue|ipc|all] [--backend list|ring|all] [--producers N]\n"
+            "          [--ops N] [--queue-size N] [--bytes N] [--label TEXT] [--no-header]\n",
+            prog);
+    fprintf(stderr, "Runs 1, 2, 4, ... up to --producers (default 4) producer threads per backend;\n"
+                    "prints one CSV row per run on stdout.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int run_queue = 1;
+    int run_ipc = 1;
+    int run_list = 1;
+    int run_ring = 1;
+    int max_producers = 4;
+    size_t ops = MICRO_DEFAULT_OPS;
+    size_t capacity = MQ_RING_DEFAULT_CAPACITY;
+    size_t bytes = MICRO_DEFAULT_BYTES;
+    int header = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--suite") == 0 && i + 1 < argc) {
+            const char *suite = argv[++i];
+            run_queue = strcmp(suite, "queue") == 0 || strcmp(suite, "all") == 0;
+            run_ipc = strcmp(suite, "ipc") == 0 || strcmp(suite, "all") == 0;
+            if (!run_queue && !run_ipc) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            run_list = strcmp(backend, "list") == 0 || strcmp(backend, "all") == 0;
+            run_ring = strcmp(backend, "ring") == 0 || strcmp(backend, "all") == 0;
+            if (!run_list && !run_ring) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--producers") == 0 && i + 1 < argc) {
+            max_producers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--queue-size") == 0 && i + 1 < argc) {
+            capacity = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--bytes") == 0 && i + 1 < argc) {
+            bytes = (size_t)atol(argv[++i]);
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = 0;
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_producers < 1 || max_producers > MICRO_MAX_PRODUCERS || ops == 0 || capacity == 0 || bytes == 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (header) {
+        print_header();
+    }
+    if (run_queue) {
+        /* 1, 2, 4, ... and always the requested count last */
+        for (int producers = 1;; producers = producers * 2 < max_producers ? producers * 2 : max_producers) {
+            if (run_list) {
+                bench_queue(MQ_BACKEND_LIST, capacity, producers, ops);
+            }
+            if (run_ring) {
+                bench_queue(MQ_BACKEND_RING, capacity, producers, ops);
+            }
+            if (producers == max_producers) {
+                break;
+            }
+        }
+    }
+    if (run_ipc) {
+        for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+            bench_ipc(frame_sizes[i], bytes);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+#include "shm.h"
+
+#define OUTQ_INITIAL_SLOTS 8
+#define OUTQ_IOV_MAX 128
+
+/* Internal queue structure - a ring that grows on demand up to the limit,
+ * so idle connections only pay for a handful of slots. */
+struct OutQueue {
+    SharedFrame **slots;
+    size_t allocated;
+    size_t limit;
+    size_t head;
+    size_t count;
+    size_t head_off; /* bytes of the head frame already written */
+    size_t busy;     /* head frames handed out by outq_peek_iov */
+};
+
+OutQueue *outq_create(size_t capacity) {
+    OutQueue *queue = calloc(1, sizeof(OutQueue));
+    if (!queue) {
+        return NULL;
+    }
+    queue->limit = capacity > 0 ? capacity : 1;
+    return queue;
+}
+
+static SharedFrame **slot_at(OutQueue *queue, size_t i) {
+    return &queue->slots[(queue->head + i) % queue->allocated];
+}
+
+static int grow(OutQueue *queue) {
+    size_t new_size = queue->allocated == 0 ? OUTQ_INITIAL_SLOTS : queue->allocated * 2;
+    if (new_size > queue->limit) {
+        new_size = queue->limit;
+    }
+    SharedFrame **slots = malloc(new_size * sizeof(SharedFrame *));
+    if (!slots) {
+        return -1;
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        slots[i] = *slot_at(queue, i);
+    }
+    free(queue->slots);
+    queue->slots = slots;
+    queue->allocated = new_size;
+    queue->head = 0;
+    return 0;
+}
+
+int outq_push(OutQueue *queue, SharedFrame *frame) {
+    if (queue->count == queue->limit) {
+        return -1;
+    }
+    if (queue->count == queue->allocated && grow(queue) < 0) {
+        return -1;
+    }
+    *slot_at(queue, queue->count) = frame_ref(frame);
+    queue->count++;
+    return 0;
+}
+
+static void pop_head(OutQueue *queue) {
+    frame_unref(queue->slots[queue->head]);
+    queue->head = (queue->head + 1) % queue->allocated;
+    queue->count--;
+    queue->head_off = 0;
+}
+
+int outq_drop_oldest(OutQueue *queue) {
+    /* Frames on the wire (or handed to the kernel) must stay; drop the first one behind them. */
+    size_t keep = queue->busy > 0 ? queue->busy : (queue->head_off > 0 ? 1 : 0);
+    if (queue->count <= keep) {
+        return -1;
+    }
+    if (keep == 0) {
+        pop_head(queue);
+        return 0;
+    }
+    frame_unref(*slot_at(queue, keep));
+    for (size_t i = keep; i > 0; i--) {
+        *slot_at(queue, i) = *slot_at(queue, i - 1);
+    }
+    queue->head = (queue->head + 1) % queue->allocated;
+    queue->count--;
+    return 0;
+}
+
+size_t outq_peek_iov(OutQueue *queue, struct iovec *iov, size_t max) {
+    size_t n = queue->count < max ? queue->count : max;
+    for (size_t i = 0; i < n; i++) {
+        SharedFrame *frame = *slot_at(queue, i);
+        size_t off = i == 0 ? queue->head_off : 0;
+        iov[i].iov_base = frame->data + off;
+        iov[i].iov_len = frame->len - off;
+    }
+    queue->busy = n;
+    return n;
+}
+
+void outq_complete(OutQueue *queue, size_t bytes) {
+    queue->busy = 0;
+    while (bytes > 0) {
+        SharedFrame *frame = *slot_at(queue, 0);
+        size_t remaining = frame->len - queue->head_off;
+        if (bytes < remaining) {
+            queue->head_off += bytes;
+            return;
+        }
+        bytes -= remaining;
+        pop_head(queue);
+    }
+}
+
+/* Bytes taken by the destination, 0 if it would block, -1 on error */
+typedef ssize_t (*WriteFn)(void *dst, struct iovec *iov, size_t count);
+
+static ssize_t write_socket(void *dst, struct iovec *iov, size_t count) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+    for (;;) {
+        ssize_t sent = sendmsg(*(int *)dst, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent >= 0) {
+            return sent;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
+static ssize_t write_shm(void *dst, struct iovec *iov, size_t count) {
+    return shm_writev(dst, iov, (int)count);
+}
+
+static int flush_to(OutQueue *queue, WriteFn write_fn, void *dst) {
+    while (queue->count > 0) {
+        struct iovec iov[OUTQ_IOV_MAX];
+        size_t n = outq_peek_iov(queue, iov, OUTQ_IOV_MAX);
+        ssize_t sent = write_fn(dst, iov, n);
+        outq_complete(queue, sent > 0 ? (size_t)sent : 0);
+        if (sent <= 0) {
+            return (int)sent;
+        }
+    }
+    return 1;
+}
+
+int outq_flush(OutQueue *queue, int fd) {
+    return flush_to(queue, write_socket, &fd);
+}
+
+int outq_flush_shm(OutQueue *queue, ShmChannel *ch) {
+    return flush_to(queue, write_shm, ch);
+}
+
+size_t outq_depth(const OutQueue *queue) {
+    return queue->count;
+}
+
+const SharedFrame *outq_head(const OutQueue *queue) {
+    return outq_at(queue, 0);
+}
+
+const SharedFrame *outq_at(const OutQueue *queue, size_t i) {
+    return i < queue->count ? queue->slots[(queue->head + i) % queue->allocated] : NULL;
+}
+
+size_t outq_head_offset(const OutQueue *queue) {
+    return queue->head_off;
+}
+
+void outq_destroy(OutQueue *queue) {
+    if (!queue) {
+        return;
+    }
+    while (queue->count > 0) {
+        pop_head(queue);
+    }
+    free(queue->slots);
+    free(queue);
+}
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_CACHE_LINE 64
+#define POOL_SLAB_BYTES (64 * 1024)
+#define POOL_BATCH 32                 /* objects moved between a thread cache and the shared list at once */
+#define POOL_CACHE_MAX (2 * POOL_BATCH) /* a thread cache above this gives a batch back */
+#define POOL_NAME_MAX 32
+
+/* Internal free object - the link lives in the object's own first bytes */
+typedef struct FreeObject {
+    struct FreeObject *next;
+} FreeObject;
+
+/* Internal slab header - padded to a cache line so the objects after it stay aligned */
+typedef struct Slab {
+    _Alignas(POOL_CACHE_LINE) struct Slab *next;
+} Slab;
+
+struct ObjectPool {
+    char name[POOL_NAME_MAX];
+    size_t size;
+    size_t per_slab;
+    int id;
+    pthread_mutex_t mutex; /* guards everything below */
+    FreeObject *shared;
+    size_t shared_count;
+    Slab *slabs;
+    size_t slab_count;
+    size_t objects;
+    long in_use; /* allocations minus frees folded in from the thread caches */
+    size_t high_water;
+};
+
+/* Internal per-thread cache of one pool - touched by its owner only, except
+ * that pool_stats reads in_use */
+typedef struct PoolCache {
+    FreeObject *head;
+    size_t count;
+    atomic_long in_use; /* allocations minus frees since the last fold; negative if
+                           the thread frees what others allocated */
+} PoolCache;
+
+typedef struct ThreadCaches {
+    PoolCache caches[POOL_MAX];
+    struct ThreadCaches *prev, *next; /* every live thread's caches, guarded by registry_mutex */
+} ThreadCaches;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ObjectPool *_Atomic pools[POOL_MAX]; /* by id */
+static int pool_count = 0;                  /* ids handed out, guarded by registry_mutex */
+static ThreadCaches *live_caches = NULL;    /* guarded by registry_mutex */
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t caches_key;
+static _Thread_local ThreadCaches *my_caches = NULL;
+
+/* Only the owner changes a cache's count, so plain loads and stores will do */
+static void count_in_use(PoolCache *cache, long delta) {
+    long n = atomic_load_explicit(&cache->in_use, memory_order_relaxed);
+    atomic_store_explicit(&cache->in_use, n + delta, memory_order_relaxed);
+}
+
+/* Move a cache's count into the pool's, where the high water mark can see it.
+ * Called by the owner with pool->mutex held. */
+static void fold_in_use(ObjectPool *pool, PoolCache *cache) {
+    pool->in_use += atomic_load_explicit(&cache->in_use, memory_order_relaxed);
+    atomic_store_explicit(&cache->in_use, 0, memory_order_relaxed);
+    if (pool->in_use > 0 && (size_t)pool->in_use > pool->high_water) {
+        pool->high_water = (size_t)pool->in_use;
+    }
+}
+
+/* Hand the first n objects of a cache back to the shared list */
+static void drain(ObjectPool *pool, PoolCache *cache, size_t n) {
+    FreeObject *first = cache->head;
+    FreeObject *last = first;
+    for (size_t i = 1; i < n; i++) {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= n;
+    pthread_mutex_lock(&pool->mutex);
+    last->next = pool->shared;
+    pool->shared = first;
+    pool->shared_count += n;
+    fold_in_use(pool, cache);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Thread exit: whatever the thread still caches goes back to its pool */
+static void flush_caches(void *arg) {
+    ThreadCaches *tc = arg;
+    for (int i = 0; i < POOL_MAX; i++) {
+        ObjectPool *pool = atomic_load(&pools[i]);
+        if (pool && tc->caches[i].count > 0) {
+            drain(pool, &tc->caches[i], tc->caches[i].count);
+        } else if (pool) {
+            pthread_mutex_lock(&pool->mutex);
+            fold_in_use(pool, &tc->caches[i]);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+    pthread_mutex_lock(&registry_mutex);
+    if (tc->prev) {
+        tc->prev->next = tc->next;
+    } else {
+        live_caches = tc->next;
+    }
+    if (tc->next) {
+        tc->next->prev = tc->prev;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    my_caches = NULL;
+    free(tc);
+}
+
+static void make_key(void) {
+    pthread_key_create(&caches_key, flush_caches);
+}
+
+/* NULL if the thread has no cache and none could be made; callers then go
+ * straight to the shared list */
+static PoolCache *thread_cache(const ObjectPool *pool) {
+    if (!my_caches) {
+        pthread_once(&key_once, make_key);
+        ThreadCaches *tc = calloc(1, sizeof(ThreadCaches));
+        if (!tc) {
+            return NULL;
+        }
+        pthread_setspecific(caches_key, tc);
+        my_caches = tc;
+        pthread_mutex_lock(&registry_mutex);
+        tc->next = live_caches;
+        if (live_caches) {
+            live_caches->prev = tc;
+        }
+        live_caches = tc;
+        pthread_mutex_unlock(&registry_mutex);
+    }
+    return &my_caches->caches[pool->id];
+}
+
+/* Caller holds pool->mutex */
+static int grow(ObjectPool *pool) {
+    Slab *slab = aligned_alloc(POOL_CACHE_LINE, sizeof(Slab) + pool->per_slab * pool->size);
+    if (!slab) {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    unsigned char *base = (unsigned char *)(slab + 1);
+    for (size_t i = pool->per_slab; i-- > 0;) {
+        FreeObject *obj = (FreeObject *)(base + i * pool->size);
+        obj->next = pool->shared;
+        pool->shared = obj;
+    }
+    pool->shared_count += pool->per_slab;
+    pool->objects += pool->per_slab;
+    return 0;
+}
+
+/* Move up to want objects from the shared list into cache; returns how many */
+static size_t refill(ObjectPool *pool, PoolCache *cache, size_t want) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->shared_count < want && grow(pool) < 0 && pool->shared_count == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return 0;
+    }
+    size_t n = 0;
+    while (n < want && pool->shared) {
+        FreeObject *obj = pool->shared;
+        pool->shared = obj->next;
+        obj->next = cache->head;
+        cache->head = obj;
+        n++;
+    }
+    pool->shared_count -= n;
+    fold_in_use(pool, cache);
+    pthread_mutex_unlock(&pool->mutex);
+    cache->count += n;
+    return n;
+}
+
+ObjectPool *pool_create(const char *name, size_t object_size) {
+    ObjectPool *pool = calloc(1, sizeof(ObjectPool));
+    if (!pool) {
+        return NULL;
+    }
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    /* A cache line each, so objects used by different threads never share one */
+    size_t size = object_size < sizeof(FreeObject) ? sizeof(FreeObject) : object_size;
+    pool->size = (size + POOL_CACHE_LINE - 1) / POOL_CACHE_LINE * POOL_CACHE_LINE;
+    pool->per_slab = POOL_SLAB_BYTES / pool->size;
+    if (pool->per_slab < POOL_BATCH) {
+        pool->per_slab = POOL_BATCH;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    pthread_mutex_lock(&registry_mutex);
+    if (pool_count == POOL_MAX) {
+        pthread_mutex_unlock(&registry_mutex);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return NULL;
+    }
+    pool->id = pool_count++;
+    atomic_store(&pools[pool->id], pool);
+    pthread_mutex_unlock(&registry_mutex);
+    return pool;
+}
+
+void *pool_alloc(ObjectPool *pool) {
+    PoolCache *cache = thread_cache(pool);
+    if (!cache) {
+        PoolCache one = {NULL, 0, 1};
+        return refill(pool, &one, 1) ? one.head : NULL;
+    }
+    if (!cache->head && refill(pool, cache, POOL_BATCH) == 0) {
+        return NULL;
+    }
+    FreeObject *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    count_in_use(cache, 1);
+    return obj;
+}
+
+void pool_free(ObjectPool *pool, void *obj) {
+    if (!obj) {
+        return;
+    }
+    PoolCache *cache = thread_cache(pool);
+    FreeObject *node = obj;
+    if (!cache) {
+        PoolCache one = {node, 1, -1};
+        node->next = NULL;
+        drain(pool, &one, 1);
+        return;
+    }
+    node->next = cache->head;
+    cache->head = node;
+    count_in_use(cache, -1);
+    if (++cache->count > POOL_CACHE_MAX) {
+        drain(pool, cache, POOL_BATCH);
+    }
+}
+
+void pool_stats(ObjectPool *pool, PoolStats *out) {
+    pthread_mutex_lock(&pool->mutex);
+    /* Add what the threads have not folded in yet */
+    long in_use = pool->in_use;
+    pthread_mutex_lock(&registry_mutex);
+    for (ThreadCaches *tc = live_caches; tc; tc = tc->next) {
+        in_use += atomic_load_explicit(&tc->caches[pool->id].in_use, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    size_t outstanding = in_use > 0 ? (size_t)in_use : 0;
+    if (outstanding > pool->high_water) {
+        pool->high_water = outstanding;
+    }
+    out->object_size = pool->size;
+    out->slabs = pool->slab_count;
+    out->objects = pool->objects;
+    out->outstanding = outstanding;
+    out->high_water = pool->high_water;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+const char *pool_name(const ObjectPool *pool) {
+    return pool->name;
+}
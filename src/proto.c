@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+size_t varint_encode(uint64_t value, unsigned char *out) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+int varint_decode(const unsigned char *buf, size_t len, uint64_t *value, size_t *used) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < PROTO_VARINT_MAX; i++) {
+        if (i == len) {
+            return 0;
+        }
+        result |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            *value = result;
+            *used = i + 1;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+int proto_frame_size(int version, const void *buf, size_t len, size_t *frame_len) {
+    if (version == PROTO_LEGACY) {
+        if (len < sizeof(LegacyMessage)) {
+            return 0;
+        }
+        *frame_len = sizeof(LegacyMessage);
+        return 1;
+    }
+
+    uint64_t body = 0;
+    size_t used = 0;
+    int rc = varint_decode(buf, len, &body, &used);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (body == 0 || body > PROTO_MAX_FRAME) {
+        return -1;
+    }
+    if (len < used + body) {
+        return 0;
+    }
+    *frame_len = used + (size_t)body;
+    return 1;
+}
+
+/* Copy a length-prefixed string; PROTO_TOO_LONG if it does not fit the destination
+ * field, which is still skipped so the rest of the frame is checked. */
+static int read_field(const unsigned char **p, const unsigned char *end, char *dst, size_t cap) {
+    uint64_t n = 0;
+    size_t used = 0;
+    if (varint_decode(*p, (size_t)(end - *p), &n, &used) != 1) {
+        return -1;
+    }
+    *p += used;
+    if (n > (uint64_t)(end - *p)) {
+        return -1;
+    }
+    int rc = n < cap ? 0 : PROTO_TOO_LONG;
+    size_t keep = rc == 0 ? (size_t)n : 0;
+    memcpy(dst, *p, keep);
+    dst[keep] = '\0';
+    *p += n;
+    return rc;
+}
+
+/* The other way round: a pre-v3 broadcast whose text starts with "#room " is a
+ * message to that room, typically a reply to one fold_room_into_text produced. */
+static void unfold_room_from_text(ChatMessage *msg) {
+    if (msg->target[0] != '\0' || msg->text[0] != '#') {
+        return;
+    }
+    size_t len = 1;
+    while (len < ROOM_MAX - 1 && isgraph((unsigned char)msg->text[len])) {
+        len++;
+    }
+    if (len < 2 || msg->text[len] != ' ') {
+        return;
+    }
+    memcpy(msg->room, msg->text, len);
+    msg->room[len] = '\0';
+    memmove(msg->text, msg->text + len + 1, TEXT_MAX - len - 1);
+}
+
+int proto_decode(int version, const void *frame, size_t len, ChatMessage *out) {
+    if (version == PROTO_LEGACY) {
+        LegacyMessage legacy;
+        if (len != sizeof(LegacyMessage)) {
+            return -1;
+        }
+        memcpy(&legacy, frame, sizeof(legacy));
+        memset(out, 0, sizeof(*out));
+        memcpy(out->sender, legacy.sender, USERNAME_MAX);
+        memcpy(out->target, legacy.target, USERNAME_MAX);
+        memcpy(out->text, legacy.text, TEXT_MAX);
+        out->timestamp = legacy.timestamp;
+        unfold_room_from_text(out);
+        return 0;
+    }
+
+    const unsigned char *p = frame;
+    const unsigned char *end = p + len;
+    uint64_t value = 0;
+    size_t used = 0;
+    if (varint_decode(p, len, &value, &used) != 1) {
+        return -1;
+    }
+    p += used;
+    if (end - p < 2 || p[0] != FRAME_MSG) {
+        return -1;
+    }
+    p += 2; /* type, flags */
+
+    memset(out, 0, sizeof(*out));
+    if (varint_decode(p, (size_t)(end - p), &value, &used) != 1) {
+        return -1;
+    }
+    p += used;
+    out->timestamp = (time_t)value;
+    char *dst[] = {out->sender, out->target, out->text, out->room};
+    const size_t cap[] = {USERNAME_MAX, USERNAME_MAX, TEXT_MAX, ROOM_MAX};
+    int count = version >= PROTO_V3 ? 4 : 3;
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        int field = read_field(&p, end, dst[i], cap[i]);
+        if (field == -1) {
+            return -1;
+        }
+        if (field == PROTO_TOO_LONG) {
+            rc = PROTO_TOO_LONG;
+        }
+    }
+    if (p != end) {
+        return -1;
+    }
+    if (version < PROTO_V3) {
+        unfold_room_from_text(out);
+    }
+    return rc;
+}
+
+static size_t put_field(unsigned char *p, const char *s, size_t cap) {
+    size_t n = strnlen(s, cap);
+    size_t used = varint_encode(n, p);
+    memcpy(p + used, s, n);
+    return used + n;
+}
+
+/* Pre-v3 peers get "#room text" since they have nowhere else to put the room. */
+static void fold_room_into_text(const ChatMessage *msg, char *text) {
+    if (msg->room[0] == '\0') {
+        memcpy(text, msg->text, TEXT_MAX);
+        return;
+    }
+    size_t rlen = strnlen(msg->room, ROOM_MAX - 1);
+    size_t tlen = strnlen(msg->text, TEXT_MAX - 1);
+    if (rlen + 1 + tlen > TEXT_MAX - 1) {
+        tlen = TEXT_MAX - 2 - rlen;
+    }
+    memcpy(text, msg->room, rlen);
+    text[rlen] = ' ';
+    memcpy(text + rlen + 1, msg->text, tlen);
+    text[rlen + 1 + tlen] = '\0';
+}
+
+size_t proto_encode(int version, const ChatMessage *msg, void *buf, size_t cap) {
+    char text[TEXT_MAX];
+    if (version < PROTO_V3) {
+        fold_room_into_text(msg, text);
+    }
+
+    if (version == PROTO_LEGACY) {
+        LegacyMessage legacy;
+        if (cap < sizeof(legacy)) {
+            return 0;
+        }
+        memset(&legacy, 0, sizeof(legacy));
+        memcpy(legacy.sender, msg->sender, USERNAME_MAX);
+        memcpy(legacy.target, msg->target, USERNAME_MAX);
+        memcpy(legacy.text, text, TEXT_MAX);
+        legacy.timestamp = msg->timestamp;
+        memcpy(buf, &legacy, sizeof(legacy));
+        return sizeof(legacy);
+    }
+
+    /* Encode the body first, then prepend its length. */
+    unsigned char body[PROTO_MAX_ENCODED];
+    size_t n = 0;
+    body[n++] = FRAME_MSG;
+    body[n++] = 0;
+    n += varint_encode((uint64_t)msg->timestamp, body + n);
+    n += put_field(body + n, msg->sender, USERNAME_MAX);
+    n += put_field(body + n, msg->target, USERNAME_MAX);
+    if (version >= PROTO_V3) {
+        n += put_field(body + n, msg->text, TEXT_MAX);
+        n += put_field(body + n, msg->room, ROOM_MAX);
+    } else {
+        n += put_field(body + n, text, TEXT_MAX);
+    }
+
+    unsigned char prefix[PROTO_VARINT_MAX];
+    size_t plen = varint_encode(n, prefix);
+    if (plen + n > cap) {
+        return 0;
+    }
+    memcpy(buf, prefix, plen);
+    memcpy((unsigned char *)buf + plen, body, n);
+    return plen + n;
+}
+
+int proto_send(int fd, int version, const ChatMessage *msg) {
+    unsigned char buf[PROTO_MAX_ENCODED];
+    size_t len = proto_encode(version, msg, buf, sizeof(buf));
+    if (len == 0) {
+        return -1;
+    }
+    return send_all(fd, buf, len);
+}
+
+int proto_recv(int fd, int version, ChatMessage *out) {
+    if (version == PROTO_LEGACY) {
+        LegacyMessage legacy;
+        if (recv_all(fd, &legacy, sizeof(legacy)) < 0) {
+            return -1;
+        }
+        return proto_decode(version, &legacy, sizeof(legacy), out);
+    }
+
+    unsigned char prefix[PROTO_VARINT_MAX];
+    uint64_t body = 0;
+    size_t used = 0;
+    size_t got = 0;
+    int rc = 0;
+    while (rc == 0) {
+        if (recv_all(fd, prefix + got, 1) < 0) {
+            return -1;
+        }
+        got++;
+        rc = varint_decode(prefix, got, &body, &used);
+    }
+    if (rc < 0 || body == 0 || body > PROTO_MAX_FRAME) {
+        return -1;
+    }
+
+    unsigned char *frame = malloc(used + (size_t)body);
+    if (!frame) {
+        return -1;
+    }
+    memcpy(frame, prefix, used);
+    rc = recv_all(fd, frame + used, (size_t)body);
+    if (rc == 0) {
+        rc = proto_decode(version, frame, used + (size_t)body, out);
+    }
+    free(frame);
+    return rc;
+}
+
+int proto_hello_version(const ChatMessage *hello) {
+    const char *tag = strstr(hello->text, PROTO_HELLO_TAG);
+    if (!tag) {
+        return PROTO_LEGACY;
+    }
+    long v = strtol(tag + strlen(PROTO_HELLO_TAG), NULL, 10);
+    if (v < PROTO_LEGACY) {
+        return PROTO_LEGACY;
+    }
+    return v > PROTO_MAX_VERSION ? PROTO_MAX_VERSION : (int)v;
+}
+
+int proto_hello_shm(const ChatMessage *hello) {
+    size_t len = strlen(hello->text);
+    size_t taglen = strlen(PROTO_SHM_TAG);
+    return proto_hello_version(hello) > PROTO_LEGACY && len >= taglen &&
+           strcmp(hello->text + len - taglen, PROTO_SHM_TAG) == 0;
+}
+
+void proto_make_ack(ChatMessage *ack, int version, int shm) {
+    memset(ack, 0, sizeof(*ack));
+    snprintf(ack->sender, USERNAME_MAX, "SYSTEM");
+    snprintf(ack->text, TEXT_MAX, "%s%d%s", PROTO_HELLO_TAG, version, shm ? PROTO_SHM_TAG : "");
+    ack->timestamp = time(NULL);
+}
+
+int proto_ack_version(const ChatMessage *msg) {
+    size_t taglen = strlen(PROTO_HELLO_TAG);
+    if (strncmp(msg->sender, "SYSTEM", USERNAME_MAX) != 0 || msg->target[0] != '\0' ||
+        strncmp(msg->text, PROTO_HELLO_TAG, taglen) != 0) {
+        return 0;
+    }
+    char *end = NULL;
+    long v = strtol(msg->text + taglen, &end, 10);
+    if (end == msg->text + taglen || (*end != '\0' && strcmp(end, PROTO_SHM_TAG) != 0)) {
+        return 0;
+    }
+    return v >= PROTO_LEGACY && v <= PROTO_MAX_VERSION ? (int)v : 0;
+}
+
+int proto_ack_shm(const ChatMessage *ack) {
+    size_t len = strlen(ack->text);
+    size_t taglen = strlen(PROTO_SHM_TAG);
+    return proto_ack_version(ack) > PROTO_LEGACY && len >= taglen &&
+           strcmp(ack->text + len - taglen, PROTO_SHM_TAG) == 0;
+}
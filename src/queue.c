@@ -1,39 +1,347 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "pool.h"
 #include "queue.h"
 
+#define MQ_CACHE_LINE 64
+#define MQ_SPIN_LIMIT 64
+
 /* Internal node structure - not exposed in header */
 typedef struct MessageNode {
     ChatMessage msg;
     struct MessageNode *next;
 } MessageNode;
 
+/* Ring slot: seq == position means free for that lap, position + 1 means filled */
+typedef struct RingCell {
+    _Alignas(MQ_CACHE_LINE) atomic_size_t seq;
+    ChatMessage msg;
+} RingCell;
+
+/*
+ * Bounded multi-producer/single-consumer ring (Vyukov-style sequenced cells).
+ * Producers claim a position with a CAS on tail; the consumer owns head.
+ * Sleeping is coordinated through two futex eventcounts so a burst of pushes
+ * costs at most one wakeup syscall for the consumer.
+ */
+typedef struct Ring {
+    _Alignas(MQ_CACHE_LINE) atomic_size_t tail;
+    _Alignas(MQ_CACHE_LINE) size_t head;
+    atomic_size_t consumed;  /* head as published for mq_depth */
+    _Alignas(MQ_CACHE_LINE) _Atomic uint32_t data_seq;  /* bumped to wake the consumer */
+    atomic_int consumer_waiting;
+    _Alignas(MQ_CACHE_LINE) _Atomic uint32_t space_seq; /* bumped to wake blocked producers */
+    atomic_int producers_waiting;
+    atomic_int closed;
+    size_t mask;
+    RingCell *cells;
+} Ring;
+
 /* Internal queue structure - not exposed in header */
 struct MessageQueue {
+    MQBackend backend;
+    Ring *ring;
     MessageNode *head;
     MessageNode *tail;
+    size_t count;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     int closed;
+    /* Laned queues only: a plain queue per lane, which the consumer never sleeps
+     * on; it waits on lane_seq instead, bumped by the push that finds it waiting */
+    struct MessageQueue *lane[MQ_LANE_COUNT];
+    unsigned weight[MQ_LANE_COUNT];
+    _Atomic uint32_t lane_seq;
+    atomic_int lane_waiting;
+    atomic_int lane_closed;
 };
 
-MessageQueue *mq_create(void) {
-    MessageQueue *queue = malloc(sizeof(MessageQueue));
+/* List nodes of every queue come from one pool, made with the first queue */
+static pthread_once_t node_pool_once = PTHREAD_ONCE_INIT;
+static ObjectPool *node_pool = NULL;
+
+static void make_node_pool(void) {
+    node_pool = pool_create("node", sizeof(MessageNode));
+}
+
+ObjectPool *mq_node_pool(void) {
+    pthread_once(&node_pool_once, make_node_pool);
+    return node_pool;
+}
+
+/* timeout is relative; NULL waits forever */
+static void futex_wait(_Atomic uint32_t *word, uint32_t expected, const struct timespec *timeout) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void deadline_after(clockid_t clock, int timeout_ms, struct timespec *deadline) {
+    clock_gettime(clock, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Time left until a CLOCK_MONOTONIC deadline; 0 once it has passed. */
+static int time_left(const struct timespec *deadline, struct timespec *left) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+    return left->tv_sec >= 0;
+}
+
+static void futex_wake(_Atomic uint32_t *word, int count) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static Ring *ring_create(size_t capacity) {
+    size_t n = 2;
+    while (n < capacity) {
+        n *= 2;
+    }
+    Ring *ring = aligned_alloc(MQ_CACHE_LINE, sizeof(Ring));
+    if (!ring) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(Ring));
+    ring->cells = aligned_alloc(MQ_CACHE_LINE, n * sizeof(RingCell));
+    if (!ring->cells) {
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+    ring->mask = n - 1;
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    return ring;
+}
+
+/* Claim a free cell; NULL if the ring is full. */
+static RingCell *ring_claim(Ring *ring, size_t *pos_out) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        RingCell *cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return cell;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_push(Ring *ring, const ChatMessage *msg) {
+    size_t pos = 0;
+    RingCell *cell = NULL;
+    int spins = 0;
+    if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+        return;
+    }
+    while (!(cell = ring_claim(ring, &pos))) {
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            return;
+        }
+        if (spins++ < MQ_SPIN_LIMIT) {
+            sched_yield();
+            continue;
+        }
+        uint32_t ticket = atomic_load(&ring->space_seq);
+        atomic_fetch_add(&ring->producers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        cell = ring_claim(ring, &pos);
+        if (!cell && !atomic_load(&ring->closed)) {
+            futex_wait(&ring->space_seq, ticket, NULL);
+        }
+        atomic_fetch_sub(&ring->producers_waiting, 1);
+        if (cell) {
+            break;
+        }
+    }
+    memcpy(&cell->msg, msg, sizeof(ChatMessage));
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->consumer_waiting, memory_order_relaxed) &&
+        atomic_exchange(&ring->consumer_waiting, 0)) {
+        atomic_fetch_add(&ring->data_seq, 1);
+        futex_wake(&ring->data_seq, 1);
+    }
+}
+
+/* Take up to max filled cells; producers blocked on a full ring get one wakeup per call. */
+static size_t ring_try_pop(Ring *ring, ChatMessage *out, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        size_t pos = ring->head;
+        RingCell *cell = &ring->cells[pos & ring->mask];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) {
+            break;
+        }
+        memcpy(&out[n++], &cell->msg, sizeof(ChatMessage));
+        atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+        ring->head = pos + 1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    atomic_store_explicit(&ring->consumed, ring->head, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->producers_waiting, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&ring->space_seq, 1);
+        futex_wake(&ring->space_seq, INT32_MAX);
+    }
+    return n;
+}
+
+static int ring_pop(Ring *ring, ChatMessage *out, size_t max, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        deadline_after(CLOCK_MONOTONIC, timeout_ms, &deadline);
+    }
+    for (;;) {
+        size_t n = ring_try_pop(ring, out, max);
+        if (n > 0) {
+            return (int)n;
+        }
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire)) {
+            return -1;
+        }
+        uint32_t ticket = atomic_load(&ring->data_seq);
+        atomic_store(&ring->consumer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        n = ring_try_pop(ring, out, max);
+        if (n > 0) {
+            atomic_store(&ring->consumer_waiting, 0);
+            return (int)n;
+        }
+        struct timespec left;
+        if (timeout_ms >= 0 && !time_left(&deadline, &left)) {
+            atomic_store(&ring->consumer_waiting, 0);
+            return 0;
+        }
+        if (!atomic_load(&ring->closed)) {
+            futex_wait(&ring->data_seq, ticket, timeout_ms >= 0 ? &left : NULL);
+        }
+        atomic_store(&ring->consumer_waiting, 0);
+    }
+}
+
+static void ring_close(Ring *ring) {
+    atomic_store(&ring->closed, 1);
+    atomic_fetch_add(&ring->data_seq, 1);
+    atomic_fetch_add(&ring->space_seq, 1);
+    futex_wake(&ring->data_seq, INT32_MAX);
+    futex_wake(&ring->space_seq, INT32_MAX);
+}
+
+static void ring_destroy(Ring *ring) {
+    free(ring->cells);
+    free(ring);
+}
+
+MessageQueue *mq_create_backend(MQBackend backend, size_t capacity) {
+    if (backend == MQ_BACKEND_LIST && !mq_node_pool()) {
+        return NULL;
+    }
+    MessageQueue *queue = calloc(1, sizeof(MessageQueue));
     if (!queue) {
         return NULL;
     }
+    queue->backend = backend;
+    queue->ring = NULL;
+    if (backend == MQ_BACKEND_RING) {
+        queue->ring = ring_create(capacity > 0 ? capacity : MQ_RING_DEFAULT_CAPACITY);
+        if (!queue->ring) {
+            free(queue);
+            return NULL;
+        }
+    }
     queue->head = NULL;
     queue->tail = NULL;
+    queue->count = 0;
     queue->closed = 0;
     pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->cond, &attr);
+    pthread_condattr_destroy(&attr);
     return queue;
 }
 
+MessageQueue *mq_create(void) {
+    return mq_create_backend(MQ_BACKEND_LIST, 0);
+}
+
+MessageQueue *mq_create_lanes(MQBackend backend, size_t capacity, const unsigned weights[MQ_LANE_COUNT]) {
+    MessageQueue *queue = mq_create_backend(MQ_BACKEND_LIST, 0);
+    if (!queue) {
+        return NULL;
+    }
+    for (int i = 0; i < MQ_LANE_COUNT; i++) {
+        queue->lane[i] = mq_create_backend(backend, capacity);
+        if (!queue->lane[i]) {
+            mq_destroy(queue);
+            return NULL;
+        }
+        queue->weight[i] = weights[i] > 0 ? weights[i] : 1;
+    }
+    return queue;
+}
+
+void mq_push_lane(MessageQueue *queue, MQLane lane, const ChatMessage *msg) {
+    if (!queue->lane[0]) {
+        mq_push(queue, msg);
+        return;
+    }
+    mq_push(queue->lane[lane], msg);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->lane_waiting, memory_order_relaxed) &&
+        atomic_exchange(&queue->lane_waiting, 0)) {
+        atomic_fetch_add(&queue->lane_seq, 1);
+        futex_wake(&queue->lane_seq, 1);
+    }
+}
+
 void mq_push(MessageQueue *queue, const ChatMessage *msg) {
-    MessageNode *node = malloc(sizeof(MessageNode));
+    if (queue->lane[0]) {
+        mq_push_lane(queue, MQ_LANE_BULK, msg);
+        return;
+    }
+    if (queue->ring) {
+        ring_push(queue->ring, msg);
+        return;
+    }
+
+    MessageNode *node = pool_alloc(node_pool);
     if (!node) {
         return;
     }
@@ -43,7 +351,7 @@ void mq_push(MessageQueue *queue, const ChatMessage *msg) {
     pthread_mutex_lock(&queue->mutex);
     if (queue->closed) {
         pthread_mutex_unlock(&queue->mutex);
-        free(node);
+        pool_free(node_pool, node);
         return;
     }
 
@@ -53,49 +361,215 @@ void mq_push(MessageQueue *queue, const ChatMessage *msg) {
     } else {
         queue->head = queue->tail = node;
     }
+    queue->count++;
     pthread_cond_signal(&queue->cond);
     pthread_mutex_unlock(&queue->mutex);
 }
 
 int mq_pop(MessageQueue *queue, ChatMessage *out) {
-    pthread_mutex_lock(&queue->mutex);
-    while (!queue->head && !queue->closed) {
-        pthread_cond_wait(&queue->cond, &queue->mutex);
+    return mq_pop_batch(queue, out, 1) < 0 ? -1 : 0;
+}
+
+int mq_pop_batch(MessageQueue *queue, ChatMessage *out, size_t max) {
+    return mq_pop_batch_timed(queue, out, max, -1);
+}
+
+/* Detach up to max nodes under one lock hold, copy them out afterwards. Caller
+ * holds the mutex of a non-empty list queue; it is released here. */
+static size_t list_take(MessageQueue *queue, ChatMessage *out, size_t max) {
+    MessageNode *first = queue->head;
+    MessageNode *last = first;
+    size_t n = 1;
+    while (n < max && last->next) {
+        last = last->next;
+        n++;
     }
+    queue->head = last->next;
+    queue->count -= n;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    last->next = NULL;
+    pthread_mutex_unlock(&queue->mutex);
 
+    size_t i = 0;
+    MessageNode *node = first;
+    while (node) {
+        MessageNode *next = node->next;
+        memcpy(&out[i++], &node->msg, sizeof(ChatMessage));
+        pool_free(node_pool, node);
+        node = next;
+    }
+    return n;
+}
+
+/* Whatever a plain queue holds right now, up to max */
+static size_t try_pop(MessageQueue *queue, ChatMessage *out, size_t max) {
+    if (queue->ring) {
+        return ring_try_pop(queue->ring, out, max);
+    }
+    pthread_mutex_lock(&queue->mutex);
     if (!queue->head) {
         pthread_mutex_unlock(&queue->mutex);
-        return -1;
+        return 0;
     }
+    return list_take(queue, out, max);
+}
 
-    MessageNode *node = queue->head;
-    queue->head = node->next;
-    if (!queue->head) {
-        queue->tail = NULL;
+/* Rounds of up to weight messages per lane until out is full or every lane is dry */
+static size_t lanes_try_pop(MessageQueue *queue, ChatMessage *out, size_t max) {
+    size_t n = 0;
+    for (;;) {
+        size_t round = 0;
+        for (int i = 0; i < MQ_LANE_COUNT && n < max; i++) {
+            size_t want = max - n < queue->weight[i] ? max - n : queue->weight[i];
+            size_t got = try_pop(queue->lane[i], out + n, want);
+            n += got;
+            round += got;
+        }
+        if (n == max || round == 0) {
+            return n;
+        }
     }
-    pthread_mutex_unlock(&queue->mutex);
+}
 
-    memcpy(out, &node->msg, sizeof(ChatMessage));
-    free(node);
-    return 0;
+/* The consumer side of ring_pop, over every lane */
+static int lanes_pop(MessageQueue *queue, ChatMessage *out, size_t max, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        deadline_after(CLOCK_MONOTONIC, timeout_ms, &deadline);
+    }
+    for (;;) {
+        size_t n = lanes_try_pop(queue, out, max);
+        if (n > 0) {
+            return (int)n;
+        }
+        if (atomic_load(&queue->lane_closed) && mq_depth(queue) == 0) {
+            return -1;
+        }
+        uint32_t ticket = atomic_load(&queue->lane_seq);
+        atomic_store(&queue->lane_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        n = lanes_try_pop(queue, out, max);
+        if (n > 0) {
+            atomic_store(&queue->lane_waiting, 0);
+            return (int)n;
+        }
+        struct timespec left;
+        if (timeout_ms >= 0 && !time_left(&deadline, &left)) {
+            atomic_store(&queue->lane_waiting, 0);
+            return 0;
+        }
+        if (!atomic_load(&queue->lane_closed)) {
+            futex_wait(&queue->lane_seq, ticket, timeout_ms >= 0 ? &left : NULL);
+        }
+        atomic_store(&queue->lane_waiting, 0);
+    }
+}
+
+int mq_pop_batch_timed(MessageQueue *queue, ChatMessage *out, size_t max, int timeout_ms) {
+    if (max == 0) {
+        return 0;
+    }
+    if (queue->lane[0]) {
+        return lanes_pop(queue, out, max, timeout_ms);
+    }
+    if (queue->ring) {
+        return ring_pop(queue->ring, out, max, timeout_ms);
+    }
+
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        deadline_after(CLOCK_MONOTONIC, timeout_ms, &deadline);
+    }
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->head && !queue->closed) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        } else if (pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    if (!queue->head) {
+        int closed = queue->closed;
+        pthread_mutex_unlock(&queue->mutex);
+        return closed ? -1 : 0;
+    }
+    return (int)list_take(queue, out, max);
 }
 
 void mq_close(MessageQueue *queue) {
+    if (queue->lane[0]) {
+        for (int i = 0; i < MQ_LANE_COUNT; i++) {
+            mq_close(queue->lane[i]);
+        }
+        atomic_store(&queue->lane_closed, 1);
+        atomic_fetch_add(&queue->lane_seq, 1);
+        futex_wake(&queue->lane_seq, INT32_MAX);
+        return;
+    }
+    if (queue->ring) {
+        ring_close(queue->ring);
+        return;
+    }
     pthread_mutex_lock(&queue->mutex);
     queue->closed = 1;
     pthread_cond_broadcast(&queue->cond);
     pthread_mutex_unlock(&queue->mutex);
 }
 
+void mq_reopen(MessageQueue *queue) {
+    if (queue->lane[0]) {
+        for (int i = 0; i < MQ_LANE_COUNT; i++) {
+            mq_reopen(queue->lane[i]);
+        }
+        atomic_store(&queue->lane_closed, 0);
+        return;
+    }
+    if (queue->ring) {
+        atomic_store(&queue->ring->closed, 0);
+        return;
+    }
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 0;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+size_t mq_depth(MessageQueue *queue) {
+    if (queue->lane[0]) {
+        size_t depth = 0;
+        for (int i = 0; i < MQ_LANE_COUNT; i++) {
+            depth += mq_depth(queue->lane[i]);
+        }
+        return depth;
+    }
+    if (queue->ring) {
+        size_t tail = atomic_load_explicit(&queue->ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&queue->ring->consumed, memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+    pthread_mutex_lock(&queue->mutex);
+    size_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
 void mq_destroy(MessageQueue *queue) {
     if (!queue) {
         return;
     }
+    for (int i = 0; i < MQ_LANE_COUNT; i++) {
+        mq_destroy(queue->lane[i]);
+    }
+    if (queue->ring) {
+        ring_destroy(queue->ring);
+    }
     pthread_mutex_lock(&queue->mutex);
     MessageNode *node = queue->head;
     while (node) {
         MessageNode *next = node->next;
-        free(node);
+        pool_free(node_pool, node);
         node = next;
     }
     queue->head = queue->tail = NULL;
@@ -104,5 +578,3 @@ void mq_destroy(MessageQueue *queue) {
     pthread_cond_destroy(&queue->cond);
     free(queue);
 }
-
-
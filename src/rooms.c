@@ -0,0 +1,126 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rooms.h"
+#include "userindex.h"
+
+#define ROOM_INITIAL_MEMBERS 4
+
+/* Internal room structure - not exposed in header */
+typedef struct Room {
+    void **members;
+    size_t count;
+    size_t cap;
+} Room;
+
+/* Internal table structure - rooms are looked up through the username index */
+struct RoomTable {
+    UserIndex *index;
+};
+
+RoomTable *rooms_create(void) {
+    RoomTable *table = malloc(sizeof(RoomTable));
+    if (!table) {
+        return NULL;
+    }
+    table->index = ui_create(0);
+    if (!table->index) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void room_free(Room *room) {
+    free(room->members);
+    free(room);
+}
+
+int rooms_join(RoomTable *table, const char *name, void *member) {
+    Room *room = ui_lookup(table->index, name);
+    if (!room) {
+        room = calloc(1, sizeof(Room));
+        if (!room) {
+            return -1;
+        }
+        if (ui_insert(table->index, name, room) < 0) {
+            free(room);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < room->count; i++) {
+        if (room->members[i] == member) {
+            return 1;
+        }
+    }
+    if (room->count == room->cap) {
+        size_t new_cap = room->cap ? room->cap * 2 : ROOM_INITIAL_MEMBERS;
+        void **members = realloc(room->members, new_cap * sizeof(void *));
+        if (!members) {
+            if (room->count == 0) {
+                ui_remove(table->index, name, room);
+                room_free(room);
+            }
+            return -1;
+        }
+        room->members = members;
+        room->cap = new_cap;
+    }
+    room->members[room->count++] = member;
+    return 0;
+}
+
+int rooms_part(RoomTable *table, const char *name, void *member) {
+    Room *room = ui_lookup(table->index, name);
+    if (!room) {
+        return -1;
+    }
+    for (size_t i = 0; i < room->count; i++) {
+        if (room->members[i] == member) {
+            room->members[i] = room->members[--room->count];
+            if (room->count == 0) {
+                ui_remove(table->index, name, room);
+                room_free(room);
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void *const *rooms_members(const RoomTable *table, const char *name, size_t *count) {
+    Room *room = ui_lookup(table->index, name);
+    if (!room) {
+        *count = 0;
+        return NULL;
+    }
+    *count = room->count;
+    return room->members;
+}
+
+int room_name_valid(const char *room) {
+    if (room[0] != '#') {
+        return 0;
+    }
+    const char *end = memchr(room, '\0', ROOM_MAX);
+    size_t len = end ? (size_t)(end - room) : ROOM_MAX;
+    if (len < 2 || len >= ROOM_MAX) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!isgraph((unsigned char)room[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void rooms_destroy(RoomTable *table) {
+    if (!table) {
+        return;
+    }
+    /* Members own nothing here; any rooms left are freed by their last part. */
+    ui_destroy(table->index);
+    free(table);
+}
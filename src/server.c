@@ -1,64 +1,266 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "binlog.h"
 #include "chat.h"
+#include "epoch.h"
+#include "fanout.h"
+#include "frame.h"
+#include "handoff.h"
+#include "history.h"
+#include "metrics.h"
+#include "outq.h"
+#include "pool.h"
+#include "proto.h"
 #include "queue.h"
+#include "rooms.h"
 #include "server.h"
+#include "shm.h"
+#include "timerwheel.h"
+#include "trace.h"
+#include "uring.h"
+#include "userindex.h"
+
+struct Shard;
 
 /* Client structure - internal implementation detail, not exposed in header */
 typedef struct Client {
     int fd;
+    struct Shard *shard;     /* owns the socket and delivers to it */
     char username[USERNAME_MAX];
     pthread_t thread;
-    time_t last_activity;
+    atomic_uint_least64_t last_activity; /* monotonic ms, stored by the reading thread */
+    Timer idle_timer;        /* inactivity deadline, guarded by clients_mutex */
     int removed;
-    struct Client *next;
+    int joined;              /* handshake done, linked into its shard */
+    const char *kick_reason; /* set by watchdog before it shuts the socket down */
+    int proto;               /* wire version negotiated in the hello */
+    ShmChannel *shm;         /* shared-memory rings instead of the socket; set in the hello */
+    char *inbuf;             /* reactor mode: bytes received but not yet parsed */
+    size_t inlen;
+    size_t incap;
+    int uring_ops;           /* io_uring mode: requests the kernel still holds; reactor only */
+    struct Client *flush_next; /* io_uring mode: on the shard's flush list, guarded by its flush_mutex */
+    pthread_mutex_t out_mutex; /* guards everything below */
+    OutQueue *outq;
+    int want_write;          /* EPOLLOUT armed because outq has pending bytes; io_uring: a send is in flight */
+    int flush_pending;       /* io_uring mode: waiting on the flush list */
+    struct msghdr send_msg;  /* io_uring mode: the send in flight */
+    struct iovec *send_iov;
+    uint64_t send_born;      /* its first frame's receive time and trace id */
+    uint64_t send_traced;
+    int registered;          /* fd known to the writer's epoll set (threads mode) */
+    int closed;
+    int lagging;
+    unsigned long dropped;     /* frames discarded by the overflow policy */
+    unsigned long lag_dropped; /* frames skipped during the current lag episode */
+    char rooms[CLIENT_ROOMS_MAX][ROOM_MAX]; /* joined rooms; changed by the owning thread under the shard mutex */
+    int room_count;
+    uint64_t history_before; /* /history continues below this chat log sequence number, 0 from the newest */
+    uint64_t rate_tokens;    /* token bucket in thousandths of a message; reading thread only */
+    uint64_t rate_refilled_ms;
+    int rate_strikes;        /* messages dropped since the last pause */
+    int rate_pauses;         /* pauses since the bucket was last full */
+    int paused;              /* reactor modes: reads stopped until resume_timer, changed under out_mutex */
+    int recv_parked;         /* io_uring mode: the multishot recv was cancelled or ended while paused; reactor only */
+    Timer resume_timer;      /* guarded by clients_mutex */
+    struct Client *resume_next; /* on the shard's resume list, guarded by its flush_mutex */
+    int resume_listed;
+    struct Client *next;      /* on the retired or zombie list once removed */
+    struct Client *hs_next;   /* on the handshaking list until joined, guarded by clients_mutex */
+    struct Client **hs_pprev;
 } Client;
 
+/*
+ * The clients of a shard as an immutable array. add_client and remove_client
+ * publish a changed copy under the shard mutex and retire the old one, so the
+ * dispatcher and /who walk it without a lock, inside an epoch section.
+ */
+typedef struct ClientSet {
+    size_t count;
+    Client *clients[];
+} ClientSet;
+
+/*
+ * One reactor + dispatcher pair, normally one per core. A shard owns its
+ * listener registration, the clients it accepted and an inbox that every
+ * shard pushes messages for those clients into.
+ */
+typedef struct Shard {
+    int listen_fd;         /* own SO_REUSEPORT socket, or the shared listener */
+    int epfd;
+    int wake_fd;
+    pthread_t reactor_thread;
+    pthread_t dispatcher_thread;
+    pthread_mutex_t mutex; /* guards index, rooms, history and replacing clients */
+    ClientSet *_Atomic clients; /* published snapshot, NULL while empty */
+    UserIndex *index;      /* this shard's users, for DM delivery */
+    RoomTable *rooms;      /* this shard's users per room */
+    History *history;      /* recent lobby and room messages, for scrollback on join; NULL if off */
+    MessageQueue *inbox;
+    Uring *ring;           /* io_uring mode: replaces epfd */
+    uint64_t wake_buf;     /* io_uring mode: target of the wake_fd read */
+    pthread_mutex_t flush_mutex; /* guards flush_list and resume_list */
+    Client *flush_list;    /* io_uring mode: clients with output for the reactor to send */
+    Client *resume_list;   /* reactor modes: paused clients whose pause is over */
+    Client *zombies;       /* io_uring mode: dropped, freed once the kernel let go of them */
+} Shard;
+
+/* epoll data sentinels for the non-client descriptors */
+static char listener_tag;
+static char wakeup_tag;
+
+/* io_uring user_data: a Client pointer with the request in its low bits, or a bare sentinel */
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_CANCEL 3
+#define URING_OP_MASK 3
+#define URING_ACCEPT 1 /* no client */
+#define URING_WAKE 2
+
 static int server_fd = -1;
 static volatile sig_atomic_t running = 1;
 static pthread_t accept_thread_id;
-static pthread_t dispatcher_thread_id;
+static pthread_t writer_thread_id;
 static pthread_t logger_thread_id;
 static pthread_t watchdog_thread_id;
+static pthread_t admin_thread_id;
+static int admin_fd = -1;
+static char admin_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = "";
 
+/* Taken before any shard mutex */
 static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-static Client *clients = NULL;
+static UserIndex *client_index = NULL; /* username -> Client* across all shards, guarded by clients_mutex */
+
+static Shard *shards = NULL;
+static int shard_count = 1;
+static int listener_shared = 0; /* every shard polls the same listening socket */
+
+/* Connections still waiting for their hello, guarded by clients_mutex */
+static Client *handshaking = NULL;
+static pthread_cond_t handshake_cond = PTHREAD_COND_INITIALIZER; /* signalled when it empties */
+
+/* Threads mode: removed clients wait here until the writer thread is done with them */
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Client *retired = NULL;
 
-static MessageQueue *dispatch_queue = NULL;
 static MessageQueue *log_queue = NULL;
+static ObjectPool *client_pool = NULL;
 
-static time_t inactivity_timeout_sec = 300; /* default 5 minutes */
+/* Broadcasts to at least fanout_threshold clients are split across the workers */
+static FanoutPool *fanout_pool = NULL;
+static int fanout_worker_count = FANOUT_WORKERS_DEFAULT;
+static size_t fanout_threshold = FANOUT_THRESHOLD_DEFAULT;
+
+/* Per-client token bucket: rate_limit messages per second, up to rate_burst at once */
+static unsigned long rate_limit = RATE_LIMIT_DEFAULT;
+static unsigned long rate_burst = RATE_BURST_DEFAULT;
+
+/* Inactivity deadlines; the watchdog sleeps on watchdog_cond until the next one,
+ * waking at least every EPOCH_RECLAIM_MS to free retired memory */
+static TimerWheel *timers = NULL; /* guarded by clients_mutex */
+static pthread_cond_t watchdog_cond;
+
+/*
+ * Every join notice goes to everyone online, so a reconnect storm of N clients
+ * would cost N^2 frames. A join within JOIN_DIGEST_MS of the last notice is
+ * collected instead and announced with the others when the window closes.
+ * Guarded by clients_mutex.
+ */
+static Timer join_digest_timer;
+static char join_digest[TEXT_MAX - 48]; /* names so far; the rest of a line is for the count */
+static size_t join_digest_more;   /* joins that did not fit in the text */
+static uint64_t join_quiet_until; /* a join before this goes into the digest */
+
+static uint64_t inactivity_timeout_ms = 300000; /* default 5 minutes */
+static int listen_backlog = BACKLOG;
 static ServerMode server_mode = MODE_UNIX;
+static IoMode io_mode = IO_EPOLL;
+static size_t outq_capacity = OUTQ_DEFAULT_CAPACITY;
+static OutqPolicy outq_policy = OUTQ_DISCONNECT;
+static MQBackend queue_backend = MQ_BACKEND_LIST;
+static size_t queue_capacity = MQ_RING_DEFAULT_CAPACITY;
+static unsigned lane_weights[MQ_LANE_COUNT] = LANE_WEIGHTS_DEFAULT;
 static char server_unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = SOCKET_PATH;
 static char server_tcp_port[PORT_STR_LEN] = DEFAULT_TCP_PORT;
+static BinLog *chat_log = NULL;
+static char log_prefix[BINLOG_PATH_MAX] = LOG_PREFIX;
+static size_t history_depth = HISTORY_DEFAULT;
+static BinLogIndex *history_index = NULL; /* mapped chat log for /history, opened on first use */
+static pthread_mutex_t history_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LogSyncPolicy log_sync_policy = LOG_SYNC_NONE;
+static long log_sync_every = 0; /* ms or records, depending on the policy */
+static char trace_path[BINLOG_PATH_MAX] = TRACE_FILE;
+static volatile sig_atomic_t trace_requested = 0;
+static _Thread_local Shard *reactor_shard = NULL; /* set on io_uring reactor threads */
+
+/* Hot restart: the admin connection of a new server taking over, and what it inherited */
+static int takeover_fd = -1;
+static atomic_int handing_over = 0; /* dispatchers drain their inboxes before exiting */
+static volatile sig_atomic_t interrupted = 0; /* SIGINT: a failed handoff shuts down instead of serving on */
+static char takeover_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = "";
+static int inherited_listeners[SHARDS_MAX];
+static int inherited_listener_count = 0;
+static HandoffRecord *inherited_clients = NULL;
+static size_t inherited_client_count = 0;
 
 static void handle_sigint(int sig) {
     (void)sig;
+    interrupted = 1;
     running = 0;
     if (server_fd >= 0) {
+        shutdown(server_fd, SHUT_RDWR); /* wakes a thread blocked in accept */
         close(server_fd);
         server_fd = -1;
     }
-    if (dispatch_queue) {
-        mq_close(dispatch_queue);
+    if (admin_fd >= 0) {
+        shutdown(admin_fd, SHUT_RDWR);
+    }
+    for (int i = 0; shards && i < shard_count; i++) {
+        if (shards[i].wake_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t r = write(shards[i].wake_fd, &one, sizeof(one));
+            (void)r;
+        }
+        if (shards[i].inbox) {
+            mq_close(shards[i].inbox);
+        }
     }
     if (log_queue) {
         mq_close(log_queue);
     }
 }
 
+/* The dump itself runs on shard 0's I/O thread, out of signal context */
+static void handle_sigusr1(int sig) {
+    (void)sig;
+    trace_requested = 1;
+    if (shards && shards[0].wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t r = write(shards[0].wake_fd, &one, sizeof(one));
+        (void)r;
+    }
+}
+
 static void trim_string(char *s, size_t len) {
     s[len - 1] = '\0';
     size_t actual = strnlen(s, len);
@@ -68,338 +270,2972 @@ static void trim_string(char *s, size_t len) {
     s[actual] = '\0';
 }
 
-static void push_system_message(const char *text, const char *target) {
-    ChatMessage msg;
-    memset(&msg, 0, sizeof(msg));
-    snprintf(msg.sender, USERNAME_MAX, "SYSTEM");
+static void make_system_message(ChatMessage *msg, const char *text, const char *target) {
+    memset(msg, 0, sizeof(*msg));
+    snprintf(msg->sender, USERNAME_MAX, "SYSTEM");
     if (target) {
-        snprintf(msg.target, USERNAME_MAX, "%s", target);
+        snprintf(msg->target, USERNAME_MAX, "%s", target);
     }
-    snprintf(msg.text, TEXT_MAX, "%s", text);
-    msg.timestamp = time(NULL);
-    mq_push(dispatch_queue, &msg);
-    mq_push(log_queue, &msg);
+    snprintf(msg->text, TEXT_MAX, "%s", text);
+    msg->timestamp = time(NULL);
+    msg->received_ns = metrics_now();
 }
 
-static void add_client(Client *client) {
-    pthread_mutex_lock(&clients_mutex);
-    client->next = clients;
-    clients = client;
-    pthread_mutex_unlock(&clients_mutex);
+static int is_system_message(const ChatMessage *msg) {
+    return strcmp(msg->sender, "SYSTEM") == 0;
 }
 
-static void remove_client(Client *client, const char *reason, int join_thread) {
-    int already_removed = 0;
-    pthread_mutex_lock(&clients_mutex);
-    Client **cursor = &clients;
-    while (*cursor && *cursor != client) {
-        cursor = &(*cursor)->next;
+/* Notices and replies overtake direct messages, which overtake broadcasts and rooms */
+static MQLane message_lane(const ChatMessage *msg) {
+    if (is_system_message(msg)) {
+        return MQ_LANE_SYSTEM;
     }
-    if (*cursor == client && !client->removed) {
-        *cursor = client->next;
-        client->removed = 1;
-    } else {
-        already_removed = 1;
+    return msg->target[0] != '\0' ? MQ_LANE_PRIVATE : MQ_LANE_BULK;
+}
+
+/*
+ * Hand a message to every shard's inbox. A direct message goes to all of them
+ * too, and each dispatcher looks the target up in its own shard's index, so
+ * sending one never takes clients_mutex.
+ */
+static void route_message(const ChatMessage *msg) {
+    MQLane lane = message_lane(msg);
+    for (int i = 0; i < shard_count; i++) {
+        mq_push_lane(shards[i].inbox, lane, msg);
     }
-    pthread_mutex_unlock(&clients_mutex);
+}
 
-    if (already_removed) {
+static void push_system_message(const char *text, const char *target) {
+    ChatMessage msg;
+    make_system_message(&msg, text, target);
+    route_message(&msg);
+    mq_push(log_queue, &msg);
+}
+
+/* Goes to the room's members on every shard */
+static void push_room_notice(const char *text, const char *room) {
+    ChatMessage msg;
+    make_system_message(&msg, text, NULL);
+    snprintf(msg.room, ROOM_MAX, "%s", room);
+    route_message(&msg);
+    mq_push(log_queue, &msg);
+}
+
+/* Command replies go to one user, whose shard is known, and are not worth logging */
+static void push_system_reply(const char *text, const Client *client) {
+    ChatMessage msg;
+    make_system_message(&msg, text, client->username);
+    mq_push_lane(client->shard->inbox, MQ_LANE_SYSTEM, &msg);
+}
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void touch_client(Client *client) {
+    atomic_store_explicit(&client->last_activity, monotonic_ms(), memory_order_relaxed);
+}
+
+/*
+ * Runs in the watchdog with clients_mutex held. Activity only stores a
+ * timestamp, so the timer is rearmed lazily here: if the client spoke since
+ * it was scheduled, push the deadline out instead of kicking. Until the hello
+ * has been accepted the same timer enforces the handshake deadline.
+ */
+static void idle_timer_expired(Timer *timer, uint64_t now) {
+    Client *client = (Client *)((char *)timer - offsetof(Client, idle_timer));
+    uint64_t limit = client->joined ? inactivity_timeout_ms : HANDSHAKE_TIMEOUT_MS;
+    uint64_t deadline = atomic_load_explicit(&client->last_activity, memory_order_relaxed) + limit;
+    if (deadline > now) {
+        tw_schedule(timers, timer, deadline);
         return;
     }
-
-    if (reason && reason[0] != '\0') {
-        char text[TEXT_MAX];
-        if (strcmp(reason, "inactivity") == 0) {
-            snprintf(text, sizeof(text), "User %s has been disconnected due to inactivity.", client->username);
-        } else {
-            snprintf(text, sizeof(text), "%s left (%s)", client->username, reason);
-        }
-        push_system_message(text, "");
+    /* The reading thread drops the connection once it sees the shutdown. */
+    if (!client->kick_reason) {
+        client->kick_reason = client->joined ? "inactivity" : "handshake timeout";
+        shutdown(client->fd, SHUT_RDWR);
     }
+}
 
-    shutdown(client->fd, SHUT_RDWR);
-    close(client->fd);
+static void wake_io_thread(Shard *shard) {
+    uint64_t one = 1;
+    ssize_t r = write(shard->wake_fd, &one, sizeof(one));
+    (void)r;
+}
 
-    if (join_thread) {
-        pthread_join(client->thread, NULL);
+/* Runs in the watchdog with clients_mutex held: the reactor resumes reads on its next wakeup */
+static void resume_timer_expired(Timer *timer, uint64_t now) {
+    Client *client = (Client *)((char *)timer - offsetof(Client, resume_timer));
+    Shard *shard = client->shard;
+    (void)now;
+    pthread_mutex_lock(&shard->flush_mutex);
+    if (!client->resume_listed) {
+        client->resume_next = shard->resume_list;
+        shard->resume_list = client;
+        client->resume_listed = 1;
     }
-    free(client);
+    pthread_mutex_unlock(&shard->flush_mutex);
+    wake_io_thread(shard);
 }
 
-static int send_message_to_client(Client *client, const ChatMessage *msg) {
-    return send_all(client->fd, msg, sizeof(ChatMessage));
+/* A silent connection is shut down after HANDSHAKE_TIMEOUT_MS; add_client rearms
+ * the timer for inactivity. */
+static void start_handshake(Client *client) {
+    pthread_mutex_lock(&clients_mutex);
+    client->hs_next = handshaking;
+    client->hs_pprev = &handshaking;
+    if (handshaking) {
+        handshaking->hs_pprev = &client->hs_next;
+    }
+    handshaking = client;
+    tw_schedule(timers, &client->idle_timer, monotonic_ms() + HANDSHAKE_TIMEOUT_MS);
+    pthread_cond_signal(&watchdog_cond);
+    pthread_mutex_unlock(&clients_mutex);
 }
 
-static void *dispatcher_thread(void *arg) {
-    (void)arg;
-    ChatMessage msg;
-    while (running && mq_pop(dispatch_queue, &msg) == 0) {
-        pthread_mutex_lock(&clients_mutex);
-        Client *cur = clients;
-        while (cur) {
-            int deliver = 0;
-            if (msg.target[0] == '\0') {
-                deliver = 1;
-            } else if (strncmp(cur->username, msg.target, USERNAME_MAX) == 0 ||
-                       strncmp(msg.target, cur->username, USERNAME_MAX) == 0) {
-                deliver = 1;
-            }
-
-            if (deliver) {
-                if (send_message_to_client(cur, &msg) < 0) {
-                    shutdown(cur->fd, SHUT_RDWR);
-                }
-            }
-            cur = cur->next;
-        }
-        pthread_mutex_unlock(&clients_mutex);
+/* Off the handshaking list once joined; a failed connection also loses its timer. */
+static void leave_handshake(Client *client, int failed) {
+    pthread_mutex_lock(&clients_mutex);
+    *client->hs_pprev = client->hs_next;
+    if (client->hs_next) {
+        client->hs_next->hs_pprev = client->hs_pprev;
     }
-    return NULL;
+    if (failed) {
+        tw_cancel(timers, &client->idle_timer);
+    }
+    if (!handshaking) {
+        pthread_cond_broadcast(&handshake_cond);
+    }
+    pthread_mutex_unlock(&clients_mutex);
 }
 
-static void *logger_thread(void *arg) {
-    (void)arg;
-    FILE *fp = fopen("chat.log", "a");
-    if (!fp) {
-        perror("chat.log");
+static Client *client_new(int fd, Shard *shard) {
+    Client *client = pool_alloc(client_pool);
+    if (!client) {
         return NULL;
     }
-
-    ChatMessage msg;
-    char timebuf[32];
-    while (mq_pop(log_queue, &msg) == 0) {
-        struct tm tm_info;
-        localtime_r(&msg.timestamp, &tm_info);
-        strftime(timebuf, sizeof(timebuf), "%H:%M:%S", &tm_info);
-        if (msg.target[0] == '\0') {
-            fprintf(fp, "[%s] <%s> %s\n", timebuf, msg.sender, msg.text);
-        } else {
-            fprintf(fp, "[%s] <%s -> %s> %s\n", timebuf, msg.sender, msg.target, msg.text);
-        }
-        fflush(fp);
+    memset(client, 0, sizeof(Client));
+    client->outq = outq_create(outq_capacity);
+    client->incap = io_mode != IO_THREADS ? INBUF_INITIAL : 0;
+    client->inbuf = client->incap ? malloc(client->incap) : NULL;
+    client->send_iov = io_mode == IO_URING ? malloc(URING_SEND_IOV * sizeof(struct iovec)) : NULL;
+    if (!client->outq || (client->incap && !client->inbuf) || (io_mode == IO_URING && !client->send_iov)) {
+        outq_destroy(client->outq);
+        free(client->inbuf);
+        free(client->send_iov);
+        pool_free(client_pool, client);
+        return NULL;
     }
-
-    fclose(fp);
-    return NULL;
+    pthread_mutex_init(&client->out_mutex, NULL);
+    client->fd = fd;
+    client->shard = shard;
+    client->proto = PROTO_LEGACY;
+    atomic_init(&client->last_activity, monotonic_ms());
+    timer_init(&client->idle_timer, idle_timer_expired);
+    timer_init(&client->resume_timer, resume_timer_expired);
+    client->rate_tokens = (uint64_t)rate_burst * 1000;
+    client->rate_refilled_ms = monotonic_ms();
+    return client;
 }
 
-static void *client_thread(void *arg) {
-    Client *client = (Client *)arg;
-    ChatMessage msg;
+static void client_free(Client *client) {
+    shm_destroy(client->shm);
+    outq_destroy(client->outq);
+    free(client->inbuf);
+    free(client->send_iov);
+    pthread_mutex_destroy(&client->out_mutex);
+    pool_free(client_pool, client);
+}
 
-    while (running) {
-        if (recv_all(client->fd, &msg, sizeof(ChatMessage)) < 0) {
-            break;
-        }
-        trim_string(msg.text, TEXT_MAX);
-        msg.text[TEXT_MAX - 1] = '\0';
-        snprintf(msg.sender, USERNAME_MAX, "%s", client->username);
-        msg.timestamp = time(NULL);
-        client->last_activity = msg.timestamp;
+static void dump_trace(void) {
+    if (trace_dump(trace_path) < 0) {
+        perror(trace_path);
+    } else {
+        fprintf(stderr, "Flight recorder written to %s\n", trace_path);
+    }
+}
 
-        mq_push(dispatch_queue, &msg);
-        mq_push(log_queue, &msg);
+static void handle_wakeup(Shard *shard) {
+    if (shard == shards && trace_requested) {
+        trace_requested = 0;
+        dump_trace();
     }
+}
 
-    remove_client(client, "disconnected", 0);
-    return NULL;
+static void drain_wakeups(Shard *shard) {
+    uint64_t count;
+    ssize_t r = read(shard->wake_fd, &count, sizeof(count));
+    (void)r;
+    handle_wakeup(shard);
 }
 
-static int accept_handshake(int client_fd, char *username_out) {
-    ChatMessage hello;
-    if (recv_all(client_fd, &hello, sizeof(ChatMessage)) < 0) {
-        return -1;
+static void free_client_later(void *client) {
+    client_free(client);
+}
+
+/* A dispatcher may still be fanning out to a removed client, so memory goes back
+ * through the epoch. The writer thread may also hold an epoll event for one, so in
+ * threads mode retiring waits for its next loop. An io_uring reactor keeps them
+ * until their last request has completed. */
+static void retire_client(Client *client) {
+    if (io_mode == IO_EPOLL) {
+        epoch_retire(client, free_client_later);
+        return;
     }
-    trim_string(hello.sender, USERNAME_MAX);
-    if (hello.sender[0] == '\0') {
-        return -1;
+    if (io_mode == IO_URING) {
+        client->next = client->shard->zombies;
+        client->shard->zombies = client;
+        return;
     }
-    snprintf(username_out, USERNAME_MAX, "%s", hello.sender);
-    return 0;
+    pthread_mutex_lock(&retired_mutex);
+    client->next = retired;
+    retired = client;
+    pthread_mutex_unlock(&retired_mutex);
+    wake_io_thread(client->shard);
 }
 
-static void *accept_thread(void *arg) {
-    (void)arg;
-    while (running) {
-        struct sockaddr_storage client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            if (!running) {
-                break;
-            }
-            perror("accept");
-            continue;
-        }
-
-        Client *client = calloc(1, sizeof(Client));
-        if (!client) {
-            close(client_fd);
-            continue;
-        }
-        client->fd = client_fd;
-        client->removed = 0;
-        client->last_activity = time(NULL);
-
-        if (accept_handshake(client_fd, client->username) < 0) {
-            close(client_fd);
-            free(client);
-            continue;
-        }
+static void free_retired_clients(void) {
+    pthread_mutex_lock(&retired_mutex);
+    Client *cur = retired;
+    retired = NULL;
+    pthread_mutex_unlock(&retired_mutex);
+    while (cur) {
+        Client *next = cur->next;
+        epoch_retire(cur, free_client_later);
+        cur = next;
+    }
+}
 
-        add_client(client);
+/* An io_uring reactor closes the descriptor when it frees the client, so a request
+ * still queued for it cannot reach a connection that reused the number. */
+static void close_client_socket(Client *client) {
+    pthread_mutex_lock(&client->out_mutex);
+    client->closed = 1;
+    shutdown(client->fd, SHUT_RDWR);
+    if (io_mode != IO_URING) {
+        close(client->fd);
+    }
+    shm_destroy(client->shm);
+    client->shm = NULL;
+    pthread_mutex_unlock(&client->out_mutex);
+}
 
-        char text[TEXT_MAX];
-        snprintf(text, sizeof(text), "%s joined", client->username);
-        push_system_message(text, "");
+/* epoll mode: a paused client is only watched for hangups and output; caller holds out_mutex. */
+static int update_epoll(Client *client, int want_write) {
+    struct epoll_event ev;
+    ev.data.ptr = client;
+    ev.events = (client->paused ? 0 : EPOLLIN) | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    return epoll_ctl(client->shard->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+}
 
-        if (pthread_create(&client->thread, NULL, client_thread, client) != 0) {
-            perror("pthread_create client");
-            remove_client(client, "handler spawn failed", 0);
-            continue;
+/* Caller holds out_mutex. */
+static void set_write_interest(Client *client, int on) {
+    struct epoll_event ev;
+    ev.data.ptr = client;
+    if (client->shm) {
+        client->want_write = on; /* the ring's doorbell brings the reactor back */
+    } else if (io_mode == IO_EPOLL) {
+        if (client->want_write == on || update_epoll(client, on) < 0) {
+            return;
         }
+    } else if (on) {
+        /* One-shot so a hung-up socket cannot spin the writer thread */
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        int op = client->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(client->shard->epfd, op, client->fd, &ev) < 0) {
+            return;
+        }
+        client->registered = 1;
     }
-    return NULL;
+    client->want_write = on;
 }
 
-static int setup_unix_socket(const char *path) {
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        perror("socket");
-        return -1;
+/* Encode msg into a new shared frame holding one reference */
+static SharedFrame *encode_frame(int version, const ChatMessage *msg) {
+    unsigned char buf[PROTO_MAX_ENCODED];
+    size_t len = proto_encode(version, msg, buf, sizeof(buf));
+    SharedFrame *frame = len > 0 ? frame_create(buf, len) : NULL;
+    if (frame) {
+        frame->born_ns = msg->received_ns;
+        frame->trace_id = msg->trace_id;
     }
+    return frame;
+}
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
-    unlink(path);
-
-    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(fd);
+/* Queue a one-off message for a single client, bypassing the overflow policy;
+ * caller holds out_mutex. */
+static int push_direct(Client *client, int version, const ChatMessage *msg) {
+    SharedFrame *frame = encode_frame(version, msg);
+    if (!frame) {
         return -1;
     }
+    int rc = outq_push(client->outq, frame);
+    frame_unref(frame);
+    return rc;
+}
 
-    if (listen(fd, BACKLOG) < 0) {
-        perror("listen");
-        close(fd);
-        return -1;
+/* Write queued frames to the socket or the shared-memory ring; caller holds out_mutex.
+ * A full ring asks the client to ring back once it has read some. */
+static int write_queued(Client *client) {
+    if (io_mode == IO_URING && client->want_write) {
+        return 0; /* the kernel owns the head of the queue */
+    }
+    if (!client->shm) {
+        return outq_flush(client->outq, client->fd);
     }
+    int rc;
+    while ((rc = outq_flush_shm(client->outq, client->shm)) == 0 && shm_arm_writable(client->shm)) {
+    }
+    return rc;
+}
 
-    return fd;
+/* Once a lagging client has caught up, say how much it missed; caller holds out_mutex.
+ * Returns 1 if the notice was queued. */
+static int queue_lag_notice(Client *client) {
+    if (!client->lagging) {
+        return 0;
+    }
+    ChatMessage notice;
+    char text[TEXT_MAX];
+    snprintf(text, sizeof(text), "You fell behind; %lu messages were skipped.", client->lag_dropped);
+    make_system_message(&notice, text, client->username);
+    client->lagging = 0;
+    client->lag_dropped = 0;
+    return push_direct(client, client->proto, &notice) == 0;
 }
 
-static int setup_tcp_socket(const char *port) {
-    struct addrinfo hints;
-    struct addrinfo *res = NULL;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+/*
+ * io_uring mode: only the reactor may touch its ring, so other threads put the
+ * client on the shard's flush list and the reactor submits the sends of every
+ * listed client with its next io_uring_enter. Caller holds out_mutex.
+ */
+static void request_send(Client *client) {
+    if (client->flush_pending) {
+        return;
+    }
+    Shard *shard = client->shard;
+    client->flush_pending = 1;
+    pthread_mutex_lock(&shard->flush_mutex);
+    int was_empty = shard->flush_list == NULL;
+    client->flush_next = shard->flush_list;
+    shard->flush_list = client;
+    pthread_mutex_unlock(&shard->flush_mutex);
+    if (was_empty && reactor_shard != shard) {
+        wake_io_thread(shard);
+    }
+}
 
-    int gai = getaddrinfo(NULL, port, &hints, &res);
-    if (gai != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai));
-        return -1;
+/* Write as much pending output as the socket takes without blocking; caller holds out_mutex. */
+static void flush_client(Client *client) {
+    if (client->closed) {
+        return;
+    }
+    if (io_mode == IO_URING) {
+        request_send(client);
+        return;
+    }
+    const SharedFrame *oldest = outq_head(client->outq);
+    uint64_t born = oldest ? oldest->born_ns : 0;
+    uint64_t traced = oldest ? oldest->trace_id : 0;
+    int rc = write_queued(client);
+    if (oldest) {
+        metrics_count(MET_FLUSHES, 1);
+        if (rc > 0) {
+            metrics_observe_since(MET_LAT_WRITE, born);
+            trace_event(traced, TRACE_WRITTEN, (uint32_t)(client->shard - shards));
+        }
+    }
+    if (rc > 0 && queue_lag_notice(client)) {
+        rc = write_queued(client);
+    }
+    if (rc < 0) {
+        metrics_count(MET_SEND_ERRORS, 1);
+        shutdown(client->fd, SHUT_RDWR);
+        set_write_interest(client, 0);
+    } else {
+        if (rc == 0) {
+            metrics_count(MET_SEND_BLOCKED, 1);
+        }
+        set_write_interest(client, rc == 0);
     }
+}
 
-    int fd = -1;
-    for (struct addrinfo *p = res; p; p = p->ai_next) {
-        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (fd < 0) {
-            continue;
+/* Apply the overflow policy when outq is full. Caller holds out_mutex; dispatchers and
+ * fan-out workers come from an epoch section, not the shard mutex, which keeps a client
+ * that leaves meanwhile from being freed under them. */
+static void queue_frame(Client *client, SharedFrame *frame) {
+    if (client->closed || client->kick_reason) {
+        return;
+    }
+    if (client->lagging) {
+        client->dropped++;
+        client->lag_dropped++;
+        metrics_count(MET_FRAMES_DROPPED, 1);
+        return;
+    }
+    while (outq_push(client->outq, frame) < 0) {
+        if (outq_depth(client->outq) == 0) {
+            return; /* out of memory */
         }
-        int opt = 1;
-        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
-            if (listen(fd, BACKLOG) == 0) {
-                break;
+        switch (outq_policy) {
+        case OUTQ_DROP_OLDEST:
+            client->dropped++;
+            metrics_count(MET_FRAMES_DROPPED, 1);
+            if (outq_drop_oldest(client->outq) < 0) {
+                return; /* only frames on the wire are left, so the new one is the drop */
             }
+            break;
+        case OUTQ_LAG:
+            client->lagging = 1;
+            client->dropped++;
+            client->lag_dropped = 1;
+            metrics_count(MET_FRAMES_DROPPED, 1);
+            return;
+        default:
+            client->kick_reason = "send queue full";
+            shutdown(client->fd, SHUT_RDWR);
+            metrics_count(MET_OUTQ_KICKS, 1);
+            return;
         }
-        close(fd);
-        fd = -1;
     }
-    freeaddrinfo(res);
+    metrics_count(MET_FRAMES_QUEUED, 1);
+}
 
-    if (fd < 0) {
-        perror("bind/listen");
+/* Scrollback frames go out with the next flush. Caller holds out_mutex. */
+static void queue_scrollback(Client *client, const ChatMessage *msgs, size_t n) {
+    size_t queued = 0;
+    while (queued < n && push_direct(client, client->proto, &msgs[queued]) == 0) {
+        queued++;
     }
-    return fd;
+    metrics_count(MET_HISTORY_REPLAYED, queued);
 }
 
-static void *watchdog_thread(void *arg) {
-    (void)arg;
-    const int poll_interval = 5; /* seconds */
-    while (running) {
-        sleep(poll_interval);
-        time_t now = time(NULL);
-
-        Client **to_kick = NULL;
-        size_t count = 0;
-        size_t cap = 0;
+/*
+ * Queue the recent messages of room ("" for the lobby) for a client about to
+ * receive it live. Only the copy is made under the shard mutex; encoding does
+ * not hold up the dispatcher. Returns the history position it covers, for
+ * catch_up_history.
+ */
+static uint64_t replay_history(Client *client, const char *room) {
+    Shard *shard = client->shard;
+    ChatMessage *msgs = shard->history ? malloc(history_depth * sizeof(ChatMessage)) : NULL;
+    if (!msgs) {
+        return UINT64_MAX;
+    }
+    pthread_mutex_lock(&shard->mutex);
+    size_t n = history_since(shard->history, room, 0, msgs, history_depth);
+    uint64_t seen = history_last(shard->history);
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_mutex_lock(&client->out_mutex);
+    queue_scrollback(client, msgs, n);
+    pthread_mutex_unlock(&client->out_mutex);
+    free(msgs);
+    return seen;
+}
 
-        pthread_mutex_lock(&clients_mutex);
-        Client *cur = clients;
-        while (cur) {
-            if (!cur->removed && (now - cur->last_activity) >= inactivity_timeout_sec) {
-                if (count == cap) {
-                    size_t new_cap = cap == 0 ? 8 : cap * 2;
-                    Client **tmp = realloc(to_kick, new_cap * sizeof(Client *));
-                    if (!tmp) {
-                        break;
-                    }
-                    to_kick = tmp;
-                    cap = new_cap;
-                }
-                to_kick[count++] = cur;
-            }
-            cur = cur->next;
-        }
-        pthread_mutex_unlock(&clients_mutex);
+/* Caller holds the shard mutex, at the point the client starts receiving room live:
+ * what the dispatcher added since replay_history would otherwise be missed. */
+static void catch_up_history(Client *client, const char *room, uint64_t seen) {
+    History *history = client->shard->history;
+    if (!history || seen >= history_last(history)) {
+        return;
+    }
+    ChatMessage *msgs = malloc(history_depth * sizeof(ChatMessage));
+    if (!msgs) {
+        return;
+    }
+    size_t n = history_since(history, room, seen, msgs, history_depth);
+    pthread_mutex_lock(&client->out_mutex);
+    queue_scrollback(client, msgs, n);
+    pthread_mutex_unlock(&client->out_mutex);
+    free(msgs);
+}
 
-        for (size_t i = 0; i < count; i++) {
-            remove_client(to_kick[i], "inactivity", 1);
+/* Copy the shard's client set with add appended and remove left out, publish the
+ * copy and retire the old one. Caller holds the shard mutex. */
+static int publish_clients(Shard *shard, Client *add, const Client *remove) {
+    ClientSet *old = atomic_load_explicit(&shard->clients, memory_order_relaxed);
+    size_t count = old ? old->count : 0;
+    ClientSet *set = malloc(sizeof(ClientSet) + (count + 1) * sizeof(Client *));
+    if (!set) {
+        return -1;
+    }
+    set->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (old->clients[i] != remove) {
+            set->clients[set->count++] = old->clients[i];
         }
-        free(to_kick);
     }
-    return NULL;
+    if (add) {
+        set->clients[set->count++] = add;
+    }
+    atomic_store(&shard->clients, set);
+    epoch_retire(old, free);
+    return 0;
 }
 
-static void join_client_threads(void) {
+/* Returns -1 if the username is already online. replayed is what replay_history
+ * returned for the lobby, UINT64_MAX for no scrollback. */
+static int add_client(Client *client, uint64_t replayed) {
+    Shard *shard = client->shard;
     pthread_mutex_lock(&clients_mutex);
-    Client *cur = clients;
-    while (cur) {
-        pthread_t tid = cur->thread;
+    if (ui_insert(client_index, client->username, client) < 0) {
         pthread_mutex_unlock(&clients_mutex);
-        pthread_join(tid, NULL);
-        pthread_mutex_lock(&clients_mutex);
-        cur = cur->next;
+        return -1;
+    }
+    pthread_mutex_lock(&shard->mutex);
+    if (ui_insert(shard->index, client->username, client) < 0) {
+        pthread_mutex_unlock(&shard->mutex);
+        ui_remove(client_index, client->username, client);
+        pthread_mutex_unlock(&clients_mutex);
+        return -1;
+    }
+    if (publish_clients(shard, client, NULL) < 0) {
+        ui_remove(shard->index, client->username, client);
+        pthread_mutex_unlock(&shard->mutex);
+        ui_remove(client_index, client->username, client);
+        pthread_mutex_unlock(&clients_mutex);
+        return -1;
     }
+    client->joined = 1;
+    catch_up_history(client, "", replayed);
+    pthread_mutex_unlock(&shard->mutex);
+    tw_schedule(timers, &client->idle_timer,
+                atomic_load_explicit(&client->last_activity, memory_order_relaxed) + inactivity_timeout_ms);
+    pthread_cond_signal(&watchdog_cond);
     pthread_mutex_unlock(&clients_mutex);
+    return 0;
 }
 
-static void print_usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [--unix PATH | --tcp PORT] [--timeout SECONDS]\n", prog);
-    fprintf(stderr, "Defaults: --unix %s, --tcp %s (if tcp selected), timeout %ld\n",
-            SOCKET_PATH, DEFAULT_TCP_PORT, (long)inactivity_timeout_sec);
-}
-
-int main(int argc, char *argv[]) {
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+static void remove_client(Client *client, const char *reason) {
+    int already_removed = 0;
+    int still_listed = 0;
+    Shard *shard = client->shard;
+    pthread_mutex_lock(&clients_mutex);
+    pthread_mutex_lock(&shard->mutex);
+    if (!client->removed) {
+        still_listed = publish_clients(shard, NULL, client) < 0;
+        client->removed = 1;
+        ui_remove(shard->index, client->username, client);
+        for (int i = 0; i < client->room_count; i++) {
+            rooms_part(shard->rooms, client->rooms[i], client);
+        }
+        client->room_count = 0;
+        ui_remove(client_index, client->username, client);
+        tw_cancel(timers, &client->idle_timer);
+        tw_cancel(timers, &client->resume_timer);
+    } else {
+        already_removed = 1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (already_removed) {
+        return;
+    }
+    pthread_mutex_lock(&shard->flush_mutex);
+    for (Client **pp = &shard->resume_list; client->resume_listed && *pp; pp = &(*pp)->resume_next) {
+        if (*pp == client) {
+            *pp = client->resume_next;
+            client->resume_listed = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->flush_mutex);
+    metrics_count(MET_DISCONNECTED, 1);
+
+    if (reason && reason[0] != '\0') {
+        char text[TEXT_MAX];
+        if (strcmp(reason, "inactivity") == 0) {
+            snprintf(text, sizeof(text), "User %s has been disconnected due to inactivity.", client->username);
+        } else {
+            snprintf(text, sizeof(text), "%s left (%s)", client->username, reason);
+        }
+        push_system_message(text, "");
+    }
+
+    close_client_socket(client);
+    /* Without memory for a new set the closed client stays listed, so it must not be freed */
+    if (!still_listed) {
+        retire_client(client);
+    }
+}
+
+/*
+ * A message being fanned out. It is serialized at most once per wire version
+ * into a shared frame; every recipient's outq just takes a reference, and the
+ * bytes are freed when the last socket has written them.
+ */
+typedef struct EncodedMessage {
+    const ChatMessage *msg;
+    SharedFrame *frame[PROTO_MAX_VERSION + 1];
+} EncodedMessage;
+
+static void encoded_init(EncodedMessage *enc, const ChatMessage *msg) {
+    enc->msg = msg;
+    memset(enc->frame, 0, sizeof(enc->frame));
+}
+
+static SharedFrame *encoded_frame(EncodedMessage *enc, int version) {
+    if (!enc->frame[version]) {
+        enc->frame[version] = encode_frame(version, enc->msg);
+    }
+    return enc->frame[version];
+}
+
+static void encoded_release(EncodedMessage *enc) {
+    for (int v = 0; v <= PROTO_MAX_VERSION; v++) {
+        frame_unref(enc->frame[v]);
+    }
+}
+
+/* Caller holds out_mutex. */
+static void queue_encoded(Client *client, EncodedMessage *enc) {
+    SharedFrame *frame = encoded_frame(enc, client->proto);
+    if (frame) {
+        queue_frame(client, frame);
+    }
+}
+
+/* One non-blocking sendmsg covering everything queued; skipped while EPOLLOUT is pending. */
+static void flush_if_idle(Client *client) {
+    if (!client->want_write) {
+        flush_client(client);
+    }
+}
+
+/* Where one message of a batch goes on this shard */
+typedef struct Delivery {
+    Client *dst;  /* private message recipient */
+    size_t first; /* room members: their range in the batch's MemberCopy */
+    size_t count;
+    int same_as;  /* an earlier message of the batch to the same room, or -1 */
+} Delivery;
+
+/* Room members of one batch, copied out under the shard mutex; one per dispatcher */
+typedef struct MemberCopy {
+    Client **clients;
+    size_t count;
+    size_t cap;
+} MemberCopy;
+
+static int is_broadcast(const ChatMessage *msg) {
+    return msg->target[0] == '\0' && msg->room[0] == '\0';
+}
+
+/* Reads the room list, which only the client's own reading thread changes: call it from
+ * that thread or under the shard mutex. Dispatchers hold neither and use delivery_has. */
+static int client_in_room(const Client *client, const char *room) {
+    for (int i = 0; i < client->room_count; i++) {
+        if (strncmp(client->rooms[i], room, ROOM_MAX) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Caller holds the shard mutex. A room that cannot be copied is left without recipients. */
+static void copy_members(const Shard *shard, const char *room, MemberCopy *copy, Delivery *dlv) {
+    size_t count = 0;
+    void *const *members = rooms_members(shard->rooms, room, &count);
+    if (copy->count + count > copy->cap) {
+        size_t new_cap = copy->cap ? copy->cap : 64;
+        while (new_cap < copy->count + count) {
+            new_cap *= 2;
+        }
+        Client **grown = realloc(copy->clients, new_cap * sizeof(Client *));
+        if (!grown) {
+            return;
+        }
+        copy->clients = grown;
+        copy->cap = new_cap;
+    }
+    dlv->first = copy->count;
+    dlv->count = count;
+    for (size_t j = 0; j < count; j++) {
+        copy->clients[copy->count++] = members[j];
+    }
+}
+
+static int compare_clients(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(Client *const *)a;
+    uintptr_t y = (uintptr_t)*(Client *const *)b;
+    return (x > y) - (x < y);
+}
+
+/* Membership without reading the client's own room list, which its thread may be changing */
+static int delivery_has(const Delivery *dlv, const MemberCopy *copy, const Client *client) {
+    return dlv->count > 0 &&
+           bsearch(&client, copy->clients + dlv->first, dlv->count, sizeof(Client *), compare_clients) != NULL;
+}
+
+static void queue_members(const Delivery *dlv, const MemberCopy *copy, EncodedMessage *enc) {
+    for (size_t j = 0; j < dlv->count; j++) {
+        Client *member = copy->clients[dlv->first + j];
+        pthread_mutex_lock(&member->out_mutex);
+        queue_encoded(member, enc);
+        pthread_mutex_unlock(&member->out_mutex);
+    }
+}
+
+static void flush_members(const Delivery *dlv, const MemberCopy *copy) {
+    for (size_t j = 0; j < dlv->count; j++) {
+        Client *member = copy->clients[dlv->first + j];
+        pthread_mutex_lock(&member->out_mutex);
+        flush_if_idle(member);
+        pthread_mutex_unlock(&member->out_mutex);
+    }
+}
+
+/* A batch with broadcasts, delivered to a range of the client set at a time */
+typedef struct FanoutBatch {
+    const ClientSet *set;
+    EncodedMessage *enc;
+    const Delivery *dlv;
+    const MemberCopy *copy;
+    size_t n;
+    int parallel; /* frames are encoded up front, so ranges may run on several threads */
+} FanoutBatch;
+
+/* Each client gets the whole batch in order, then one flush */
+static void deliver_range(void *arg, size_t first, size_t end) {
+    FanoutBatch *fb = arg;
+    for (size_t c = first; c < end; c++) {
+        Client *cur = fb->set->clients[c];
+        pthread_mutex_lock(&cur->out_mutex);
+        for (size_t i = 0; i < fb->n; i++) {
+            EncodedMessage *enc = &fb->enc[i];
+            const Delivery *dlv = &fb->dlv[i];
+            if (!is_broadcast(enc->msg) && dlv->dst != cur && !delivery_has(dlv, fb->copy, cur)) {
+                continue;
+            }
+            if (!fb->parallel) {
+                queue_encoded(cur, enc);
+            } else if (enc->frame[cur->proto]) {
+                queue_frame(cur, enc->frame[cur->proto]);
+            }
+        }
+        flush_if_idle(cur);
+        pthread_mutex_unlock(&cur->out_mutex);
+    }
+}
+
+/*
+ * Fan out a batch popped from a shard's inbox to that shard's clients. The shard
+ * mutex is only held to resolve recipients: private recipients are looked up,
+ * room members copied, the batch added to the history and the client set taken.
+ * Queueing and writing then run on that snapshot inside an epoch section, so
+ * joins and leaves never wait for a fan-out, nor a fan-out for them. Frames are
+ * queued per recipient in batch order, then each touched socket is flushed once,
+ * so a burst of M messages to N clients costs about N writes instead of M x N.
+ * A large client set is cut into chunks that the fan-out workers deliver
+ * alongside the dispatcher. Each client is still in exactly one chunk and the
+ * next batch waits for every chunk, so per-recipient order holds, and the
+ * epoch section stays open until the last worker is done with the set.
+ */
+static void dispatch_batch(Shard *shard, EncodedMessage *enc, Delivery *dlv, MemberCopy *copy, FanoutJob *job,
+                           size_t n) {
+    int has_broadcast = 0;
+    uint32_t shard_no = (uint32_t)(shard - shards);
+    copy->count = 0;
+    epoch_enter();
+    pthread_mutex_lock(&shard->mutex);
+    for (size_t i = 0; i < n && trace_enabled(); i++) {
+        trace_event(enc[i].msg->trace_id, TRACE_LOCKED, shard_no);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const ChatMessage *msg = enc[i].msg;
+        memset(&dlv[i], 0, sizeof(Delivery));
+        dlv[i].same_as = -1;
+        if (msg->target[0] != '\0') {
+            dlv[i].dst = ui_lookup(shard->index, msg->target);
+        } else if (msg->room[0] != '\0') {
+            for (size_t k = 0; k < i && dlv[i].same_as < 0; k++) {
+                if (enc[k].msg->target[0] == '\0' && strncmp(enc[k].msg->room, msg->room, ROOM_MAX) == 0) {
+                    dlv[i] = dlv[k];
+                    dlv[i].same_as = dlv[k].same_as < 0 ? (int)k : dlv[k].same_as;
+                }
+            }
+            if (dlv[i].same_as < 0) {
+                copy_members(shard, msg->room, copy, &dlv[i]);
+            }
+        } else {
+            has_broadcast = 1;
+        }
+        if (shard->history && msg->target[0] == '\0' && !is_system_message(msg)) {
+            history_add(shard->history, msg);
+        }
+    }
+    const ClientSet *set = has_broadcast ? atomic_load(&shard->clients) : NULL;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (has_broadcast) {
+        for (size_t i = 0; i < n; i++) {
+            if (dlv[i].count > 1 && dlv[i].same_as < 0) {
+                qsort(copy->clients + dlv[i].first, dlv[i].count, sizeof(Client *), compare_clients);
+            }
+        }
+        FanoutBatch fb = {set, enc, dlv, copy, n, job && set && set->count >= fanout_threshold};
+        if (fb.parallel) {
+            for (size_t i = 0; i < n; i++) {
+                for (int v = PROTO_LEGACY; v <= PROTO_MAX_VERSION; v++) {
+                    encoded_frame(&enc[i], v);
+                }
+            }
+            size_t steals = fanout_run(job, set->count, FANOUT_CHUNK, deliver_range, &fb);
+            metrics_count(MET_FANOUT_PARALLEL, 1);
+            metrics_count(MET_FANOUT_STEALS, steals);
+        } else if (set) {
+            deliver_range(&fb, 0, set->count);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            if (dlv[i].dst) {
+                pthread_mutex_lock(&dlv[i].dst->out_mutex);
+                queue_encoded(dlv[i].dst, &enc[i]);
+                pthread_mutex_unlock(&dlv[i].dst->out_mutex);
+            }
+            queue_members(&dlv[i], copy, &enc[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (dlv[i].dst) {
+                pthread_mutex_lock(&dlv[i].dst->out_mutex);
+                flush_if_idle(dlv[i].dst);
+                pthread_mutex_unlock(&dlv[i].dst->out_mutex);
+            }
+            if (dlv[i].same_as < 0) {
+                flush_members(&dlv[i], copy);
+            }
+        }
+    }
+    for (size_t i = 0; i < n && trace_enabled(); i++) {
+        trace_event(enc[i].msg->trace_id, TRACE_FANNED, shard_no);
+    }
+    epoch_exit();
+}
+
+static void *dispatcher_thread(void *arg) {
+    Shard *shard = arg;
+    ChatMessage *batch = malloc(DISPATCH_BATCH * sizeof(ChatMessage));
+    EncodedMessage *enc = malloc(DISPATCH_BATCH * sizeof(EncodedMessage));
+    Delivery *dlv = malloc(DISPATCH_BATCH * sizeof(Delivery));
+    MemberCopy copy = {NULL, 0, 0};
+    FanoutJob *job = fanout_pool ? fanout_job_create(fanout_pool) : NULL;
+    if (!batch || !enc || !dlv || (fanout_pool && !job)) {
+        perror("dispatcher");
+        free(batch);
+        free(enc);
+        free(dlv);
+        fanout_job_destroy(job);
+        return NULL;
+    }
+
+    int n;
+    while ((running || atomic_load(&handing_over)) && (n = mq_pop_batch(shard->inbox, batch, DISPATCH_BATCH)) > 0) {
+        uint64_t now = metrics_now();
+        metrics_count(MET_MSGS_DISPATCHED, (uint64_t)n);
+        for (int i = 0; i < n; i++) {
+            if (batch[i].received_ns) {
+                metrics_observe(MET_LAT_QUEUE, now > batch[i].received_ns ? now - batch[i].received_ns : 0);
+            }
+            trace_event(batch[i].trace_id, TRACE_DEQUEUED, (uint32_t)(shard - shards));
+            encoded_init(&enc[i], &batch[i]);
+        }
+        dispatch_batch(shard, enc, dlv, &copy, job, (size_t)n);
+        metrics_observe_since(MET_LAT_DISPATCH, now);
+        for (int i = 0; i < n; i++) {
+            encoded_release(&enc[i]);
+        }
+    }
+    free(batch);
+    free(enc);
+    free(dlv);
+    free(copy.clients);
+    fanout_job_destroy(job);
+    return NULL;
+}
+
+/*
+ * Group commit: every batch taken off the log queue becomes one write() of
+ * binary records, and fdatasync runs per --log-sync rather than per message.
+ * Rendering to text is left to the offline chatlog tool.
+ */
+static void *logger_thread(void *arg) {
+    (void)arg;
+    ChatMessage *batch = malloc(LOG_BATCH * sizeof(ChatMessage));
+    if (!batch) {
+        perror("logger");
+        return NULL;
+    }
+
+    size_t unsynced = 0;
+    uint64_t first_unsynced = 0;
+    for (;;) {
+        int timeout = -1;
+        if (log_sync_policy == LOG_SYNC_INTERVAL && unsynced > 0) {
+            long left = log_sync_every - (long)(monotonic_ms() - first_unsynced);
+            timeout = left > 0 ? (int)left : 0;
+        }
+        int n = mq_pop_batch_timed(log_queue, batch, LOG_BATCH, timeout);
+        if (n < 0) {
+            break;
+        }
+        if (n > 0) {
+            if (binlog_append(chat_log, batch, (size_t)n) < 0) {
+                perror("chat log");
+                metrics_count(MET_LOG_ERRORS, 1);
+            } else {
+                metrics_count(MET_LOG_RECORDS, (uint64_t)n);
+                metrics_count(MET_LOG_WRITES, 1);
+                metrics_observe_since(MET_LAT_LOG, batch[0].received_ns);
+                for (int i = 0; i < n && trace_enabled(); i++) {
+                    trace_event(batch[i].trace_id, TRACE_LOGGED, TRACE_NO_SHARD);
+                }
+            }
+            if (unsynced == 0) {
+                first_unsynced = monotonic_ms();
+            }
+            unsynced += (size_t)n;
+        }
+
+        int due = 0;
+        if (log_sync_policy == LOG_SYNC_COUNT) {
+            due = unsynced >= (size_t)log_sync_every;
+        } else if (log_sync_policy == LOG_SYNC_INTERVAL) {
+            due = unsynced > 0 && (long)(monotonic_ms() - first_unsynced) >= log_sync_every;
+        }
+        if (due) {
+            if (binlog_sync(chat_log) < 0) {
+                perror("chat log sync");
+                metrics_count(MET_LOG_ERRORS, 1);
+            } else {
+                metrics_count(MET_LOG_SYNCS, 1);
+            }
+            unsynced = 0;
+        }
+    }
+
+    if (unsynced > 0 && log_sync_policy != LOG_SYNC_NONE) {
+        binlog_sync(chat_log);
+    }
+    free(batch);
+    return NULL;
+}
+
+static const char *client_exit_reason(Client *client) {
+    pthread_mutex_lock(&clients_mutex);
+    const char *reason = client->kick_reason ? client->kick_reason : "disconnected";
+    pthread_mutex_unlock(&clients_mutex);
+    return reason;
+}
+
+/* Reply with each user's outbound queue depth, so slow readers are easy to spot. */
+static void list_clients(Client *requester) {
+    char lines[WHO_MAX_ENTRIES][TEXT_MAX];
+    size_t shown = 0;
+    size_t total = 0;
+
+    epoch_enter();
+    for (int s = 0; s < shard_count; s++) {
+        const ClientSet *set = atomic_load(&shards[s].clients);
+        total += set ? set->count : 0;
+        for (size_t c = 0; set && c < set->count && shown < WHO_MAX_ENTRIES; c++) {
+            Client *cur = set->clients[c];
+            pthread_mutex_lock(&cur->out_mutex);
+            snprintf(lines[shown], TEXT_MAX, "%s: queue %zu/%zu, dropped %lu%s", cur->username,
+                     outq_depth(cur->outq), outq_capacity, cur->dropped, cur->lagging ? ", lagging" : "");
+            pthread_mutex_unlock(&cur->out_mutex);
+            shown++;
+        }
+    }
+    epoch_exit();
+
+    for (size_t i = 0; i < shown; i++) {
+        push_system_reply(lines[i], requester);
+    }
+    char summary[TEXT_MAX];
+    snprintf(summary, sizeof(summary), "%zu user(s) online", total);
+    push_system_reply(summary, requester);
+}
+
+/* The admin report as text, one reply per line */
+static void send_stats(Client *client) {
+    char *report = metrics_render(0);
+    if (!report) {
+        push_system_reply("Stats are unavailable.", client);
+        return;
+    }
+    char *save = NULL;
+    for (char *line = strtok_r(report, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        push_system_reply(line, client);
+    }
+    free(report);
+}
+
+/* Runs on the client's own reading thread, the only writer of its room list. */
+static void join_room(Client *client, const char *room) {
+    char text[TEXT_MAX];
+    if (!room_name_valid(room)) {
+        push_system_reply("Room names look like #name.", client);
+        return;
+    }
+
+    Shard *shard = client->shard;
+    /* Only this thread changes the room list, so a join that passes here happens below */
+    uint64_t replayed = UINT64_MAX;
+    if (!client_in_room(client, room) && client->room_count < CLIENT_ROOMS_MAX) {
+        replayed = replay_history(client, room);
+    }
+    int rc;
+    pthread_mutex_lock(&shard->mutex);
+    if (client_in_room(client, room)) {
+        rc = 1;
+    } else if (client->room_count == CLIENT_ROOMS_MAX) {
+        rc = -2;
+    } else {
+        rc = rooms_join(shard->rooms, room, client);
+        if (rc == 0) {
+            snprintf(client->rooms[client->room_count++], ROOM_MAX, "%s", room);
+            catch_up_history(client, room, replayed);
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (rc == 0) {
+        pthread_mutex_lock(&client->out_mutex);
+        flush_if_idle(client);
+        pthread_mutex_unlock(&client->out_mutex);
+        snprintf(text, sizeof(text), "%s joined %s", client->username, room);
+        push_room_notice(text, room);
+        return;
+    }
+    if (rc == 1) {
+        snprintf(text, sizeof(text), "You are already in %s.", room);
+    } else if (rc == -2) {
+        snprintf(text, sizeof(text), "You can be in at most %d rooms.", CLIENT_ROOMS_MAX);
+    } else {
+        snprintf(text, sizeof(text), "Could not join %s.", room);
+    }
+    push_system_reply(text, client);
+}
+
+static void part_room(Client *client, const char *room) {
+    char text[TEXT_MAX];
+    Shard *shard = client->shard;
+    int found = 0;
+    pthread_mutex_lock(&shard->mutex);
+    for (int i = 0; i < client->room_count; i++) {
+        if (strncmp(client->rooms[i], room, ROOM_MAX) == 0) {
+            rooms_part(shard->rooms, room, client);
+            memcpy(client->rooms[i], client->rooms[--client->room_count], ROOM_MAX);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!found) {
+        snprintf(text, sizeof(text), "You are not in %s.", room);
+        push_system_reply(text, client);
+        return;
+    }
+    snprintf(text, sizeof(text), "You left %s.", room);
+    push_system_reply(text, client);
+    snprintf(text, sizeof(text), "%s left %s", client->username, room);
+    push_room_notice(text, room);
+}
+
+/* What /history shows a client: the lobby, its rooms and its own private messages */
+static int history_visible(const Client *client, const ChatMessage *msg) {
+    if (is_system_message(msg)) {
+        return 0;
+    }
+    if (msg->target[0] != '\0') {
+        return strcmp(msg->target, client->username) == 0 || strcmp(msg->sender, client->username) == 0;
+    }
+    return msg->room[0] == '\0' || client_in_room(client, msg->room);
+}
+
+/* Position of the first indexed record numbered at least seq; caller holds history_index_mutex. */
+static size_t history_position(uint64_t seq) {
+    size_t lo = 0;
+    size_t hi = binlog_index_count(history_index);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t at = 0;
+        ChatMessage msg;
+        if (binlog_index_get(history_index, mid, &at, &msg) < 0 || at >= seq) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/*
+ * /history N: page back through the chat log, N messages at a time, each call
+ * continuing below the oldest record the last one looked at. The log segments
+ * are mapped and indexed once and extended as they grow; the walk holds only
+ * history_index_mutex and sends the page in one write.
+ */
+static void show_history(Client *client, const char *arg) {
+    long want = arg ? strtol(arg, NULL, 10) : 0;
+    if (want <= 0) {
+        want = HISTORY_PAGE_DEFAULT;
+    } else if (want > HISTORY_PAGE_MAX) {
+        want = HISTORY_PAGE_MAX;
+    }
+    ChatMessage *page = malloc((size_t)want * sizeof(ChatMessage));
+    if (!page) {
+        push_system_reply("History is unavailable.", client);
+        return;
+    }
+
+    size_t found = 0;
+    uint64_t cursor = client->history_before;
+    pthread_mutex_lock(&history_index_mutex);
+    if (!history_index) {
+        history_index = binlog_index_open(log_prefix);
+    }
+    if (history_index && binlog_index_refresh(history_index) == 0) {
+        size_t i = cursor ? history_position(cursor) : binlog_index_count(history_index);
+        for (size_t scanned = 0; i > 0 && found < (size_t)want && scanned < HISTORY_SCAN_MAX; scanned++) {
+            ChatMessage msg;
+            if (binlog_index_get(history_index, --i, &cursor, &msg) == 0 && history_visible(client, &msg)) {
+                page[found++] = msg;
+            }
+        }
+        if (i == 0) {
+            cursor = 1; /* nothing is numbered below the first record */
+        }
+    }
+    pthread_mutex_unlock(&history_index_mutex);
+    client->history_before = cursor;
+
+    if (found == 0) {
+        push_system_reply("No earlier messages in the chat log.", client);
+        free(page);
+        return;
+    }
+    /* Newest first on the walk back, oldest first on the screen */
+    for (size_t lo = 0, hi = found - 1; lo < hi; lo++, hi--) {
+        ChatMessage tmp = page[lo];
+        page[lo] = page[hi];
+        page[hi] = tmp;
+    }
+    char text[TEXT_MAX];
+    ChatMessage header;
+    snprintf(text, sizeof(text), "%zu earlier message(s); /history again for more:", found);
+    make_system_message(&header, text, client->username);
+    pthread_mutex_lock(&client->out_mutex);
+    push_direct(client, client->proto, &header);
+    queue_scrollback(client, page, found);
+    flush_if_idle(client);
+    pthread_mutex_unlock(&client->out_mutex);
+    free(page);
+}
+
+/* Server-side slash commands; returns 1 when the text was consumed. */
+static int handle_command(Client *client, const ChatMessage *msg) {
+    if (msg->target[0] != '\0' || msg->room[0] != '\0') {
+        return 0;
+    }
+    if (strcmp(msg->text, "/who") == 0) {
+        list_clients(client);
+        return 1;
+    }
+    if (strcmp(msg->text, "/stats") == 0) {
+        send_stats(client);
+        return 1;
+    }
+    if (strcmp(msg->text, "/history") == 0 || strncmp(msg->text, "/history ", 9) == 0) {
+        show_history(client, msg->text[8] ? msg->text + 9 : NULL);
+        return 1;
+    }
+    if (strncmp(msg->text, "/join ", 6) == 0) {
+        join_room(client, msg->text + 6);
+        return 1;
+    }
+    if (strncmp(msg->text, "/part ", 6) == 0) {
+        part_room(client, msg->text + 6);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Stop reading from a flooding client for RATE_PAUSE_MS, so what it sends
+ * backs up in its own socket buffer. A client thread just sleeps; a reactor
+ * stops watching for input, or cancels the multishot recv, and the watchdog
+ * puts the client on the resume list.
+ */
+static void pause_reads(Client *client) {
+    if (io_mode == IO_THREADS) {
+        struct timespec ts = {RATE_PAUSE_MS / 1000, (long)(RATE_PAUSE_MS % 1000) * 1000000L};
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+        return;
+    }
+    pthread_mutex_lock(&client->out_mutex);
+    client->paused = 1;
+    if (io_mode == IO_EPOLL && !client->shm) {
+        update_epoll(client, client->want_write);
+    }
+    pthread_mutex_unlock(&client->out_mutex);
+    /* On the reactor: input already completed still lands in inbuf, nothing more is received */
+    if (io_mode == IO_URING && !client->recv_parked &&
+        uring_prep_cancel(client->shard->ring, (uint64_t)(uintptr_t)client | URING_RECV,
+                          (uint64_t)(uintptr_t)client | URING_CANCEL) == 0) {
+        client->uring_ops++;
+        /* Right away, so the recv stops before it drains the whole socket buffer */
+        int submitted = uring_submit_and_wait(client->shard->ring, 0);
+        if (submitted > 0) {
+            metrics_count(MET_URING_ENTERS, 1);
+            metrics_count(MET_URING_SQES, (uint64_t)submitted);
+        }
+    }
+    pthread_mutex_lock(&clients_mutex);
+    tw_schedule(timers, &client->resume_timer, monotonic_ms() + RATE_PAUSE_MS);
+    pthread_cond_signal(&watchdog_cond);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/*
+ * Token bucket, refilled at rate_limit messages per second up to rate_burst.
+ * Over the limit a message is dropped: the first drop of a run warns the
+ * client, every RATE_STRIKES drops pause its reads, and more than RATE_PAUSES_MAX pauses
+ * without the bucket filling up again disconnect it. Returns 0 to drop.
+ */
+static int rate_allow(Client *client) {
+    if (rate_limit == 0) {
+        return 1;
+    }
+    if (client->rate_pauses > RATE_PAUSES_MAX) {
+        return 0; /* kicked; whatever is still buffered goes unread */
+    }
+    uint64_t now = monotonic_ms();
+    uint64_t cap = (uint64_t)rate_burst * 1000;
+    client->rate_tokens += (now - client->rate_refilled_ms) * rate_limit;
+    client->rate_refilled_ms = now;
+    if (client->rate_tokens >= cap) {
+        client->rate_tokens = cap;
+        client->rate_strikes = 0;
+        client->rate_pauses = 0;
+    }
+    if (client->rate_tokens >= 1000) {
+        client->rate_tokens -= 1000;
+        return 1;
+    }
+    metrics_count(MET_RATE_DROPPED, 1);
+    if (++client->rate_strikes == 1) {
+        char text[TEXT_MAX];
+        snprintf(text, sizeof(text), "You are sending too fast (limit %lu messages per second); "
+                 "messages are being dropped.", rate_limit);
+        push_system_reply(text, client);
+        metrics_count(MET_RATE_WARNED, 1);
+    }
+    if (client->rate_strikes < RATE_STRIKES) {
+        return 0;
+    }
+    client->rate_strikes = 0;
+    if (++client->rate_pauses > RATE_PAUSES_MAX) {
+        /* The reading thread drops the connection once it sees the shutdown. */
+        pthread_mutex_lock(&clients_mutex);
+        if (!client->kick_reason) {
+            client->kick_reason = "flooding";
+            shutdown(client->fd, SHUT_RDWR);
+            metrics_count(MET_RATE_KICKED, 1);
+        }
+        pthread_mutex_unlock(&clients_mutex);
+        return 0;
+    }
+    metrics_count(MET_RATE_PAUSED, 1);
+    pause_reads(client);
+    return 0;
+}
+
+static void handle_client_message(Client *client, ChatMessage *msg) {
+    trim_string(msg->target, USERNAME_MAX);
+    trim_string(msg->room, ROOM_MAX);
+    trim_string(msg->text, TEXT_MAX);
+    msg->text[TEXT_MAX - 1] = '\0';
+    snprintf(msg->sender, USERNAME_MAX, "%s", client->username);
+    msg->timestamp = time(NULL);
+    msg->received_ns = metrics_now();
+    msg->trace_id = trace_next_id();
+    trace_event(msg->trace_id, TRACE_RECV, (uint32_t)(client->shard - shards));
+    metrics_count(MET_MSGS_IN, 1);
+    touch_client(client);
+    if (!rate_allow(client)) {
+        return;
+    }
+
+    if (handle_command(client, msg)) {
+        return;
+    }
+    if (msg->target[0] != '\0') {
+        msg->room[0] = '\0';
+    } else if (msg->room[0] != '\0' && !client_in_room(client, msg->room)) {
+        char text[TEXT_MAX];
+        snprintf(text, sizeof(text), "You are not in %s; /join %s first.", msg->room, msg->room);
+        push_system_reply(text, client);
+        return;
+    }
+
+    route_message(msg);
+    trace_event(msg->trace_id, TRACE_ROUTED, (uint32_t)(client->shard - shards));
+    mq_push(log_queue, msg);
+}
+
+/* A frame the protocol accepts but ChatMessage cannot hold is refused, not cut short */
+static void reject_too_long(Client *client) {
+    touch_client(client);
+    if (!rate_allow(client)) {
+        return;
+    }
+    char text[TEXT_MAX];
+    snprintf(text, sizeof(text), "Message not sent: text is limited to %d bytes, names and rooms to %d.",
+             TEXT_MAX - 1, USERNAME_MAX - 1);
+    push_system_reply(text, client);
+}
+
+static int parse_hello(ChatMessage *hello, char *username_out) {
+    trim_string(hello->sender, USERNAME_MAX);
+    if (hello->sender[0] == '\0') {
+        return -1;
+    }
+    snprintf(username_out, USERNAME_MAX, "%s", hello->sender);
+    return 0;
+}
+
+static int accept_handshake(Client *client) {
+    ChatMessage hello;
+    if (proto_recv(client->fd, PROTO_LEGACY, &hello) < 0) {
+        return -1;
+    }
+    if (parse_hello(&hello, client->username) < 0) {
+        return -1;
+    }
+    int version = proto_hello_version(&hello);
+    if (version > PROTO_LEGACY) {
+        ChatMessage ack;
+        proto_make_ack(&ack, version, 0);
+        if (proto_send(client->fd, PROTO_LEGACY, &ack) < 0) {
+            return -1;
+        }
+    }
+    client->proto = version;
+    return 0;
+}
+
+/*
+ * Reactor mode, UNIX socket: ack, pass the shared memory, then watch the
+ * client's doorbell instead of socket input; the socket only reports the
+ * hangup from now on. Nothing else has been written to the socket yet, so the
+ * ack goes out directly. Returns 1 if granted, 0 to stay on the socket.
+ */
+static int start_shm(Client *client, int version) {
+    ShmChannel *ch = shm_create(SHM_RING_SIZE);
+    if (!ch) {
+        perror("shm");
+        return 0;
+    }
+    ChatMessage ack;
+    proto_make_ack(&ack, version, 1);
+    if (proto_send(client->fd, PROTO_LEGACY, &ack) < 0 || shm_send(ch, client->fd) < 0) {
+        shm_destroy(ch);
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    if (epoll_ctl(client->shard->epfd, EPOLL_CTL_ADD, shm_wait_fd(ch), &ev) < 0) {
+        shm_destroy(ch);
+        return -1;
+    }
+    ev.events = EPOLLRDHUP;
+    if (epoll_ctl(client->shard->epfd, EPOLL_CTL_MOD, client->fd, &ev) < 0) {
+        shm_destroy(ch);
+        return -1;
+    }
+    pthread_mutex_lock(&client->out_mutex);
+    client->shm = ch;
+    pthread_mutex_unlock(&client->out_mutex);
+    return 1;
+}
+
+/* Reactor mode: the ack is queued before the client becomes visible to the dispatcher. */
+static int accept_hello(Client *client, ChatMessage *hello) {
+    if (parse_hello(hello, client->username) < 0) {
+        return -1;
+    }
+    int version = proto_hello_version(hello);
+    if (proto_hello_shm(hello) && server_mode == MODE_UNIX && io_mode == IO_EPOLL) {
+        int rc = start_shm(client, version);
+        if (rc != 0) {
+            client->proto = version;
+            return rc < 0 ? -1 : 0;
+        }
+    }
+    if (version > PROTO_LEGACY) {
+        ChatMessage ack;
+        proto_make_ack(&ack, version, 0);
+        pthread_mutex_lock(&client->out_mutex);
+        int rc = push_direct(client, PROTO_LEGACY, &ack);
+        if (rc == 0) {
+            flush_client(client);
+        }
+        pthread_mutex_unlock(&client->out_mutex);
+        if (rc < 0) {
+            return -1;
+        }
+    }
+    client->proto = version;
+    return 0;
+}
+
+static void make_name_taken_notice(ChatMessage *notice, const Client *client) {
+    char text[TEXT_MAX];
+    snprintf(text, sizeof(text), "Username %s is already taken.", client->username);
+    make_system_message(notice, text, client->username);
+}
+
+/* Runs in the watchdog with clients_mutex held; a storm keeps the window open. */
+static void join_digest_expired(Timer *timer, uint64_t now) {
+    (void)timer;
+    char text[TEXT_MAX];
+    if (join_digest_more > 0) {
+        snprintf(text, sizeof(text), "%s and %zu others joined", join_digest, join_digest_more);
+    } else {
+        snprintf(text, sizeof(text), "%s joined", join_digest);
+    }
+    join_digest[0] = '\0';
+    join_digest_more = 0;
+    join_quiet_until = now + JOIN_DIGEST_MS;
+    push_system_message(text, "");
+}
+
+static void announce_join(Client *client) {
+    char text[TEXT_MAX];
+    pthread_mutex_lock(&clients_mutex);
+    uint64_t now = monotonic_ms();
+    if (now >= join_quiet_until && !timer_pending(&join_digest_timer)) {
+        join_quiet_until = now + JOIN_DIGEST_MS;
+        pthread_mutex_unlock(&clients_mutex);
+        snprintf(text, sizeof(text), "%s joined", client->username);
+        push_system_message(text, "");
+        return;
+    }
+    size_t len = strlen(join_digest);
+    if (len + strlen(client->username) + 2 < sizeof(join_digest)) {
+        snprintf(join_digest + len, sizeof(join_digest) - len, "%s%s", len ? ", " : "", client->username);
+    } else {
+        join_digest_more++;
+    }
+    if (!timer_pending(&join_digest_timer)) {
+        tw_schedule(timers, &join_digest_timer, join_quiet_until);
+        pthread_cond_signal(&watchdog_cond);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/* Threads mode: the hello is read on the client's own thread, so a connection
+ * that never sends one holds up nobody but itself until its deadline. */
+static int thread_handshake(Client *client) {
+    if (accept_handshake(client) < 0) {
+        return -1;
+    }
+    touch_client(client);
+    uint64_t replayed = replay_history(client, "");
+    if (add_client(client, replayed) < 0) {
+        ChatMessage notice;
+        make_name_taken_notice(&notice, client);
+        proto_send(client->fd, client->proto, &notice);
+        return -1;
+    }
+    leave_handshake(client, 0);
+    pthread_mutex_lock(&client->out_mutex);
+    flush_if_idle(client);
+    pthread_mutex_unlock(&client->out_mutex);
+    announce_join(client);
+    return 0;
+}
+
+static void *client_thread(void *arg) {
+    Client *client = (Client *)arg;
+    ChatMessage msg;
+
+    if (thread_handshake(client) < 0) {
+        /* Never joined: nobody waits for this thread */
+        pthread_detach(pthread_self());
+        leave_handshake(client, 1);
+        close(client->fd);
+        client_free(client);
+        return NULL;
+    }
+    while (running) {
+        int rc = proto_recv(client->fd, client->proto, &msg);
+        if (rc == PROTO_TOO_LONG) {
+            reject_too_long(client);
+            continue;
+        }
+        if (rc < 0) {
+            break;
+        }
+        handle_client_message(client, &msg);
+    }
+
+    remove_client(client, client_exit_reason(client));
+    return NULL;
+}
+
+static void *accept_thread(void *arg) {
+    (void)arg;
+    while (running) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!running) {
+                break;
+            }
+            perror("accept");
+            continue;
+        }
+
+        metrics_count(MET_ACCEPTED, 1);
+        Client *client = client_new(client_fd, &shards[0]);
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+
+        start_handshake(client);
+        if (pthread_create(&client->thread, NULL, client_thread, client) != 0) {
+            perror("pthread_create client");
+            leave_handshake(client, 1);
+            close(client_fd);
+            client_free(client);
+        }
+    }
+    return NULL;
+}
+
+/* Connections that die before their hello was accepted never entered the clients list. */
+static void drop_connection(Client *client) {
+    if (!client->joined) {
+        leave_handshake(client, 1);
+        close_client_socket(client);
+        retire_client(client);
+        return;
+    }
+    remove_client(client, client_exit_reason(client));
+}
+
+/* A shared listener is taken ACCEPT_BATCH connections per wakeup so the other shards get a turn. */
+static void reactor_accept(Shard *shard) {
+    for (int taken = 0; !listener_shared || taken < ACCEPT_BATCH; taken++) {
+        int client_fd = accept4(shard->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && running) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        metrics_count(MET_ACCEPTED, 1);
+        Client *client = client_new(client_fd, shard);
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client;
+        if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl client");
+            close(client_fd);
+            client_free(client);
+            continue;
+        }
+        start_handshake(client);
+    }
+}
+
+/* Best effort: the connection is dropped right after, so whatever fits in the socket buffer */
+static void reject_name_taken(Client *client) {
+    ChatMessage notice;
+    make_name_taken_notice(&notice, client);
+    pthread_mutex_lock(&client->out_mutex);
+    if (push_direct(client, client->proto, &notice) == 0) {
+        write_queued(client);
+    }
+    pthread_mutex_unlock(&client->out_mutex);
+}
+
+/* Make room for more input; -1 once a frame would exceed the protocol limit,
+ * or a paused client's backlog RATE_PAUSE_INPUT_MAX. */
+static int reserve_input(Client *client) {
+    if (client->inlen < client->incap) {
+        return 0;
+    }
+    /* A frame larger than the buffer, or frames received before a pause took effect;
+     * the last step stops exactly at the limit */
+    size_t limit = client->paused ? RATE_PAUSE_INPUT_MAX : PROTO_MAX_FRAME + PROTO_VARINT_MAX;
+    size_t new_cap = client->incap * 2 < limit ? client->incap * 2 : limit;
+    char *grown = new_cap > client->incap ? realloc(client->inbuf, new_cap) : NULL;
+    if (!grown) {
+        return -1;
+    }
+    client->inbuf = grown;
+    client->incap = new_cap;
+    return 0;
+}
+
+/* Act on every complete frame in inbuf and keep the partial tail; -1 to drop the connection. */
+static int handle_input(Client *client, int *frames) {
+    size_t off = 0;
+    while (!client->paused) {
+        size_t frame_len = 0;
+        int rc = proto_frame_size(client->proto, client->inbuf + off, client->inlen - off, &frame_len);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            break;
+        }
+        ChatMessage msg;
+        int decoded = proto_decode(client->proto, client->inbuf + off, frame_len, &msg);
+        if (decoded == -1 || (decoded < 0 && !client->joined)) {
+            return -1;
+        }
+        off += frame_len;
+        (*frames)++;
+        if (decoded == PROTO_TOO_LONG) {
+            reject_too_long(client);
+            continue;
+        }
+
+        if (!client->joined) {
+            if (accept_hello(client, &msg) < 0) {
+                return -1;
+            }
+            touch_client(client);
+            uint64_t replayed = replay_history(client, "");
+            if (add_client(client, replayed) < 0) {
+                reject_name_taken(client);
+                return -1;
+            }
+            leave_handshake(client, 0);
+            pthread_mutex_lock(&client->out_mutex);
+            flush_if_idle(client);
+            pthread_mutex_unlock(&client->out_mutex);
+            announce_join(client);
+        } else {
+            handle_client_message(client, &msg);
+        }
+    }
+    memmove(client->inbuf, client->inbuf + off, client->inlen - off);
+    client->inlen -= off;
+    return 0;
+}
+
+/* Assemble frames from a readable socket; returns -1 when the connection should be dropped. */
+static int reactor_read(Client *client) {
+    int frames = 0;
+    while (frames < REACTOR_READ_BUDGET && !client->paused) {
+        if (reserve_input(client) < 0) {
+            return -1;
+        }
+        ssize_t n;
+        if (client->shm) {
+            n = shm_read(client->shm, client->inbuf + client->inlen, client->incap - client->inlen);
+            if (n == 0 && shm_arm_readable(client->shm)) {
+                continue;
+            }
+            if (n <= 0) {
+                return (int)n;
+            }
+        } else {
+            n = recv(client->fd, client->inbuf + client->inlen, client->incap - client->inlen, 0);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        client->inlen += (size_t)n;
+        if (handle_input(client, &frames) < 0) {
+            return -1;
+        }
+    }
+    if (client->shm && !client->paused) {
+        shm_ring_self(client->shm); /* out of budget: come back for the rest */
+    }
+    return 0;
+}
+
+/* A shared-memory client: its doorbell rang (EPOLLIN) or its socket hung up */
+static int shm_event(Client *client, uint32_t events) {
+    if (events & EPOLLIN) {
+        shm_clear(client->shm);
+        pthread_mutex_lock(&client->out_mutex);
+        if (client->want_write) {
+            flush_client(client);
+        }
+        pthread_mutex_unlock(&client->out_mutex);
+    }
+    int rc = reactor_read(client);
+    return events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ? -1 : rc;
+}
+
+/* A dropped shared-memory client may still have an event for its other descriptor */
+static void forget_events(struct epoll_event *events, int from, int n, const Client *client) {
+    for (int i = from; i < n; i++) {
+        if (events[i].data.ptr == client) {
+            events[i].data.ptr = NULL;
+        }
+    }
+}
+
+/* Reactor modes: read again from clients whose pause is over, starting with what is already buffered */
+static void resume_reads(Shard *shard) {
+    pthread_mutex_lock(&shard->flush_mutex);
+    Client *cur = shard->resume_list;
+    shard->resume_list = NULL;
+    for (Client *c = cur; c; c = c->resume_next) {
+        c->resume_listed = 0;
+    }
+    pthread_mutex_unlock(&shard->flush_mutex);
+    while (cur) {
+        Client *next = cur->resume_next;
+        pthread_mutex_lock(&cur->out_mutex);
+        cur->paused = 0;
+        if (io_mode == IO_EPOLL && !cur->shm && !cur->closed) {
+            update_epoll(cur, cur->want_write);
+        }
+        pthread_mutex_unlock(&cur->out_mutex);
+        int frames = 0;
+        int rc = handle_input(cur, &frames);
+        if (rc == 0 && !cur->paused && cur->shm) {
+            rc = reactor_read(cur);
+        } else if (rc == 0 && !cur->paused && cur->recv_parked) {
+            rc = uring_prep_recv(shard->ring, cur->fd, (uint64_t)(uintptr_t)cur | URING_RECV);
+            cur->uring_ops += rc == 0;
+            cur->recv_parked = rc != 0;
+        }
+        if (rc < 0) {
+            drop_connection(cur);
+        }
+        cur = next;
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    Shard *shard = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (running) {
+        int n = epoll_wait(shard->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &wakeup_tag) {
+                drain_wakeups(shard);
+                continue;
+            }
+            if (tag == &listener_tag) {
+                reactor_accept(shard);
+                continue;
+            }
+            Client *client = tag;
+            if (!client) {
+                continue;
+            }
+            if (client->shm) {
+                if (shm_event(client, events[i].events) < 0) {
+                    drop_connection(client);
+                    forget_events(events, i + 1, n, client);
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&client->out_mutex);
+                flush_client(client);
+                pthread_mutex_unlock(&client->out_mutex);
+            }
+            if ((events[i].events & ~EPOLLOUT) && reactor_read(client) < 0) {
+                drop_connection(client);
+            } else if (client->paused && (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                drop_connection(client); /* not reading, so a hangup would keep firing */
+            }
+        }
+        resume_reads(shard);
+    }
+    return NULL;
+}
+
+/* io_uring mode: hand everything queued for the client to the kernel in one sendmsg;
+ * caller holds out_mutex and runs on the shard's reactor. */
+static void uring_send(Client *client) {
+    if (client->closed || client->want_write || outq_depth(client->outq) == 0) {
+        return;
+    }
+    const SharedFrame *oldest = outq_head(client->outq);
+    client->send_born = oldest->born_ns;
+    client->send_traced = oldest->trace_id;
+    memset(&client->send_msg, 0, sizeof(client->send_msg));
+    client->send_msg.msg_iov = client->send_iov;
+    client->send_msg.msg_iovlen = outq_peek_iov(client->outq, client->send_iov, URING_SEND_IOV);
+    if (uring_prep_sendmsg(client->shard->ring, client->fd, &client->send_msg,
+                           (uint64_t)(uintptr_t)client | URING_SEND) < 0) {
+        outq_complete(client->outq, 0);
+        metrics_count(MET_SEND_ERRORS, 1);
+        shutdown(client->fd, SHUT_RDWR);
+        return;
+    }
+    client->want_write = 1;
+    client->uring_ops++;
+}
+
+/* Queue a send for every client put on the flush list since the last loop */
+static void uring_flush_listed(Shard *shard) {
+    pthread_mutex_lock(&shard->flush_mutex);
+    Client *cur = shard->flush_list;
+    shard->flush_list = NULL;
+    pthread_mutex_unlock(&shard->flush_mutex);
+    while (cur) {
+        Client *next = cur->flush_next;
+        pthread_mutex_lock(&cur->out_mutex);
+        cur->flush_pending = 0;
+        uring_send(cur);
+        pthread_mutex_unlock(&cur->out_mutex);
+        cur = next;
+    }
+}
+
+static void uring_send_done(Client *client, int32_t res) {
+    pthread_mutex_lock(&client->out_mutex);
+    client->uring_ops--;
+    client->want_write = 0;
+    outq_complete(client->outq, res > 0 ? (size_t)res : 0);
+    metrics_count(MET_FLUSHES, 1);
+    if (res < 0) {
+        if (!client->closed) {
+            metrics_count(MET_SEND_ERRORS, 1);
+            shutdown(client->fd, SHUT_RDWR);
+        }
+    } else {
+        metrics_observe_since(MET_LAT_WRITE, client->send_born);
+        trace_event(client->send_traced, TRACE_WRITTEN, (uint32_t)(client->shard - shards));
+        if (outq_depth(client->outq) > 0) {
+            metrics_count(MET_SEND_BLOCKED, 1);
+        } else {
+            queue_lag_notice(client);
+        }
+        uring_send(client);
+    }
+    pthread_mutex_unlock(&client->out_mutex);
+}
+
+static void uring_recv_done(Shard *shard, Client *client, const UringCompletion *cqe) {
+    /* 0 is the peer hanging up; a cancelled recv is a pause */
+    int drop = cqe->res <= 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED;
+    if (cqe->res > 0 && !client->closed) {
+        const char *data = uring_buffer(shard->ring, cqe);
+        size_t left = (size_t)cqe->res;
+        int frames = 0;
+        while (!drop && left > 0) {
+            if (reserve_input(client) < 0) {
+                drop = 1;
+                break;
+            }
+            size_t n = client->incap - client->inlen < left ? client->incap - client->inlen : left;
+            memcpy(client->inbuf + client->inlen, data, n);
+            client->inlen += n;
+            data += n;
+            left -= n;
+            drop = handle_input(client, &frames) < 0;
+        }
+    }
+    uring_recycle(shard->ring, cqe);
+    int more = uring_more(cqe);
+    if (!more) {
+        client->uring_ops--;
+    }
+    if (client->closed) {
+        return;
+    }
+    if (drop) {
+        drop_connection(client);
+        return;
+    }
+    /* Out of provided buffers, or the kernel ended the multishot: arm it again, once resumed.
+     * A client left with no recv would never be read again, so failing to arm drops it. */
+    if (more) {
+        return;
+    }
+    if (client->paused) {
+        client->recv_parked = 1;
+    } else if (uring_prep_recv(shard->ring, client->fd, (uint64_t)(uintptr_t)client | URING_RECV) == 0) {
+        client->uring_ops++;
+    } else {
+        drop_connection(client);
+    }
+}
+
+static void uring_accept_done(Shard *shard, const UringCompletion *cqe) {
+    if (!uring_more(cqe) && running && uring_prep_accept(shard->ring, shard->listen_fd, URING_ACCEPT) < 0) {
+        perror("io_uring accept");
+    }
+    if (cqe->res < 0) {
+        if (running) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+    metrics_count(MET_ACCEPTED, 1);
+    Client *client = client_new(cqe->res, shard);
+    if (!client) {
+        close(cqe->res);
+        return;
+    }
+    if (uring_prep_recv(shard->ring, client->fd, (uint64_t)(uintptr_t)client | URING_RECV) < 0) {
+        close(client->fd);
+        client_free(client);
+        return;
+    }
+    client->uring_ops++;
+    start_handshake(client);
+}
+
+/* Free dropped clients the kernel holds no requests for and no thread has listed for a send */
+static void uring_free_zombies(Shard *shard, int all) {
+    Client **cursor = &shard->zombies;
+    while (*cursor) {
+        Client *client = *cursor;
+        pthread_mutex_lock(&client->out_mutex);
+        int busy = client->uring_ops > 0 || client->flush_pending;
+        pthread_mutex_unlock(&client->out_mutex);
+        if (busy && !all) {
+            cursor = &client->next;
+            continue;
+        }
+        *cursor = client->next;
+        close(client->fd);
+        epoch_retire(client, free_client_later);
+    }
+}
+
+/*
+ * The io_uring reactor. A multishot accept and a multishot recv per client stay
+ * armed, and recv lands in buffers the ring provides, so reading costs no
+ * syscalls of its own. Sends from the dispatcher's fan-out are collected on the
+ * flush list and go to the kernel together: one io_uring_enter per loop submits
+ * every pending request and waits for the next completion.
+ */
+static void *uring_reactor_thread(void *arg) {
+    Shard *shard = arg;
+    UringCompletion cqes[REACTOR_MAX_EVENTS];
+    reactor_shard = shard;
+    if (uring_prep_accept(shard->ring, shard->listen_fd, URING_ACCEPT) < 0 ||
+        uring_prep_read(shard->ring, shard->wake_fd, &shard->wake_buf, sizeof(shard->wake_buf), URING_WAKE) < 0) {
+        perror("io_uring");
+        return NULL;
+    }
+    while (running) {
+        uring_flush_listed(shard);
+        int submitted = uring_submit_and_wait(shard->ring, 1);
+        if (submitted < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        metrics_count(MET_URING_ENTERS, 1);
+        metrics_count(MET_URING_SQES, (uint64_t)submitted);
+
+        size_t n;
+        while (running && (n = uring_reap(shard->ring, cqes, REACTOR_MAX_EVENTS)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                Client *client = (Client *)(uintptr_t)(cqes[i].data & ~(uint64_t)URING_OP_MASK);
+                unsigned op = (unsigned)(cqes[i].data & URING_OP_MASK);
+                if (!client && op == URING_ACCEPT) {
+                    uring_accept_done(shard, &cqes[i]);
+                } else if (!client) {
+                    if (uring_prep_read(shard->ring, shard->wake_fd, &shard->wake_buf, sizeof(shard->wake_buf),
+                                        URING_WAKE) < 0) {
+                        perror("io_uring read");
+                    }
+                    handle_wakeup(shard);
+                    resume_reads(shard);
+                } else if (op == URING_RECV) {
+                    uring_recv_done(shard, client, &cqes[i]);
+                } else if (op == URING_CANCEL) {
+                    client->uring_ops--;
+                } else {
+                    uring_send_done(client, cqes[i].res);
+                }
+            }
+        }
+        uring_free_zombies(shard, 0);
+    }
+    /* Closing the ring cancels whatever is still in flight */
+    uring_destroy(shard->ring);
+    shard->ring = NULL;
+    uring_free_zombies(shard, 1);
+    return NULL;
+}
+
+/* Threads mode: client threads block in recv, so pending output is flushed here. */
+static void *writer_thread(void *arg) {
+    Shard *shard = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (running) {
+        int n = epoll_wait(shard->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &wakeup_tag) {
+                drain_wakeups(shard);
+                continue;
+            }
+            Client *client = tag;
+            pthread_mutex_lock(&client->out_mutex);
+            client->want_write = 0; /* the one-shot registration fired */
+            flush_client(client);
+            pthread_mutex_unlock(&client->out_mutex);
+        }
+        free_retired_clients();
+    }
+    return NULL;
+}
+
+static int setup_shard(Shard *shard) {
+    pthread_mutex_init(&shard->mutex, NULL);
+    pthread_mutex_init(&shard->flush_mutex, NULL);
+    shard->index = ui_create(0);
+    shard->rooms = rooms_create();
+    shard->inbox = mq_create_lanes(queue_backend, queue_capacity, lane_weights);
+    shard->history = history_create(history_depth);
+    if (!shard->index || !shard->rooms || !shard->inbox || (history_depth > 0 && !shard->history)) {
+        fprintf(stderr, "Failed to create shard queues.\n");
+        return -1;
+    }
+    if (io_mode == IO_URING) {
+        /* Blocking descriptors: the ring polls them instead of failing with EAGAIN */
+        shard->wake_fd = eventfd(0, EFD_CLOEXEC);
+        shard->ring = uring_create(URING_ENTRIES);
+        if (shard->wake_fd < 0 || !shard->ring) {
+            perror("io_uring");
+            return -1;
+        }
+        int flags = fcntl(shard->listen_fd, F_GETFL, 0); /* an inherited listener is non-blocking */
+        if (flags < 0 || fcntl(shard->listen_fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+            perror("fcntl listener");
+            return -1;
+        }
+        return 0;
+    }
+    shard->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeup_tag;
+    if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->wake_fd, &ev) < 0) {
+        perror("epoll_ctl eventfd");
+        return -1;
+    }
+    if (io_mode != IO_EPOLL) {
+        return 0; /* the writer thread only watches client sockets */
+    }
+
+    int flags = fcntl(shard->listen_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(shard->listen_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl listener");
+        return -1;
+    }
+
+    /* Exclusive so a connection on a shared listener wakes one reactor, not all */
+    ev.events = EPOLLIN | (listener_shared ? EPOLLEXCLUSIVE : 0);
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(shard->epfd, EPOLL_CTL_ADD, shard->listen_fd, &ev) < 0) {
+        perror("epoll_ctl listener");
+        return -1;
+    }
+    return 0;
+}
+
+static void destroy_shard(Shard *shard) {
+    if (shard->epfd >= 0) {
+        close(shard->epfd);
+    }
+    if (shard->wake_fd >= 0) {
+        close(shard->wake_fd);
+    }
+    uring_destroy(shard->ring);
+    mq_destroy(shard->inbox);
+    rooms_destroy(shard->rooms);
+    history_destroy(shard->history);
+    ui_destroy(shard->index);
+    pthread_mutex_destroy(&shard->mutex);
+    pthread_mutex_destroy(&shard->flush_mutex);
+}
+
+/* Idle connections are cheap in reactor mode; let the process use as many fds as allowed. */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            perror("setrlimit");
+        }
+    }
+}
+
+static int setup_unix_socket(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, listen_backlog) < 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* With reuse_port every shard binds its own socket and the kernel spreads connections. */
+static int setup_tcp_socket(const char *port, int reuse_port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int gai = getaddrinfo(NULL, port, &hints, &res);
+    if (gai != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            if (listen(fd, listen_backlog) == 0) {
+                break;
+            }
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        perror("bind/listen");
+    }
+    return fd;
+}
+
+static size_t gauge_clients(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&clients_mutex);
+    size_t count = ui_count(client_index);
+    pthread_mutex_unlock(&clients_mutex);
+    return count;
+}
+
+static size_t gauge_queue_depth(void *arg) {
+    return mq_depth(arg);
+}
+
+static size_t gauge_pool_outstanding(void *arg) {
+    PoolStats stats;
+    pool_stats(arg, &stats);
+    return stats.outstanding;
+}
+
+static size_t gauge_pool_high_water(void *arg) {
+    PoolStats stats;
+    pool_stats(arg, &stats);
+    return stats.high_water;
+}
+
+/* Workers that actually started; 0 before the pool exists or with --fanout-workers 0 */
+static size_t gauge_fanout_workers(void *arg) {
+    (void)arg;
+    return fanout_pool ? (size_t)fanout_workers(fanout_pool) : 0;
+}
+
+static void register_gauges(void) {
+    char name[32];
+    metrics_add_gauge("clients", gauge_clients, NULL);
+    metrics_add_gauge("log_queue_depth", gauge_queue_depth, log_queue);
+    metrics_add_gauge("fanout_workers", gauge_fanout_workers, NULL);
+    for (int i = 0; i < shard_count; i++) {
+        snprintf(name, sizeof(name), "inbox_depth.%d", i);
+        metrics_add_gauge(name, gauge_queue_depth, shards[i].inbox);
+    }
+    ObjectPool *pools[] = {client_pool, mq_node_pool(), frame_pool()};
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        if (!pools[i]) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "pool_outstanding.%s", pool_name(pools[i]));
+        metrics_add_gauge(name, gauge_pool_outstanding, pools[i]);
+        snprintf(name, sizeof(name), "pool_high_water.%s", pool_name(pools[i]));
+        metrics_add_gauge(name, gauge_pool_high_water, pools[i]);
+    }
+}
+
+/*
+ * Offer our state to the new server on sock while still serving. Only once it
+ * has accepted the hello do we stop, keeping every socket open for main to
+ * hand over. Returns -1, with nothing stopped, if it does not.
+ */
+static int begin_takeover(int sock) {
+    char hello[sizeof(HANDOFF_MAGIC) + sizeof(uint32_t)];
+    uint32_t version = HANDOFF_VERSION;
+    memcpy(hello, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC));
+    memcpy(hello + sizeof(HANDOFF_MAGIC), &version, sizeof(version));
+    if (handoff_send(sock, HANDOFF_HELLO, hello, sizeof(hello), -1) < 0 ||
+        handoff_wait_ack(sock, HANDOFF_ACK_TIMEOUT_MS) < 0) {
+        fprintf(stderr, "Takeover request not confirmed; still serving.\n");
+        return -1;
+    }
+    takeover_fd = sock;
+    atomic_store(&handing_over, 1);
+    running = 0;
+    for (int i = 0; i < shard_count; i++) {
+        wake_io_thread(&shards[i]);
+    }
+    return 0;
+}
+
+/* One report per connection: an optional "json", "text", "trace" or "takeover" request line, then the reply. */
+static void *admin_thread(void *arg) {
+    (void)arg;
+    while (running) {
+        int fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        char request[ADMIN_REQUEST_MAX] = "";
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, ADMIN_REQUEST_TIMEOUT_MS) > 0) {
+            ssize_t n = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+            request[n > 0 ? n : 0] = '\0';
+        }
+        if (strncmp(request, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST)) == 0) {
+            if (io_mode == IO_EPOLL) {
+                if (begin_takeover(fd) == 0) {
+                    break;
+                }
+                close(fd);
+                continue;
+            }
+            static const char reason[] = "takeover needs a server running --io epoll";
+            handoff_send(fd, HANDOFF_END, reason, sizeof(reason) - 1, -1);
+            close(fd);
+            continue;
+        }
+        if (strncmp(request, "trace", 5) == 0) {
+            const char *reply = trace_dump(trace_path) == 0 ? "ok\n" : "trace failed\n";
+            send_all(fd, reply, strlen(reply));
+            close(fd);
+            continue;
+        }
+        char *report = metrics_render(strncmp(request, "json", 4) == 0);
+        if (report) {
+            send_all(fd, report, strlen(report));
+            free(report);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Fires due idle timers and sleeps until the wheel's next deadline; the
+ * work per wakeup is proportional to the clients actually timing out. */
+static void *watchdog_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&clients_mutex);
+    while (running) {
+        /* Memory retired after the last membership change has no later retire to free it */
+        pthread_mutex_unlock(&clients_mutex);
+        epoch_reclaim();
+        pthread_mutex_lock(&clients_mutex);
+        uint64_t now = monotonic_ms();
+        tw_advance(timers, now);
+        long wait_ms = tw_next_timeout(timers, now);
+        if (wait_ms < 0 || wait_ms > EPOCH_RECLAIM_MS) {
+            wait_ms = EPOCH_RECLAIM_MS;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += wait_ms / 1000;
+        deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&watchdog_cond, &clients_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return NULL;
+}
+
+/* Threads mode: shut down connections still waiting for a hello and wait until their threads let go. */
+static void finish_handshakes(void) {
+    pthread_mutex_lock(&clients_mutex);
+    for (Client *cur = handshaking; cur; cur = cur->hs_next) {
+        shutdown(cur->fd, SHUT_RDWR);
+    }
+    while (handshaking) {
+        pthread_cond_wait(&handshake_cond, &clients_mutex);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+/* Each client thread unlists itself on the way out, so the first is always the next one to stop. */
+static void join_client_threads(void) {
+    Shard *shard = &shards[0];
+    for (;;) {
+        pthread_mutex_lock(&shard->mutex);
+        const ClientSet *set = atomic_load(&shard->clients);
+        if (!set || set->count == 0) {
+            pthread_mutex_unlock(&shard->mutex);
+            break;
+        }
+        Client *cur = set->clients[0];
+        pthread_t tid = cur->thread;
+        shutdown(cur->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_join(tid, NULL);
+    }
+}
+
+/* Old server, every other thread stopped: one record per connection, with its socket. */
+static int hand_over_client(int sock, Client *client, int shard_no) {
+    HandoffClient hc;
+    memset(&hc, 0, sizeof(hc));
+    snprintf(hc.username, sizeof(hc.username), "%s", client->joined ? client->username : "");
+    memcpy(hc.rooms, client->rooms, sizeof(hc.rooms));
+    hc.proto = client->proto;
+    hc.shard = shard_no;
+    hc.room_count = client->room_count;
+    hc.lagging = client->lagging;
+    hc.dropped = client->dropped;
+    hc.lag_dropped = client->lag_dropped;
+    hc.inlen = (uint32_t)client->inlen;
+    hc.frames = (uint32_t)outq_depth(client->outq);
+    hc.head_off = (uint32_t)outq_head_offset(client->outq);
+
+    size_t len = sizeof(hc) + client->inlen;
+    for (uint32_t i = 0; i < hc.frames; i++) {
+        len += sizeof(uint32_t) + outq_at(client->outq, i)->len;
+    }
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        return -1;
+    }
+    unsigned char *p = buf;
+    memcpy(p, &hc, sizeof(hc));
+    p += sizeof(hc);
+    memcpy(p, client->inbuf, client->inlen);
+    p += client->inlen;
+    for (uint32_t i = 0; i < hc.frames; i++) {
+        const SharedFrame *frame = outq_at(client->outq, i);
+        uint32_t frame_len = (uint32_t)frame->len;
+        memcpy(p, &frame_len, sizeof(frame_len));
+        memcpy(p + sizeof(frame_len), frame->data, frame->len);
+        p += sizeof(frame_len) + frame->len;
+    }
+    int rc = handoff_send(sock, HANDOFF_CLIENT, buf, len, client->fd);
+    free(buf);
+    return rc;
+}
+
+/* Old server, once the new one has everything: our copies of the sockets are
+ * closed without a shutdown, so the connections live on in the new process.
+ * Shared-memory clients cannot move and go with them. */
+static void release_connections(void) {
+    for (int i = 0; i < shard_count; i++) {
+        ClientSet *set = atomic_exchange(&shards[i].clients, NULL);
+        for (size_t c = 0; set && c < set->count; c++) {
+            Client *cur = set->clients[c];
+            for (int r = 0; r < cur->room_count; r++) {
+                rooms_part(shards[i].rooms, cur->rooms[r], cur);
+            }
+            close(cur->fd);
+            client_free(cur);
+        }
+        free(set);
+    }
+    while (handshaking) {
+        Client *client = handshaking;
+        handshaking = client->hs_next;
+        close(client->fd);
+        client_free(client);
+    }
+}
+
+/*
+ * Old server, after its reactors, dispatchers and logger have stopped and the
+ * chat log is closed: pass the listeners and every connection to the new
+ * server and wait for it to confirm. Nothing is let go here, so on -1 every
+ * socket is still ours to serve; on 0 main calls release_connections.
+ */
+static int hand_over(int sock) {
+    size_t moved = 0;
+    int rc = 0;
+    int listeners = listener_shared ? 1 : shard_count;
+    for (int i = 0; rc == 0 && i < listeners; i++) {
+        rc = handoff_send(sock, HANDOFF_LISTENER, NULL, 0, shards[i].listen_fd);
+    }
+    for (int i = 0; rc == 0 && i < shard_count; i++) {
+        const ClientSet *set = atomic_load(&shards[i].clients);
+        for (size_t c = 0; rc == 0 && set && c < set->count; c++) {
+            Client *cur = set->clients[c];
+            if (!cur->shm) {
+                rc = hand_over_client(sock, cur, i);
+                moved++;
+            }
+        }
+    }
+    for (Client *client = handshaking; rc == 0 && client; client = client->hs_next) {
+        if (!client->shm) {
+            rc = hand_over_client(sock, client, (int)(client->shard - shards));
+            moved++;
+        }
+    }
+    if (rc == 0) {
+        rc = handoff_send(sock, HANDOFF_END, NULL, 0, -1);
+    }
+    if (rc == 0) {
+        rc = handoff_wait_ack(sock, HANDOFF_ACK_TIMEOUT_MS);
+    }
+    close(sock);
+    if (rc < 0) {
+        fprintf(stderr, "Handoff to the new server failed; still serving.\n");
+        return -1;
+    }
+    fprintf(stderr, "Handed %zu connections over to the new server.\n", moved);
+    return 0;
+}
+
+/* Old server, after a failed handoff: undo what main stopped for it, except the
+ * reactors, which main starts again itself. */
+static int resume_serving(void) {
+    atomic_store(&handing_over, 0);
+    running = 1;
+    for (int i = 0; i < shard_count; i++) {
+        mq_reopen(shards[i].inbox);
+    }
+    mq_reopen(log_queue);
+    chat_log = binlog_open(log_prefix, LOG_SEGMENT_SIZE);
+    if (!chat_log) {
+        perror(log_prefix);
+        return -1;
+    }
+    if (pthread_create(&logger_thread_id, NULL, logger_thread, NULL) != 0) {
+        perror("pthread_create logger");
+        return -1;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (pthread_create(&shards[i].dispatcher_thread, NULL, dispatcher_thread, &shards[i]) != 0) {
+            perror("pthread_create dispatcher");
+            return -1;
+        }
+    }
+    if (pthread_create(&watchdog_thread_id, NULL, watchdog_thread, NULL) != 0) {
+        perror("pthread_create watchdog");
+        return -1;
+    }
+    /* The admin thread stopped when it took the request */
+    pthread_join(admin_thread_id, NULL);
+    if (pthread_create(&admin_thread_id, NULL, admin_thread, NULL) != 0) {
+        perror("pthread_create admin");
+        return -1;
+    }
+    return 0;
+}
+
+/* New server: ask the old one for its sockets and state; runs before anything is set up. */
+static int take_over(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send_all(sock, HANDOFF_REQUEST "\n", strlen(HANDOFF_REQUEST) + 1) < 0) {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    HandoffRecord rec;
+    int rc = handoff_recv(sock, &rec);
+    if (rc == 0 && (rec.type != HANDOFF_HELLO || rec.len < sizeof(HANDOFF_MAGIC) + sizeof(uint32_t) ||
+                    memcmp(rec.data, HANDOFF_MAGIC, sizeof(HANDOFF_MAGIC)) != 0)) {
+        if (rec.type == HANDOFF_END && rec.len > 0) {
+            fprintf(stderr, "%.*s\n", (int)rec.len, (const char *)rec.data);
+        }
+        rc = -1;
+    } else if (rc == 0) {
+        uint32_t version;
+        memcpy(&version, rec.data + sizeof(HANDOFF_MAGIC), sizeof(version));
+        rc = version == HANDOFF_VERSION ? 0 : -1;
+    }
+    handoff_release(&rec);
+    /* Until this ack the old server has not stopped, so giving up here costs nothing */
+    if (rc == 0) {
+        rc = handoff_send(sock, HANDOFF_ACK, NULL, 0, -1);
+    }
+
+    size_t allocated = 0;
+    while (rc == 0 && (rc = handoff_recv(sock, &rec)) == 0 && rec.type != HANDOFF_END) {
+        if (rec.type == HANDOFF_LISTENER && rec.fd >= 0 && inherited_listener_count < SHARDS_MAX) {
+            inherited_listeners[inherited_listener_count++] = rec.fd;
+            rec.fd = -1;
+        } else if (rec.type == HANDOFF_CLIENT && rec.fd >= 0 && rec.len >= sizeof(HandoffClient)) {
+            if (inherited_client_count == allocated) {
+                size_t grown_size = allocated ? allocated * 2 : 256;
+                HandoffRecord *grown = realloc(inherited_clients, grown_size * sizeof(HandoffRecord));
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                inherited_clients = grown;
+                allocated = grown_size;
+            }
+            inherited_clients[inherited_client_count++] = rec;
+            continue;
+        }
+        handoff_release(&rec);
+    }
+    if (rc == 0) {
+        handoff_release(&rec);
+        /* The old server lets go of the sockets only once it has this */
+        rc = inherited_listener_count > 0 ? handoff_send(sock, HANDOFF_ACK, NULL, 0, -1) : -1;
+    }
+    close(sock);
+    if (rc < 0) {
+        fprintf(stderr, "No usable handoff from %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* New server: rebuild one inherited connection on its shard; consumes the record. */
+static int adopt_client(HandoffRecord *rec) {
+    HandoffClient hc;
+    memcpy(&hc, rec->data, sizeof(hc));
+    const unsigned char *p = rec->data + sizeof(hc);
+    const unsigned char *end = rec->data + rec->len;
+    hc.username[USERNAME_MAX - 1] = '\0';
+    if (hc.proto < PROTO_LEGACY || hc.proto > PROTO_MAX_VERSION || hc.room_count < 0 ||
+        hc.room_count > CLIENT_ROOMS_MAX || hc.inlen > (size_t)(end - p)) {
+        return -1;
+    }
+
+    Shard *shard = &shards[(hc.shard >= 0 ? hc.shard : 0) % shard_count];
+    Client *client = client_new(rec->fd, shard);
+    if (!client) {
+        return -1;
+    }
+    client->proto = hc.proto;
+    snprintf(client->username, USERNAME_MAX, "%s", hc.username);
+    client->lagging = hc.lagging;
+    client->dropped = (unsigned long)hc.dropped;
+    client->lag_dropped = (unsigned long)hc.lag_dropped;
+    if (hc.inlen > client->incap) {
+        /* More than a frame only if the client was paused */
+        char *grown = hc.inlen <= RATE_PAUSE_INPUT_MAX ? realloc(client->inbuf, hc.inlen) : NULL;
+        if (!grown) {
+            client_free(client);
+            return -1;
+        }
+        client->inbuf = grown;
+        client->incap = hc.inlen;
+    }
+    memcpy(client->inbuf, p, hc.inlen);
+    client->inlen = hc.inlen;
+    p += hc.inlen;
+    for (uint32_t i = 0; i < hc.frames; i++) {
+        uint32_t frame_len;
+        if ((size_t)(end - p) < sizeof(frame_len)) {
+            break;
+        }
+        memcpy(&frame_len, p, sizeof(frame_len));
+        p += sizeof(frame_len);
+        if (frame_len > (size_t)(end - p)) {
+            break;
+        }
+        SharedFrame *frame = frame_create(p, frame_len);
+        int queued = frame && outq_push(client->outq, frame) == 0;
+        frame_unref(frame);
+        if (i == 0 && queued && hc.head_off < frame_len) {
+            outq_complete(client->outq, hc.head_off); /* the part the client already has */
+        }
+        p += frame_len;
+    }
+
+    /* Dispatchers and reactors have not started yet, so nothing else sees the client */
+    int joined = hc.username[0] != '\0';
+    if (joined) {
+        if (add_client(client, UINT64_MAX) < 0) {
+            client_free(client);
+            return -1;
+        }
+        pthread_mutex_lock(&shard->mutex);
+        for (int i = 0; i < hc.room_count; i++) {
+            hc.rooms[i][ROOM_MAX - 1] = '\0';
+            if (room_name_valid(hc.rooms[i]) && rooms_join(shard->rooms, hc.rooms[i], client) == 0) {
+                snprintf(client->rooms[client->room_count++], ROOM_MAX, "%s", hc.rooms[i]);
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    rec->fd = -1; /* the client owns it now */
+
+    int flags = fcntl(client->fd, F_GETFL, 0);
+    int registered = flags >= 0 &&
+                     fcntl(client->fd, F_SETFL, io_mode == IO_URING ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) == 0;
+    if (registered && io_mode == IO_URING) {
+        registered = uring_prep_recv(shard->ring, client->fd, (uint64_t)(uintptr_t)client | URING_RECV) == 0;
+        client->uring_ops += registered;
+    } else if (registered) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client;
+        registered = epoll_ctl(shard->epfd, EPOLL_CTL_ADD, client->fd, &ev) == 0;
+    }
+    if (!registered) {
+        if (joined) {
+            drop_connection(client);
+        } else {
+            close(client->fd);
+            client_free(client);
+        }
+        return -1;
+    }
+
+    if (!joined) {
+        start_handshake(client);
+        return 0;
+    }
+    pthread_mutex_lock(&client->out_mutex);
+    flush_client(client);
+    pthread_mutex_unlock(&client->out_mutex);
+    return 0;
+}
+
+static void adopt_clients(void) {
+    size_t adopted = 0;
+    for (size_t i = 0; i < inherited_client_count; i++) {
+        if (adopt_client(&inherited_clients[i]) == 0) {
+            adopted++;
+        }
+        handoff_release(&inherited_clients[i]);
+    }
+    free(inherited_clients);
+    inherited_clients = NULL;
+    inherited_client_count = 0;
+    fprintf(stderr, "Took over %zu connections from %s.\n", adopted, takeover_path);
+}
+
+/* Startup, before any thread runs: refill the rings from the tail of the chat log,
+ * so scrollback survives a restart. */
+static void seed_history(void) {
+    history_index = binlog_index_open(log_prefix);
+    if (!history_index || binlog_index_refresh(history_index) < 0) {
+        return;
+    }
+    size_t count = binlog_index_count(history_index);
+    for (size_t i = count > HISTORY_SEED_RECORDS ? count - HISTORY_SEED_RECORDS : 0; i < count; i++) {
+        uint64_t seq;
+        ChatMessage msg;
+        if (binlog_index_get(history_index, i, &seq, &msg) < 0 || msg.target[0] != '\0' ||
+            is_system_message(&msg)) {
+            continue;
+        }
+        for (int s = 0; s < shard_count; s++) {
+            history_add(shards[s].history, &msg);
+        }
+    }
+}
+
+static void close_all_clients(void) {
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        ClientSet *set = atomic_exchange(&shards[i].clients, NULL);
+        pthread_mutex_unlock(&shards[i].mutex);
+        for (size_t c = 0; set && c < set->count; c++) {
+            Client *cur = set->clients[c];
+            for (int r = 0; r < cur->room_count; r++) {
+                rooms_part(shards[i].rooms, cur->rooms[r], cur);
+            }
+            close(cur->fd);
+            client_free(cur);
+        }
+        free(set);
+    }
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--unix PATH | --tcp PORT] [--timeout SECONDS|MSms] [--io epoll|uring|threads]\n"
+            "       [--outq FRAMES] [--outq-policy disconnect|drop-oldest|lag]\n"
+            "       [--queue list|ring] [--queue-size MESSAGES] [--lane-weights S,P,B] [--shards N]\n"
+            "       [--log PREFIX] [--log-sync none|Nms|N] [--admin PATH]\n"
+            "       [--trace EVENTS] [--trace-file PATH] [--backlog N] [--takeover ADMIN_PATH]\n"
+            "       [--history MESSAGES] [--fanout-workers N] [--fanout-threshold CLIENTS]\n"
+            "       [--rate-limit MSGS_PER_SEC] [--rate-burst MSGS]\n", prog);
+    fprintf(stderr, "Defaults: --unix %s, --tcp %s (if tcp selected), timeout %ld, outq %d disconnect, "
+            "queue list (ring size %d)\n",
+            SOCKET_PATH, DEFAULT_TCP_PORT, (long)(inactivity_timeout_ms / 1000), OUTQ_DEFAULT_CAPACITY,
+            MQ_RING_DEFAULT_CAPACITY);
+    fprintf(stderr, "Inboxes: system, private and bulk lanes drained %u:%u:%u per round (--lane-weights); "
+            "--queue-size is per lane\n", lane_weights[0], lane_weights[1], lane_weights[2]);
+    fprintf(stderr, "Metrics: /stats in chat, or connect to the --admin socket and send \"json\" or \"text\"\n");
+    fprintf(stderr, "Scrollback: the last %d lobby and room messages are replayed on join (--history 0 "
+            "turns it off); /history N pages back through the chat log\n", HISTORY_DEFAULT);
+    fprintf(stderr, "Fan-out: broadcasts to %d or more clients of a shard are delivered by %d workers "
+            "(--fanout-workers 0 keeps them on the dispatcher)\n", FANOUT_THRESHOLD_DEFAULT, FANOUT_WORKERS_DEFAULT);
+    fprintf(stderr, "Rate limit: %d messages per second per client with bursts of %d (--rate-limit 0 turns "
+            "it off); a flooding client is warned, paused for %d ms, then disconnected\n",
+            RATE_LIMIT_DEFAULT, RATE_BURST_DEFAULT, RATE_PAUSE_MS);
+    fprintf(stderr, "Hot restart: --takeover ADMIN_PATH inherits the listeners and connections of the "
+            "epoll server with that --admin socket\n");
+    fprintf(stderr, "Flight recorder: --trace keeps the last EVENTS stage events per thread; "
+            "SIGUSR1 or \"trace\" on the admin socket writes them to %s, read it with ./chattrace\n",
+            TRACE_FILE);
+    fprintf(stderr, "Chat log: binary segments %s.NNNNNN, read them with ./chatlog; "
+            "--log-sync 100ms or 500 fdatasyncs every 100 ms or 500 messages (default none)\n",
+            LOG_PREFIX);
+}
+
+/* "none", "<N>ms" or "<N>" (messages) */
+static int parse_log_sync(const char *spec) {
+    if (strcmp(spec, "none") == 0) {
+        log_sync_policy = LOG_SYNC_NONE;
+        return 0;
+    }
+    char *end = NULL;
+    long v = strtol(spec, &end, 10);
+    if (end == spec || v <= 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        log_sync_policy = LOG_SYNC_INTERVAL;
+    } else if (*end == '\0') {
+        log_sync_policy = LOG_SYNC_COUNT;
+    } else {
+        return -1;
+    }
+    log_sync_every = v;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
             server_mode = MODE_UNIX;
             snprintf(server_unix_path, sizeof(server_unix_path), "%s", argv[++i]);
         } else if (strcmp(argv[i], "--tcp") == 0 && i + 1 < argc) {
             server_mode = MODE_TCP;
             snprintf(server_tcp_port, sizeof(server_tcp_port), "%s", argv[++i]);
         } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            long v = strtol(argv[++i], &end, 10);
+            if (v > 0) {
+                inactivity_timeout_ms = strcmp(end, "ms") == 0 ? (uint64_t)v : (uint64_t)v * 1000;
+            }
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "epoll") == 0) {
+                io_mode = IO_EPOLL;
+            } else if (strcmp(mode, "uring") == 0) {
+                io_mode = IO_URING;
+            } else if (strcmp(mode, "threads") == 0) {
+                io_mode = IO_THREADS;
+            } else {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--outq") == 0 && i + 1 < argc) {
             long v = strtol(argv[++i], NULL, 10);
             if (v > 0) {
-                inactivity_timeout_sec = (time_t)v;
+                outq_capacity = (size_t)v;
+            }
+        } else if (strcmp(argv[i], "--outq-policy") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "disconnect") == 0) {
+                outq_policy = OUTQ_DISCONNECT;
+            } else if (strcmp(policy, "drop-oldest") == 0) {
+                outq_policy = OUTQ_DROP_OLDEST;
+            } else if (strcmp(policy, "lag") == 0) {
+                outq_policy = OUTQ_LAG;
+            } else {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            if (strcmp(backend, "list") == 0) {
+                queue_backend = MQ_BACKEND_LIST;
+            } else if (strcmp(backend, "ring") == 0) {
+                queue_backend = MQ_BACKEND_RING;
+            } else {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--lane-weights") == 0 && i + 1 < argc) {
+            unsigned w[MQ_LANE_COUNT];
+            if (sscanf(argv[++i], "%u,%u,%u", &w[0], &w[1], &w[2]) != MQ_LANE_COUNT || !w[0] || !w[1] || !w[2]) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            memcpy(lane_weights, w, sizeof(lane_weights));
+        } else if (strcmp(argv[i], "--queue-size") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v > 0) {
+                queue_capacity = (size_t)v;
+            }
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 1 || v > SHARDS_MAX) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            shard_count = (int)v;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v > 0 && v <= INT32_MAX) {
+                listen_backlog = (int)v;
+            }
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            snprintf(log_prefix, sizeof(log_prefix), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 0 || v > HISTORY_SEED_RECORDS) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            history_depth = (size_t)v;
+        } else if (strcmp(argv[i], "--fanout-workers") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 0 || v > FANOUT_WORKERS_MAX) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            fanout_worker_count = (int)v;
+        } else if (strcmp(argv[i], "--fanout-threshold") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 1) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            fanout_threshold = (size_t)v;
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 0 || v > RATE_MAX) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            rate_limit = (unsigned long)v;
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v < 1 || v > RATE_MAX) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            rate_burst = (unsigned long)v;
+        } else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc) {
+            snprintf(takeover_path, sizeof(takeover_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--admin") == 0 && i + 1 < argc) {
+            snprintf(admin_path, sizeof(admin_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            long v = strtol(argv[++i], NULL, 10);
+            if (v <= 0 || trace_init((size_t)v) < 0) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            snprintf(trace_path, sizeof(trace_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--log-sync") == 0 && i + 1 < argc) {
+            if (parse_log_sync(argv[++i]) < 0) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
             }
         } else {
             print_usage(argv[0]);
@@ -407,37 +3243,140 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (io_mode == IO_URING && uring_probe() < 0) {
+        fprintf(stderr, "io_uring unavailable (%s); using epoll.\n", strerror(errno));
+        io_mode = IO_EPOLL;
+    }
+    if (shard_count > 1 && io_mode == IO_THREADS) {
+        fprintf(stderr, "--shards needs --io epoll or uring.\n");
+        return EXIT_FAILURE;
+    }
+    client_pool = pool_create("client", sizeof(Client));
+    if (!client_pool) {
+        fprintf(stderr, "Failed to create client pool.\n");
+        return EXIT_FAILURE;
+    }
+    if (takeover_path[0] != '\0') {
+        if (io_mode == IO_THREADS) {
+            fprintf(stderr, "--takeover needs --io epoll or uring.\n");
+            return EXIT_FAILURE;
+        }
+        if (take_over(takeover_path) < 0) {
+            return EXIT_FAILURE;
+        }
+        /* One inherited listener per shard, or one that every shard polls */
+        if (inherited_listener_count > 1) {
+            shard_count = inherited_listener_count;
+        }
+    }
+    shards = calloc((size_t)shard_count, sizeof(Shard));
+    if (!shards) {
+        perror("shards");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].listen_fd = shards[i].epfd = shards[i].wake_fd = -1;
+    }
+
     struct sigaction sa;
     sa.sa_handler = handle_sigint;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
+    if (trace_enabled()) {
+        sa.sa_handler = handle_sigusr1;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
 
-    dispatch_queue = mq_create();
-    log_queue = mq_create();
-    if (!dispatch_queue || !log_queue) {
+    log_queue = mq_create_backend(queue_backend, queue_capacity);
+    if (!log_queue) {
         fprintf(stderr, "Failed to create message queues.\n");
         return EXIT_FAILURE;
     }
-
-    if (server_mode == MODE_TCP) {
-        server_fd = setup_tcp_socket(server_tcp_port);
-    } else {
-        server_fd = setup_unix_socket(server_unix_path);
+    client_index = ui_create(0);
+    if (!client_index) {
+        fprintf(stderr, "Failed to create client index.\n");
+        return EXIT_FAILURE;
     }
-    if (server_fd < 0) {
-        fprintf(stderr, "Failed to start server.\n");
+    timers = tw_create(monotonic_ms());
+    if (!timers) {
+        fprintf(stderr, "Failed to create timer wheel.\n");
         return EXIT_FAILURE;
     }
+    timer_init(&join_digest_timer, join_digest_expired);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&watchdog_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    /* TCP shards each get an SO_REUSEPORT listener; a UNIX socket is polled by all of them */
+    for (int i = 0; i < shard_count; i++) {
+        if (inherited_listener_count > 0) {
+            shards[i].listen_fd = inherited_listeners[inherited_listener_count > 1 ? i : 0];
+        } else if (server_mode == MODE_TCP) {
+            shards[i].listen_fd = setup_tcp_socket(server_tcp_port, shard_count > 1);
+        } else {
+            shards[i].listen_fd = i == 0 ? setup_unix_socket(server_unix_path) : shards[0].listen_fd;
+        }
+        if (shards[i].listen_fd < 0) {
+            fprintf(stderr, "Failed to start server.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    server_fd = shards[0].listen_fd;
+    listener_shared = shard_count > 1 && (inherited_listener_count > 0 ? inherited_listener_count == 1
+                                                                        : server_mode == MODE_UNIX);
+    if (io_mode != IO_THREADS) {
+        raise_fd_limit();
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (setup_shard(&shards[i]) < 0) {
+            fprintf(stderr, "Failed to start reactor.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    register_gauges();
+    if (admin_path[0] != '\0') {
+        admin_fd = setup_unix_socket(admin_path);
+        if (admin_fd < 0 || pthread_create(&admin_thread_id, NULL, admin_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to start admin socket.\n");
+            return EXIT_FAILURE;
+        }
+    }
 
+    chat_log = binlog_open(log_prefix, LOG_SEGMENT_SIZE);
+    if (!chat_log) {
+        perror(log_prefix);
+        return EXIT_FAILURE;
+    }
+    if (history_depth > 0) {
+        seed_history();
+    }
     if (pthread_create(&logger_thread_id, NULL, logger_thread, NULL) != 0) {
         perror("pthread_create logger");
         return EXIT_FAILURE;
     }
+    if (inherited_client_count > 0) {
+        adopt_clients();
+    }
 
-    if (pthread_create(&dispatcher_thread_id, NULL, dispatcher_thread, NULL) != 0) {
-        perror("pthread_create dispatcher");
-        return EXIT_FAILURE;
+    if (fanout_worker_count > 0) {
+        fanout_pool = fanout_create(fanout_worker_count);
+        if (!fanout_pool) {
+            fprintf(stderr, "Failed to start fan-out workers.\n");
+            return EXIT_FAILURE;
+        }
+        if (fanout_workers(fanout_pool) < fanout_worker_count) {
+            fprintf(stderr, "Started %d of %d fan-out workers.\n", fanout_workers(fanout_pool), fanout_worker_count);
+        }
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (pthread_create(&shards[i].dispatcher_thread, NULL, dispatcher_thread, &shards[i]) != 0) {
+            perror("pthread_create dispatcher");
+            return EXIT_FAILURE;
+        }
     }
 
     if (pthread_create(&watchdog_thread_id, NULL, watchdog_thread, NULL) != 0) {
@@ -445,31 +3384,99 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    if (pthread_create(&accept_thread_id, NULL, accept_thread, NULL) != 0) {
-        perror("pthread_create accept");
-        return EXIT_FAILURE;
-    }
+    /* Goes round again only when a handoff fails and the old server serves on */
+    for (;;) {
+        if (io_mode != IO_THREADS) {
+            for (int i = 0; i < shard_count; i++) {
+                if (pthread_create(&shards[i].reactor_thread, NULL,
+                                   io_mode == IO_URING ? uring_reactor_thread : reactor_thread, &shards[i]) != 0) {
+                    perror("pthread_create reactor");
+                    return EXIT_FAILURE;
+                }
+            }
+            for (int i = 0; i < shard_count; i++) {
+                pthread_join(shards[i].reactor_thread, NULL);
+            }
+        } else {
+            if (pthread_create(&writer_thread_id, NULL, writer_thread, &shards[0]) != 0) {
+                perror("pthread_create writer");
+                return EXIT_FAILURE;
+            }
+            if (pthread_create(&accept_thread_id, NULL, accept_thread, NULL) != 0) {
+                perror("pthread_create accept");
+                return EXIT_FAILURE;
+            }
+            pthread_join(accept_thread_id, NULL);
+        }
+        for (int i = 0; i < shard_count; i++) {
+            mq_close(shards[i].inbox);
+        }
+        if (log_queue) {
+            mq_close(log_queue);
+        }
 
-    pthread_join(accept_thread_id, NULL);
-    if (dispatch_queue) {
-        mq_close(dispatch_queue);
+        pthread_mutex_lock(&clients_mutex);
+        pthread_cond_signal(&watchdog_cond);
+        pthread_mutex_unlock(&clients_mutex);
+        pthread_join(watchdog_thread_id, NULL);
+        for (int i = 0; i < shard_count; i++) {
+            pthread_join(shards[i].dispatcher_thread, NULL);
+        }
+        pthread_join(logger_thread_id, NULL);
+        if (takeover_fd < 0) {
+            break;
+        }
+        binlog_close(chat_log); /* the new server appends to the same segments */
+        chat_log = NULL;
+        if (hand_over(takeover_fd) == 0) {
+            break;
+        }
+        takeover_fd = -1;
+        if (interrupted) {
+            break;
+        }
+        if (resume_serving() < 0) {
+            return EXIT_FAILURE;
+        }
     }
-    if (log_queue) {
-        mq_close(log_queue);
+    fanout_destroy(fanout_pool);
+    if (admin_fd >= 0) {
+        shutdown(admin_fd, SHUT_RDWR);
+        pthread_join(admin_thread_id, NULL);
+        close(admin_fd);
+        unlink(admin_path);
     }
+    if (takeover_fd >= 0) {
+        release_connections();
+    } else if (io_mode != IO_THREADS) {
+        close_all_clients();
+    } else {
+        finish_handshakes();
+        join_client_threads();
+        pthread_join(writer_thread_id, NULL);
+        free_retired_clients();
+    }
+    epoch_shutdown();
+    for (int i = 0; i < shard_count; i++) {
+        if (i > 0 && !listener_shared) {
+            close(shards[i].listen_fd);
+        }
+        destroy_shard(&shards[i]);
+    }
+    free(shards);
 
-    pthread_join(watchdog_thread_id, NULL);
-    pthread_join(dispatcher_thread_id, NULL);
-    pthread_join(logger_thread_id, NULL);
-    join_client_threads();
-
-    mq_destroy(dispatch_queue);
     mq_destroy(log_queue);
+    binlog_close(chat_log);
+    binlog_index_close(history_index);
+    ui_destroy(client_index);
+    tw_destroy(timers);
+    metrics_shutdown();
+    trace_shutdown();
     if (server_fd >= 0) {
         close(server_fd);
     }
-    if (server_mode == MODE_UNIX) {
-        unlink(server_unix_path);
+    if (server_mode == MODE_UNIX && takeover_fd < 0) {
+        unlink(server_unix_path); /* after a handoff the path belongs to the new server */
     }
     return EXIT_SUCCESS;
 }
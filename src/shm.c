@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+#define SHM_CACHE_LINE 64
+#define SHM_RING_MIN 4096
+#define SHM_RING_MAX (16 * 1024 * 1024)
+#define SHM_FD_COUNT 3 /* memfd, client doorbell, server doorbell */
+
+enum { SHM_TO_SERVER = 0, SHM_TO_CLIENT = 1 };
+
+/* Ring positions count bytes ever written and read; each line has one writer */
+typedef struct ShmRing {
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t head; /* published by the writer */
+    _Atomic uint32_t writer_waiting;                 /* writer sleeps until the reader frees space */
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t tail; /* published by the reader */
+    _Atomic uint32_t reader_waiting;                 /* reader sleeps until the writer adds data */
+} ShmRing;
+
+/* Start of the shared mapping; the two data areas follow at SHM_DATA_OFFSET */
+typedef struct ShmHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ring_size;
+    ShmRing rings[2];
+} ShmHeader;
+
+#define SHM_DATA_OFFSET ((sizeof(ShmHeader) + SHM_CACHE_LINE - 1) / SHM_CACHE_LINE * SHM_CACHE_LINE)
+
+/* Internal channel structure - one process's view of the mapping */
+struct ShmChannel {
+    ShmHeader *shared;
+    size_t map_size;
+    size_t size;
+    size_t mask;
+    ShmRing *tx;
+    ShmRing *rx;
+    unsigned char *tx_data;
+    unsigned char *rx_data;
+    uint64_t tx_head; /* private copies: never read back from shared memory */
+    uint64_t rx_tail;
+    int memfd;
+    int wait_fd;      /* our doorbell */
+    int peer_fd;      /* the peer's doorbell */
+};
+
+static size_t map_size_for(size_t ring_size) {
+    return SHM_DATA_OFFSET + 2 * ring_size;
+}
+
+static void attach(ShmChannel *ch, int to_client) {
+    unsigned char *data = (unsigned char *)ch->shared + SHM_DATA_OFFSET;
+    int tx = to_client ? SHM_TO_CLIENT : SHM_TO_SERVER;
+    int rx = to_client ? SHM_TO_SERVER : SHM_TO_CLIENT;
+    ch->tx = &ch->shared->rings[tx];
+    ch->rx = &ch->shared->rings[rx];
+    ch->tx_data = data + (size_t)tx * ch->size;
+    ch->rx_data = data + (size_t)rx * ch->size;
+    ch->mask = ch->size - 1;
+}
+
+static ShmChannel *channel_new(void) {
+    ShmChannel *ch = calloc(1, sizeof(ShmChannel));
+    if (ch) {
+        ch->memfd = ch->wait_fd = ch->peer_fd = -1;
+    }
+    return ch;
+}
+
+ShmChannel *shm_create(size_t ring_size) {
+    if (ring_size < SHM_RING_MIN || ring_size > SHM_RING_MAX || (ring_size & (ring_size - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ShmChannel *ch = channel_new();
+    if (!ch) {
+        return NULL;
+    }
+    ch->size = ring_size;
+    ch->map_size = map_size_for(ring_size);
+    ch->memfd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ch->memfd < 0 || ftruncate(ch->memfd, (off_t)ch->map_size) < 0 ||
+        /* A client that could shrink the file would SIGBUS the server */
+        fcntl(ch->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        shm_destroy(ch);
+        return NULL;
+    }
+    void *map = mmap(NULL, ch->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if (map == MAP_FAILED) {
+        shm_destroy(ch);
+        return NULL;
+    }
+    ch->shared = map;
+    memcpy(ch->shared->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    ch->shared->version = SHM_VERSION;
+    ch->shared->ring_size = (uint32_t)ring_size;
+    ch->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ch->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->wait_fd < 0 || ch->peer_fd < 0) {
+        shm_destroy(ch);
+        return NULL;
+    }
+    attach(ch, 1);
+    return ch;
+}
+
+int shm_send(const ShmChannel *ch, int sock) {
+    int fds[SHM_FD_COUNT] = {ch->memfd, ch->peer_fd, ch->wait_fd};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    for (;;) {
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (n == 1) {
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+            if (poll(&pfd, 1, -1) >= 0 || errno == EINTR) {
+                continue;
+            }
+        }
+        return -1;
+    }
+}
+
+ShmChannel *shm_receive(int sock) {
+    int fds[SHM_FD_COUNT];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    ssize_t n;
+    while ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errno = EPROTO;
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    ShmChannel *ch = channel_new();
+    if (!ch) {
+        for (int i = 0; i < SHM_FD_COUNT; i++) {
+            close(fds[i]);
+        }
+        return NULL;
+    }
+    ch->memfd = fds[0];
+    ch->wait_fd = fds[1];
+    ch->peer_fd = fds[2];
+
+    struct stat st;
+    if (fstat(ch->memfd, &st) < 0 || (size_t)st.st_size < sizeof(ShmHeader)) {
+        shm_destroy(ch);
+        errno = EPROTO;
+        return NULL;
+    }
+    ch->map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, ch->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if (map == MAP_FAILED) {
+        shm_destroy(ch);
+        return NULL;
+    }
+    ch->shared = map;
+    ch->size = ch->shared->ring_size;
+    if (memcmp(ch->shared->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || ch->shared->version != SHM_VERSION ||
+        ch->size < SHM_RING_MIN || ch->size > SHM_RING_MAX || (ch->size & (ch->size - 1)) ||
+        map_size_for(ch->size) != ch->map_size) {
+        shm_destroy(ch);
+        errno = EPROTO;
+        return NULL;
+    }
+    attach(ch, 0);
+    return ch;
+}
+
+void shm_destroy(ShmChannel *ch) {
+    if (!ch) {
+        return;
+    }
+    if (ch->shared) {
+        munmap(ch->shared, ch->map_size);
+    }
+    if (ch->memfd >= 0) {
+        close(ch->memfd);
+    }
+    if (ch->wait_fd >= 0) {
+        close(ch->wait_fd);
+    }
+    if (ch->peer_fd >= 0) {
+        close(ch->peer_fd);
+    }
+    free(ch);
+}
+
+int shm_wait_fd(const ShmChannel *ch) {
+    return ch->wait_fd;
+}
+
+static void ring_doorbell(int fd) {
+    uint64_t one = 1;
+    ssize_t r = write(fd, &one, sizeof(one));
+    (void)r;
+}
+
+void shm_clear(ShmChannel *ch) {
+    uint64_t count;
+    ssize_t r = read(ch->wait_fd, &count, sizeof(count));
+    (void)r;
+}
+
+void shm_ring_self(ShmChannel *ch) {
+    ring_doorbell(ch->wait_fd);
+}
+
+/* Publish a new position, then wake the other side if it went to sleep before seeing it */
+static void publish(_Atomic uint64_t *pos, uint64_t value, _Atomic uint32_t *waiting, int peer_fd) {
+    atomic_store_explicit(pos, value, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) && atomic_exchange(waiting, 0)) {
+        ring_doorbell(peer_fd);
+    }
+}
+
+ssize_t shm_read(ShmChannel *ch, void *buf, size_t cap) {
+    uint64_t head = atomic_load_explicit(&ch->rx->head, memory_order_acquire);
+    uint64_t avail = head - ch->rx_tail;
+    if (avail > ch->size) {
+        return -1;
+    }
+    size_t n = avail < cap ? (size_t)avail : cap;
+    if (n == 0) {
+        return 0;
+    }
+    size_t off = (size_t)(ch->rx_tail & ch->mask);
+    size_t first = ch->size - off < n ? ch->size - off : n;
+    memcpy(buf, ch->rx_data + off, first);
+    memcpy((unsigned char *)buf + first, ch->rx_data, n - first);
+    ch->rx_tail += n;
+    publish(&ch->rx->tail, ch->rx_tail, &ch->rx->writer_waiting, ch->peer_fd);
+    return (ssize_t)n;
+}
+
+ssize_t shm_writev(ShmChannel *ch, const struct iovec *iov, int count) {
+    uint64_t tail = atomic_load_explicit(&ch->tx->tail, memory_order_acquire);
+    uint64_t used = ch->tx_head - tail;
+    if (used > ch->size) {
+        return -1;
+    }
+    size_t space = ch->size - (size_t)used;
+    size_t written = 0;
+    for (int i = 0; i < count && written < space; i++) {
+        size_t len = iov[i].iov_len < space - written ? iov[i].iov_len : space - written;
+        size_t off = (size_t)((ch->tx_head + written) & ch->mask);
+        size_t first = ch->size - off < len ? ch->size - off : len;
+        memcpy(ch->tx_data + off, iov[i].iov_base, first);
+        memcpy(ch->tx_data, (const unsigned char *)iov[i].iov_base + first, len - first);
+        written += len;
+    }
+    if (written > 0) {
+        ch->tx_head += written;
+        publish(&ch->tx->head, ch->tx_head, &ch->tx->reader_waiting, ch->peer_fd);
+    }
+    return (ssize_t)written;
+}
+
+ssize_t shm_write(ShmChannel *ch, const void *buf, size_t len) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    return shm_writev(ch, &iov, 1);
+}
+
+int shm_arm_readable(ShmChannel *ch) {
+    atomic_store(&ch->rx->reader_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&ch->rx->head, memory_order_acquire) != ch->rx_tail;
+}
+
+int shm_arm_writable(ShmChannel *ch) {
+    atomic_store(&ch->tx->writer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return ch->tx_head - atomic_load_explicit(&ch->tx->tail, memory_order_acquire) < ch->size;
+}
+
+int shm_wait(ShmChannel *ch, int sock) {
+    if (shm_arm_readable(ch)) {
+        return 1;
+    }
+    struct pollfd pfd[2] = {{.fd = ch->wait_fd, .events = POLLIN}, {.fd = sock, .events = POLLIN}};
+    if (poll(pfd, 2, -1) < 0) {
+        return errno == EINTR ? 1 : -1;
+    }
+    if (pfd[0].revents & POLLIN) {
+        shm_clear(ch);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define TW_ROOT_BITS 8
+#define TW_ROOT_SIZE (1u << TW_ROOT_BITS)
+#define TW_ROOT_MASK (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_BITS 6
+#define TW_LEVEL_SIZE (1u << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK (TW_LEVEL_SIZE - 1)
+#define TW_LEVELS 4 /* above the root: 256 ms, 16 s, 17 min, 18 h per slot */
+#define TW_MAX_SPAN ((1ull << (TW_ROOT_BITS + TW_LEVELS * TW_LEVEL_BITS)) - 1)
+#define TW_MAP_WORDS (TW_ROOT_SIZE / 64)
+
+/*
+ * Internal wheel structure - not exposed in header. 'now' is the next tick to
+ * process. The root wheel holds timers due within the current 256 ms window,
+ * with an occupancy bitmap so idle stretches are skipped instead of walked.
+ * Higher levels are cascaded down one slot at a time as the root wraps.
+ */
+struct TimerWheel {
+    uint64_t now;
+    size_t count;
+    uint64_t root_map[TW_MAP_WORDS];
+    Timer *root[TW_ROOT_SIZE];
+    Timer *levels[TW_LEVELS][TW_LEVEL_SIZE];
+};
+
+TimerWheel *tw_create(uint64_t now) {
+    TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+    if (!wheel) {
+        return NULL;
+    }
+    wheel->now = now;
+    return wheel;
+}
+
+void tw_destroy(TimerWheel *wheel) {
+    free(wheel);
+}
+
+void timer_init(Timer *timer, TimerFn fn) {
+    memset(timer, 0, sizeof(Timer));
+    timer->fn = fn;
+}
+
+int timer_pending(const Timer *timer) {
+    return timer->pprev != NULL;
+}
+
+static void link_timer(Timer **head, Timer *timer) {
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void place(TimerWheel *wheel, Timer *timer) {
+    uint64_t expires = timer->expires < wheel->now ? wheel->now : timer->expires;
+    uint64_t delta = expires - wheel->now;
+    if (delta > TW_MAX_SPAN) {
+        expires = wheel->now + TW_MAX_SPAN;
+        delta = TW_MAX_SPAN;
+    }
+    timer->expires = expires;
+
+    if (delta < TW_ROOT_SIZE) {
+        unsigned idx = (unsigned)(expires & TW_ROOT_MASK);
+        link_timer(&wheel->root[idx], timer);
+        wheel->root_map[idx / 64] |= 1ull << (idx % 64);
+        return;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= 1ull << (TW_ROOT_BITS + (level + 1) * TW_LEVEL_BITS)) {
+        level++;
+    }
+    unsigned idx = (unsigned)((expires >> (TW_ROOT_BITS + level * TW_LEVEL_BITS)) & TW_LEVEL_MASK);
+    link_timer(&wheel->levels[level][idx], timer);
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+
+    /* Keep the root bitmap exact so tw_next_timeout never reports an empty slot */
+    unsigned idx = (unsigned)(timer->expires & TW_ROOT_MASK);
+    if (!wheel->root[idx]) {
+        wheel->root_map[idx / 64] &= ~(1ull << (idx % 64));
+    }
+}
+
+void tw_schedule(TimerWheel *wheel, Timer *timer, uint64_t expires) {
+    if (timer_pending(timer)) {
+        tw_cancel(wheel, timer);
+    }
+    timer->expires = expires;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+void tw_cancel(TimerWheel *wheel, Timer *timer) {
+    if (!timer_pending(timer)) {
+        return;
+    }
+    unlink_timer(wheel, timer);
+    wheel->count--;
+}
+
+/* The root just wrapped: pull the next slot of each level down, stopping at
+ * the first level that has not wrapped itself. */
+static void cascade(TimerWheel *wheel) {
+    for (int level = 0; level < TW_LEVELS; level++) {
+        unsigned idx = (unsigned)((wheel->now >> (TW_ROOT_BITS + level * TW_LEVEL_BITS)) & TW_LEVEL_MASK);
+        Timer *list = wheel->levels[level][idx];
+        wheel->levels[level][idx] = NULL;
+        while (list) {
+            Timer *next = list->next;
+            list->next = NULL;
+            list->pprev = NULL;
+            place(wheel, list);
+            list = next;
+        }
+        if (idx != 0) {
+            break;
+        }
+    }
+}
+
+/* Distance from the root index idx to the next occupied root slot, or -1 */
+static int next_root_slot(const TimerWheel *wheel, unsigned idx) {
+    for (unsigned i = idx; i < TW_ROOT_SIZE;) {
+        uint64_t word = wheel->root_map[i / 64] >> (i % 64);
+        if (word) {
+            return (int)(i - idx) + __builtin_ctzll(word);
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+size_t tw_advance(TimerWheel *wheel, uint64_t now) {
+    size_t fired = 0;
+    while (wheel->now <= now) {
+        if (wheel->count == 0) {
+            wheel->now = now + 1;
+            break;
+        }
+        unsigned idx = (unsigned)(wheel->now & TW_ROOT_MASK);
+        if (idx == 0) {
+            cascade(wheel);
+        }
+
+        /* Skip straight to the next occupied slot or the next wrap */
+        int skip = next_root_slot(wheel, idx);
+        uint64_t target = skip < 0 ? (wheel->now | TW_ROOT_MASK) + 1 : wheel->now + (uint64_t)skip;
+        if (target != wheel->now) {
+            wheel->now = target <= now ? target : now + 1;
+            continue;
+        }
+
+        Timer *list = wheel->root[idx];
+        wheel->root[idx] = NULL;
+        wheel->root_map[idx / 64] &= ~(1ull << (idx % 64));
+        wheel->now++;
+        while (list) {
+            Timer *timer = list;
+            list = timer->next;
+            if (list) {
+                list->pprev = &list;
+            }
+            timer->next = NULL;
+            timer->pprev = NULL;
+            wheel->count--;
+            fired++;
+            timer->fn(timer, now);
+        }
+    }
+    return fired;
+}
+
+/* First tick at which tw_advance has work: an occupied root slot, or the
+ * cascade of the next occupied slot further up. May be early, never late. */
+static uint64_t next_event(const TimerWheel *wheel) {
+    if ((wheel->now & TW_ROOT_MASK) == 0) {
+        return wheel->now; /* a cascade is pending before the root can be trusted */
+    }
+    int skip = next_root_slot(wheel, (unsigned)(wheel->now & TW_ROOT_MASK));
+    if (skip >= 0) {
+        return wheel->now + (uint64_t)skip;
+    }
+    uint64_t base = (wheel->now | TW_ROOT_MASK) + 1; /* next cascade */
+    for (unsigned i = 0; i < TW_MAP_WORDS; i++) {
+        if (wheel->root_map[i]) {
+            return base; /* root timers behind the cursor are due in the next lap */
+        }
+    }
+    for (int level = 0; level < TW_LEVELS; level++) {
+        unsigned shift = TW_ROOT_BITS + (unsigned)level * TW_LEVEL_BITS;
+        unsigned idx = (unsigned)((base >> shift) & TW_LEVEL_MASK);
+        for (unsigned i = idx; i < TW_LEVEL_SIZE; i++) {
+            if (wheel->levels[level][i]) {
+                return base + ((uint64_t)(i - idx) << shift);
+            }
+        }
+        if (idx != 0) {
+            /* Earlier slots belong to the next lap; wake when this level wraps */
+            return base + ((uint64_t)(TW_LEVEL_SIZE - idx) << shift);
+        }
+    }
+    return base;
+}
+
+long tw_next_timeout(const TimerWheel *wheel, uint64_t now) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    uint64_t target = next_event(wheel);
+    return target > now ? (long)(target - now) : 0;
+}
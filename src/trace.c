@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_ID_SHIFT 40 /* ring number above, per-thread sequence below */
+#define TRACE_RETIRED_MAX 256 /* rings of exited threads kept for the next dump */
+
+/* Internal ring structure - written by its owning thread only. Event fields
+ * are relaxed atomics so a dump can copy them while the owner keeps going;
+ * head is published with release after each event is complete. */
+typedef struct TraceRing {
+    _Atomic uint64_t head;  /* events ever written */
+    uint64_t next_seq;      /* owner only */
+    uint64_t number;
+    size_t mask;
+    int retired;            /* owner exited; guarded by registry_mutex */
+    struct TraceSlot {
+        _Atomic uint64_t ts;
+        _Atomic uint64_t id;
+        _Atomic uint32_t stage;
+        _Atomic uint32_t shard;
+    } *events;
+    struct TraceRing *next;
+} TraceRing;
+
+static size_t ring_size = 0; /* 0 while tracing is off; set before threads start */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings = NULL;  /* guarded by registry_mutex */
+static uint64_t rings_made = 0;  /* guarded by registry_mutex */
+static size_t rings_retired = 0; /* guarded by registry_mutex */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local TraceRing *my_ring = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void free_ring(TraceRing *ring) {
+    free(ring->events);
+    free(ring);
+}
+
+/* Thread exit: the ring stays for later dumps, so short-lived client threads
+ * still show up; past TRACE_RETIRED_MAX the oldest retired ring is dropped. */
+static void retire_ring(void *arg) {
+    TraceRing *ring = arg;
+    TraceRing *dropped = NULL;
+    pthread_mutex_lock(&registry_mutex);
+    ring->retired = 1;
+    if (++rings_retired > TRACE_RETIRED_MAX) {
+        TraceRing **oldest = NULL;
+        for (TraceRing **pp = &rings; *pp; pp = &(*pp)->next) {
+            if ((*pp)->retired) {
+                oldest = pp;
+            }
+        }
+        dropped = *oldest;
+        *oldest = dropped->next;
+        rings_retired--;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    if (dropped) {
+        free_ring(dropped);
+    }
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, retire_ring);
+}
+
+static TraceRing *thread_ring(void) {
+    if (my_ring) {
+        return my_ring;
+    }
+    pthread_once(&key_once, make_key);
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (!ring) {
+        return NULL;
+    }
+    ring->events = calloc(ring_size, sizeof(*ring->events));
+    if (!ring->events) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = ring_size - 1;
+    pthread_mutex_lock(&registry_mutex);
+    ring->number = ++rings_made;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&registry_mutex);
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+int trace_init(size_t events_per_thread) {
+    if (events_per_thread == 0) {
+        return 0;
+    }
+    if (events_per_thread < 2 || events_per_thread > (1u << 30)) {
+        return -1;
+    }
+    size_t n = 2;
+    while (n < events_per_thread) {
+        n *= 2;
+    }
+    ring_size = n;
+    return 0;
+}
+
+int trace_enabled(void) {
+    return ring_size > 0;
+}
+
+uint64_t trace_next_id(void) {
+    if (!ring_size) {
+        return 0;
+    }
+    TraceRing *ring = thread_ring();
+    if (!ring) {
+        return 0;
+    }
+    return ring->number << TRACE_ID_SHIFT | (++ring->next_seq & ((1ull << TRACE_ID_SHIFT) - 1));
+}
+
+void trace_event(uint64_t id, TraceStage stage, uint32_t shard) {
+    if (id == 0 || !ring_size) {
+        return;
+    }
+    TraceRing *ring = thread_ring();
+    if (!ring) {
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct TraceSlot *slot = &ring->events[head & ring->mask];
+    atomic_store_explicit(&slot->ts, now_ns(), memory_order_relaxed);
+    atomic_store_explicit(&slot->id, id, memory_order_relaxed);
+    atomic_store_explicit(&slot->stage, (uint32_t)stage, memory_order_relaxed);
+    atomic_store_explicit(&slot->shard, shard, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void put_event(const struct TraceSlot *slot, TraceEvent *out) {
+    out->ts = atomic_load_explicit(&slot->ts, memory_order_relaxed);
+    out->id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+    out->stage = atomic_load_explicit(&slot->stage, memory_order_relaxed);
+    out->shard = atomic_load_explicit(&slot->shard, memory_order_relaxed);
+}
+
+/* Copy one ring, then drop whatever its owner overwrote while we were copying */
+static size_t copy_ring(const TraceRing *ring, TraceEvent *out) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head > ring_size ? head - ring_size : 0;
+    for (uint64_t i = first; i < head; i++) {
+        put_event(&ring->events[i & ring->mask], &out[i - first]);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t valid = after > ring_size ? after - ring_size : 0;
+    if (valid <= first) {
+        return (size_t)(head - first);
+    }
+    if (valid >= head) {
+        return 0;
+    }
+    size_t skip = (size_t)(valid - first);
+    memmove(out, out + skip, (size_t)(head - valid) * sizeof(TraceEvent));
+    return (size_t)(head - valid);
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+int trace_dump(const char *path) {
+    if (!ring_size) {
+        return -1;
+    }
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    FILE *fp = fopen(tmp, "wb");
+    TraceEvent *events = malloc(ring_size * sizeof(TraceEvent));
+    if (!fp || !events) {
+        if (fp) {
+            fclose(fp);
+        }
+        free(events);
+        return -1;
+    }
+
+    /* The count in the header is patched in once every ring has been written */
+    unsigned char header[TRACE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    put_u32(header + 8, TRACE_VERSION);
+    put_u32(header + 12, (uint32_t)sizeof(TraceEvent));
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+    uint64_t total = 0;
+    pthread_mutex_lock(&registry_mutex);
+    for (TraceRing *ring = rings; ring && ok; ring = ring->next) {
+        size_t n = copy_ring(ring, events);
+        ok = fwrite(events, sizeof(TraceEvent), n, fp) == n;
+        total += n;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(events);
+
+    put_u64(header + 16, total);
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void trace_shutdown(void) {
+    pthread_mutex_lock(&registry_mutex);
+    TraceRing *ring = rings;
+    rings = NULL;
+    rings_retired = 0;
+    pthread_mutex_unlock(&registry_mutex);
+    while (ring) {
+        TraceRing *next = ring->next;
+        free_ring(ring);
+        ring = next;
+    }
+    if (my_ring) {
+        pthread_setspecific(ring_key, NULL);
+        my_ring = NULL;
+    }
+}
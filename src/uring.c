@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define URING_BUF_GROUP 0
+#define URING_PROBE_OPS 256
+
+/* Internal ring structure - the kernel's queues as mapped into this process */
+struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; /* prepared so far; published to *sq_tail on submit */
+    unsigned cq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *bufs;
+    size_t bufs_size;
+    unsigned char *buf_mem;
+    uint16_t buf_tail;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+static unsigned load_acquire(unsigned *p) {
+    return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+    atomic_store_explicit((_Atomic unsigned *)p, v, memory_order_release);
+}
+
+int uring_probe(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_setup(4, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    struct io_uring_probe *probe =
+        calloc(1, sizeof(struct io_uring_probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+    int rc = probe && sys_register(fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0 ? 0 : -1;
+    /* Multishot recv has no opcode of its own; it arrived in the same kernel as SEND_ZC */
+    static const unsigned needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ,
+                                      IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC};
+    for (size_t i = 0; rc == 0 && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            rc = -1;
+        }
+    }
+    if (rc == 0 && !(params.features & IORING_FEAT_NODROP)) {
+        errno = EOPNOTSUPP;
+        rc = -1;
+    }
+    int saved = errno;
+    free(probe);
+    close(fd);
+    errno = saved;
+    if (rc < 0) {
+        return -1;
+    }
+    /* Provided buffer rings came later than the opcodes; try a real one */
+    Uring *ring = uring_create(4);
+    if (!ring) {
+        return -1;
+    }
+    uring_destroy(ring);
+    return 0;
+}
+
+static void provide_buffer(Uring *ring, uint16_t bid) {
+    struct io_uring_buf *buf = &ring->bufs->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buf_mem + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&ring->bufs->tail, ring->buf_tail, memory_order_release);
+}
+
+static int map_queues(Uring *ring, const struct io_uring_params *params) {
+    ring->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        return -1;
+    }
+    ring->cq_map = ring->sq_map;
+    if (ring->cq_map_size > 0) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_map;
+    unsigned char *cq = ring->cq_map;
+    ring->sq_entries = params->sq_entries;
+    ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params->sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+    return 0;
+}
+
+static int setup_buffers(Uring *ring) {
+    ring->bufs_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    ring->bufs = mmap(NULL, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        return -1;
+    }
+    ring->buf_mem = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!ring->buf_mem) {
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufs;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) {
+        provide_buffer(ring, (uint16_t)i);
+    }
+    return 0;
+}
+
+Uring *uring_create(unsigned entries) {
+    Uring *ring = calloc(1, sizeof(Uring));
+    if (!ring) {
+        return NULL;
+    }
+    /* Every client has a recv and maybe a send outstanding, so leave the CQ room to spare */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0 || map_queues(ring, &params) < 0 || setup_buffers(ring) < 0) {
+        int saved = errno;
+        uring_destroy(ring);
+        errno = saved;
+        return NULL;
+    }
+    return ring;
+}
+
+void uring_destroy(Uring *ring) {
+    if (!ring) {
+        return;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->bufs) {
+        munmap(ring->bufs, ring->bufs_size);
+    }
+    free(ring->buf_mem);
+    free(ring);
+}
+
+/* A cleared SQE; a full queue is handed to the kernel first, without waiting */
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    if (ring->sqe_tail - load_acquire(ring->sq_head) == ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0) < 0 || ring->sqe_tail - load_acquire(ring->sq_head) == ring->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned idx = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_prep_accept(Uring *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_recv(Uring *ring, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_sendmsg(Uring *ring, int fd, const struct msghdr *mh, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)mh;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_read(Uring *ring, int fd, void *buf, size_t len, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_prep_cancel(Uring *ring, uint64_t target, uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    store_release(ring->sq_tail, ring->sqe_tail);
+    unsigned pending = ring->sqe_tail - load_acquire(ring->sq_head);
+    int rc = sys_enter(ring->fd, pending, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0 && (errno == EINTR || errno == EBUSY)) {
+        return 0; /* interrupted, or completions must be reaped first */
+    }
+    return rc;
+}
+
+size_t uring_reap(Uring *ring, UringCompletion *out, size_t max) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = load_acquire(ring->cq_tail);
+    size_t n = 0;
+    while (head != tail && n < max) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+        out[n].data = cqe->user_data;
+        out[n].res = cqe->res;
+        out[n].flags = cqe->flags;
+        head++;
+        n++;
+    }
+    store_release(ring->cq_head, head);
+    return n;
+}
+
+int uring_more(const UringCompletion *cqe) {
+    return (cqe->flags & IORING_CQE_F_MORE) != 0;
+}
+
+const void *uring_buffer(const Uring *ring, const UringCompletion *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return NULL;
+    }
+    return ring->buf_mem + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE;
+}
+
+void uring_recycle(Uring *ring, const UringCompletion *cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        provide_buffer(ring, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+}
@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "userindex.h"
+
+#define UI_MIN_SLOTS 64
+
+/* Internal slot - not exposed in header. value == NULL marks an empty slot,
+ * value == &tombstone a deleted one, so probe chains stay intact. */
+typedef struct Slot {
+    uint32_t hash;
+    void *value;
+    char name[USERNAME_MAX];
+} Slot;
+
+/* Internal index structure - linear probing over a power-of-two table */
+struct UserIndex {
+    Slot *slots;
+    size_t mask;
+    size_t count;
+    size_t used; /* live entries plus tombstones */
+};
+
+static char tombstone;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < USERNAME_MAX && name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int is_live(const Slot *slot) {
+    return slot->value != NULL && slot->value != &tombstone;
+}
+
+static int alloc_slots(UserIndex *index, size_t n) {
+    index->slots = calloc(n, sizeof(Slot));
+    if (!index->slots) {
+        return -1;
+    }
+    index->mask = n - 1;
+    index->count = 0;
+    index->used = 0;
+    return 0;
+}
+
+UserIndex *ui_create(size_t expected) {
+    UserIndex *index = malloc(sizeof(UserIndex));
+    if (!index) {
+        return NULL;
+    }
+    size_t n = UI_MIN_SLOTS;
+    while (n < expected * 2) {
+        n *= 2;
+    }
+    if (alloc_slots(index, n) < 0) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* Live slot holding name, or NULL */
+static Slot *find(const UserIndex *index, const char *name, uint32_t hash) {
+    for (size_t i = hash & index->mask;; i = (i + 1) & index->mask) {
+        Slot *slot = &index->slots[i];
+        if (slot->value == NULL) {
+            return NULL;
+        }
+        if (slot->value != &tombstone && slot->hash == hash &&
+            strncmp(slot->name, name, USERNAME_MAX) == 0) {
+            return slot;
+        }
+    }
+}
+
+static void place(UserIndex *index, uint32_t hash, const char *name, void *value) {
+    size_t i = hash & index->mask;
+    while (is_live(&index->slots[i])) {
+        i = (i + 1) & index->mask;
+    }
+    Slot *slot = &index->slots[i];
+    if (slot->value == NULL) {
+        index->used++;
+    }
+    slot->hash = hash;
+    slot->value = value;
+    strncpy(slot->name, name, USERNAME_MAX - 1);
+    slot->name[USERNAME_MAX - 1] = '\0';
+    index->count++;
+}
+
+/* Rebuild at a size that keeps the load factor under 1/2; also clears tombstones. */
+static int rehash(UserIndex *index) {
+    Slot *old = index->slots;
+    size_t old_n = index->mask + 1;
+    size_t n = old_n;
+    while (index->count * 2 >= n) {
+        n *= 2;
+    }
+    if (alloc_slots(index, n) < 0) {
+        index->slots = old;
+        index->mask = old_n - 1;
+        return -1;
+    }
+    for (size_t i = 0; i < old_n; i++) {
+        if (is_live(&old[i])) {
+            place(index, old[i].hash, old[i].name, old[i].value);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+int ui_insert(UserIndex *index, const char *name, void *value) {
+    uint32_t hash = hash_name(name);
+    if (!value || find(index, name, hash)) {
+        return -1;
+    }
+    if ((index->used + 1) * 10 > (index->mask + 1) * 7 && rehash(index) < 0) {
+        return -1;
+    }
+    place(index, hash, name, value);
+    return 0;
+}
+
+void *ui_lookup(const UserIndex *index, const char *name) {
+    Slot *slot = find(index, name, hash_name(name));
+    return slot ? slot->value : NULL;
+}
+
+int ui_remove(UserIndex *index, const char *name, const void *value) {
+    Slot *slot = find(index, name, hash_name(name));
+    if (!slot || slot->value != value) {
+        return -1;
+    }
+    slot->value = &tombstone;
+    index->count--;
+    return 0;
+}
+
+size_t ui_count(const UserIndex *index) {
+    return index->count;
+}
+
+void ui_destroy(UserIndex *index) {
+    if (!index) {
+        return;
+    }
+    free(index->slots);
+    free(index);
+}
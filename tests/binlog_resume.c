@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binlog.h"
+#include "chat.h"
+
+/*
+ * A crash right after a roll leaves the newest segment with a header and no
+ * records, or with less than a header. Reopening must carry on from seq 3
+ * instead of numbering from 1 again or refusing to open.
+ */
+
+static int fail(const char *what) {
+    fprintf(stderr, "binlog_resume: %s\n", what);
+    return EXIT_FAILURE;
+}
+
+/* Cut the third segment to len bytes, reopen, and check that the next record is seq 3 */
+static int reopen_after_cut(const char *prefix, off_t len, const ChatMessage *msgs) {
+    char path[BINLOG_PATH_MAX];
+    binlog_segment_path(prefix, 2, path, sizeof(path));
+    if (truncate(path, len) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    int rc = EXIT_SUCCESS;
+    BinLog *log = binlog_open(prefix, 1);
+    if (!log) {
+        fprintf(stderr, "binlog_resume: could not reopen after a cut to %lld bytes\n", (long long)len);
+        return EXIT_FAILURE;
+    }
+    if (binlog_last_seq(log) != 2) {
+        fprintf(stderr, "binlog_resume: reopened at seq %llu, want 2\n", (unsigned long long)binlog_last_seq(log));
+        rc = EXIT_FAILURE;
+    } else if (binlog_append(log, msgs, 1) < 0 || binlog_last_seq(log) != 3) {
+        rc = fail("the next record did not get seq 3");
+    }
+    binlog_close(log);
+    return rc;
+}
+
+int main(void) {
+    char dir[] = "/tmp/binlog_resume.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char prefix[BINLOG_PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s/chat.log", dir);
+
+    /* A segment size of 1 puts every record in a segment of its own */
+    ChatMessage msgs[3];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < 3; i++) {
+        snprintf(msgs[i].sender, USERNAME_MAX, "alice");
+        snprintf(msgs[i].text, TEXT_MAX, "message %d", i + 1);
+    }
+    BinLog *log = binlog_open(prefix, 1);
+    if (!log || binlog_append(log, msgs, 3) < 0) {
+        return fail("could not write the log");
+    }
+    binlog_close(log);
+
+    /* A header with no records, then a header cut short, then an empty file */
+    static const off_t cuts[] = {BINLOG_HEADER_SIZE, 7, 0};
+    int rc = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]) && rc == EXIT_SUCCESS; i++) {
+        rc = reopen_after_cut(prefix, cuts[i], msgs);
+    }
+
+    char path[BINLOG_PATH_MAX];
+    for (unsigned i = 0; binlog_segment_path(prefix, i, path, sizeof(path)) == 0 && unlink(path) == 0; i++) {
+    }
+    rmdir(dir);
+    if (rc == EXIT_SUCCESS) {
+        printf("binlog_resume: ok\n");
+    }
+    return rc;
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Prints the value of one counter or gauge from a server's --admin socket */
+
+#define METRIC_REPORT_MAX (256 * 1024)
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s ADMIN_PATH NAME\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[1]);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (write(fd, "text\n", 5) != 5) {
+        perror("write");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    char *report = malloc(METRIC_REPORT_MAX);
+    if (!report) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t len = 0;
+    ssize_t n;
+    while (len < METRIC_REPORT_MAX - 1 && (n = read(fd, report + len, METRIC_REPORT_MAX - 1 - len)) > 0) {
+        len += (size_t)n;
+    }
+    report[len] = '\0';
+    close(fd);
+
+    /* Lines are "counter NAME VALUE" or "gauge NAME VALUE" */
+    int rc = EXIT_FAILURE;
+    char kind[16];
+    char name[128];
+    unsigned long long value;
+    for (char *line = strtok(report, "\n"); line; line = strtok(NULL, "\n")) {
+        if (sscanf(line, "%15s %127s %llu", kind, name, &value) == 3 && strcmp(name, argv[2]) == 0) {
+            printf("%llu\n", value);
+            rc = EXIT_SUCCESS;
+            break;
+        }
+    }
+    if (rc != EXIT_SUCCESS) {
+        fprintf(stderr, "%s: no metric %s\n", argv[1], argv[2]);
+    }
+    free(report);
+    return rc;
+}